@@ -1,6 +1,12 @@
 #ifndef FILE_LIST_H
 #define FILE_LIST_H
 
-int PrintFileNameList(int out_fd, const char *dir_name);
-int PrintFileFullList(int out_fd, const char *dir_name);
+#include "ftp_buffer.h"
+
+/* PrintFileFullList() flag: list entries as they are read, unsorted */
+#define FILE_LIST_UNSORTED 1
+
+void SetFileListLimits(int max_sorted, int stream, int spill_dir_fd);
+int PrintFileNameList(FtpBuffer *out, const char *dir_name);
+int PrintFileFullList(FtpBuffer *out, const char *dir_name, int flags);
 #endif /* FILE_LIST_H */
@@ -0,0 +1,114 @@
+#include "ftp_buffer.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+
+static int Grow(FtpBuffer *b, int n);
+
+int FtpBufferInit(FtpBuffer *b, int fd, int size) {
+  assert(b != NULL);
+  assert(size > 0);
+
+  b->data = (char *)malloc(size);
+  if (b->data == NULL) {
+    return 0;
+  }
+  b->len = 0;
+  b->size = size;
+  b->fd = fd;
+  b->hold = 0;
+  b->written = 0;
+  b->error = 0;
+  b->flushed = NULL;
+  b->arg = NULL;
+
+  return 1;
+}
+
+/* make room for n more bytes, writing out what's buffered first if */
+/* there is a descriptor; returns NULL on error                     */
+char *FtpBufferReserve(FtpBuffer *b, int n) {
+  assert(n >= 0);
+
+  if (b->error != 0) {
+    return NULL;
+  }
+  if ((b->len + n > b->size) && (b->fd != -1) &&
+      ((b->written > 0) || (b->len + n > b->hold))) {
+    if (!FtpBufferFlush(b)) {
+      return NULL;
+    }
+  }
+  if ((b->len + n > b->size) && !Grow(b, n)) {
+    return NULL;
+  }
+
+  return b->data + b->len;
+}
+
+int FtpBufferAppend(FtpBuffer *b, const char *s, int n) {
+  char *p;
+
+  p = FtpBufferReserve(b, n);
+  if (p == NULL) {
+    return 0;
+  }
+  memcpy(p, s, n);
+  FtpBufferCommit(b, n);
+
+  return 1;
+}
+
+/* write out everything buffered */
+int FtpBufferFlush(FtpBuffer *b) {
+  int amt_written, write_ret;
+
+  assert(b->fd != -1);
+
+  amt_written = 0;
+  while ((b->error == 0) && (amt_written < b->len)) {
+    write_ret = write(b->fd, b->data + amt_written, b->len - amt_written);
+    if (write_ret > 0) {
+      amt_written += write_ret;
+      b->written += write_ret;
+      if (b->flushed != NULL) {
+        b->flushed(b->arg);
+      }
+    } else if ((write_ret == -1) && (errno != EINTR)) {
+      b->error = errno;
+    } else if (write_ret == 0) {
+      b->error = EPIPE;
+    }
+  }
+  b->len = 0;
+
+  return (b->error == 0);
+}
+
+void FtpBufferDestroy(FtpBuffer *b) {
+  free(b->data);
+  b->data = NULL;
+  b->len = b->size = 0;
+}
+
+/* at least double the size, so appends stay linear overall */
+static int Grow(FtpBuffer *b, int n) {
+  char *data;
+  int size;
+
+  size = b->size * 2;
+  if (size < b->len + n) {
+    size = b->len + n;
+  }
+  data = (char *)realloc(b->data, size);
+  if (data == NULL) {
+    b->error = ENOMEM;
+    return 0;
+  }
+  b->data = data;
+  b->size = size;
+
+  return 1;
+}
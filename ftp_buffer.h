@@ -0,0 +1,41 @@
+#ifndef FTP_BUFFER_H
+#define FTP_BUFFER_H
+
+/* size data connection output is collected up to before it is written */
+#define FTP_BUFFER_SIZE (64 * 1024)
+
+/* output buffer turning many small appends into a few large writes; */
+/* without a descriptor it just grows, to hold rendered output        */
+typedef struct {
+  char *data;
+  int len;
+  int size;
+
+  /* descriptor written to when the buffer fills, or -1 */
+  int fd;
+
+  /* with a descriptor, how far the buffer may grow before the first */
+  /* write, so short output can still be kept whole (set back to 0   */
+  /* by a producer whose output shouldn't be); and how much has been */
+  /* written                                                         */
+  int hold;
+  long written;
+
+  /* errno of the first failed write, 0 if none */
+  int error;
+
+  /* called after every write, e.g. to note transfer progress */
+  void (*flushed)(void *arg);
+  void *arg;
+} FtpBuffer;
+
+int FtpBufferInit(FtpBuffer *b, int fd, int size);
+char *FtpBufferReserve(FtpBuffer *b, int n);
+int FtpBufferAppend(FtpBuffer *b, const char *s, int n);
+int FtpBufferFlush(FtpBuffer *b);
+void FtpBufferDestroy(FtpBuffer *b);
+
+/* add n bytes written to the space FtpBufferReserve() returned */
+#define FtpBufferCommit(b, n) ((b)->len += (n))
+
+#endif /* FTP_BUFFER_H */
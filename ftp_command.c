@@ -9,6 +9,9 @@
 #include <netdb.h>
 #include <assert.h>
 
+#include "ftp_command_handler.h"
+#include "ftp_log.h"
+
 /* argument types */
 #define ARG_NONE              0
 #define ARG_STRING            1
@@ -19,95 +22,110 @@
 #define ARG_MODE              6
 #define ARG_OFFSET            7
 
-/* FTP commands syntax define */
-struct {
-  char *name;
-  int arg_type;
-} command_def[] = {
-  { "AUTH", ARG_STRING          },
-  { "USER", ARG_STRING          },
-  { "PASS", ARG_STRING          },
-  { "CWD",  ARG_STRING          },
-  { "CDUP", ARG_NONE            },
-  { "QUIT", ARG_NONE            },
-  { "PORT", ARG_HOST_PORT       },
-  { "PASV", ARG_NONE            },
-  { "TYPE", ARG_TYPE            },
-  { "STRU", ARG_STRUCTURE       },
-  { "MODE", ARG_MODE            },
-  { "RETR", ARG_STRING          },
-  { "STOR", ARG_STRING          },
-  { "PWD",  ARG_NONE            },
-  { "LIST", ARG_OPTIONAL_STRING },
-  { "NLST", ARG_OPTIONAL_STRING },
-  { "SYST", ARG_NONE            },
-  { "HELP", ARG_OPTIONAL_STRING },
-  { "NOOP", ARG_NONE            },
-  { "REST", ARG_OFFSET          },
-  { "SIZE", ARG_STRING          },
-  { "MDTM", ARG_STRING          }
+/* pack the case-folded verb, NUL padded, into 32 bits */
+#define COMMAND_KEY(a, b, c, d) \
+  (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | \
+   ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+/* multiplicative hash, perfect over the verbs of RFC 959, RFC 775   */
+/* (XCUP XCWD XMKD XPWD XRMD), RFC 2228 (AUTH ADAT PROT PBSZ CCC MIC  */
+/* CONF ENC), RFC 2389 (FEAT OPTS), RFC 2428 (EPRT EPSV), RFC 2640    */
+/* (LANG), RFC 3659 (MDTM SIZE MLST MLSD) and RFC 7151 (HOST), so any */
+/* of them can be added without a collision; any other verb must be   */
+/* checked, though a slot used twice fails the build, as the Makefile */
+/* makes -Woverride-init an error                                     */
+#define COMMAND_SLOTS 128
+#define COMMAND_SLOT(key) \
+  ((uint32_t)((uint32_t)(key) * 0xcf6f6b2fU) >> 25)
+
+#define COMMAND(a, b, c, d, arg_type, func, flags) \
+  [COMMAND_SLOT(COMMAND_KEY(a, b, c, d))] = \
+    { COMMAND_KEY(a, b, c, d), arg_type, func, flags }
+
+/* FTP commands syntax, handlers and flags, indexed by COMMAND_SLOT() */
+static const FtpCommandDef command_def[COMMAND_SLOTS] = {
+  COMMAND('a','u','t','h', ARG_STRING,          NULL,   0),
+  COMMAND('u','s','e','r', ARG_STRING,          DoUser, 0),
+  COMMAND('p','a','s','s', ARG_STRING,          DoPass, 0),
+  COMMAND('c','w','d', 0,  ARG_STRING,          DoCwd,  COMMAND_LOGIN),
+  COMMAND('c','d','u','p', ARG_NONE,            DoCdup, COMMAND_LOGIN),
+  COMMAND('q','u','i','t', ARG_NONE,            DoQuit, 0),
+  COMMAND('p','o','r','t', ARG_HOST_PORT,       DoPort, COMMAND_LOGIN),
+  COMMAND('p','a','s','v', ARG_NONE,            DoPasv, COMMAND_LOGIN),
+  COMMAND('t','y','p','e', ARG_TYPE,            DoType, COMMAND_LOGIN),
+  COMMAND('s','t','r','u', ARG_STRUCTURE,       DoStru, COMMAND_LOGIN),
+  COMMAND('m','o','d','e', ARG_MODE,            DoMode, COMMAND_LOGIN),
+  COMMAND('r','e','t','r', ARG_STRING,          DoRetr, COMMAND_LOGIN |
+                                                        COMMAND_BLOCKS),
+  COMMAND('s','t','o','r', ARG_STRING,          DoStor, COMMAND_LOGIN),
+  COMMAND('p','w','d', 0,  ARG_NONE,            DoPwd,  COMMAND_LOGIN),
+  COMMAND('l','i','s','t', ARG_OPTIONAL_STRING, DoList, COMMAND_LOGIN |
+                                                        COMMAND_BLOCKS),
+  COMMAND('n','l','s','t', ARG_OPTIONAL_STRING, DoNlst, COMMAND_LOGIN |
+                                                        COMMAND_BLOCKS),
+  COMMAND('s','y','s','t', ARG_NONE,            NULL,   0),
+  COMMAND('h','e','l','p', ARG_OPTIONAL_STRING, NULL,   0),
+  COMMAND('n','o','o','p', ARG_NONE,            DoNoop, 0),
+  COMMAND('r','e','s','t', ARG_OFFSET,          DoRest, COMMAND_LOGIN),
+  COMMAND('s','i','z','e', ARG_STRING,          DoSize, COMMAND_LOGIN),
+  COMMAND('m','d','t','m', ARG_STRING,          DoMdtm, COMMAND_LOGIN)
 };
 
-static const int kCommandNum = sizeof(command_def) / sizeof(command_def[0]);
+/* invocation counts and time spent, in the same slots as command_def */
+static struct {
+  unsigned long count;
+  unsigned long nsec;
+} command_stats[COMMAND_SLOTS];
 
 /* prototypes */
-static const char *CopyLine(char *dst, const char *src);
+static void CommandName(uint32_t key, char *name);
+static const char *ViewLine(FtpCommand *cmd, int n, const char *src);
 static const char *ParseHostPort(struct sockaddr_in *addr, const char *s);
 static const char *ParseNumber(int *num, const char *s, int max_num);
 static const char *ParseOffset(off_t *ofs, const char *s);
 
-int FtpCommandParse(const char *input, FtpCommand *cmd) {
-  int i, len, match;
-  FtpCommand tmp;
+int FtpCommandParse(char *line, FtpCommand *cmd) {
+  const char *input;
   int c;
-  const char *optional_number;
 
-  assert(input != NULL);
+  assert(line != NULL);
   assert(cmd != NULL);
 
   /* see if our input starts with a valid command */
-  match = -1;
-  for (i = 0; (i < kCommandNum) && (match == -1); ++i) {
-    len = strlen(command_def[i].name);
-    if (strncasecmp(input, command_def[i].name, len) == 0) {
-      match = i;
-    }
-  }
+  cmd->def = FtpCommandLookup(line);
 
   /* if we didn't find a match, return error */
-  if (match == -1) {
+  if (cmd->def == NULL) {
     return COMMAND_UNRECOGNIZED;
   }
 
-  assert(match >= 0);
-  assert(match < kCommandNum);
-
   /* copy our command */
-  strcpy(tmp.command, command_def[match].name);
+  CommandName(cmd->def->key, cmd->command);
 
   /* advance input past the command */
-  input += strlen(command_def[match].name);
+  cmd->line = line;
+  input = line + strlen(cmd->command);
 
   /* now act based on the command */
-  switch (command_def[match].arg_type) {
+  switch (cmd->def->arg_type) {
     case ARG_NONE:
-      tmp.num_arg = 0;
+      cmd->num_arg = 0;
       break;
     case ARG_STRING:
       if (*input != ' ') {
         goto Parameter_Error;
       }
       ++input;
-      input = CopyLine(tmp.arg[0].string, input);
-      tmp.num_arg = 1;
+      input = ViewLine(cmd, 0, input);
+      cmd->num_arg = 1;
       break;
     case ARG_OPTIONAL_STRING:
       if (*input == ' ') {
         ++input;
-        input = CopyLine(tmp.arg[0].string, input);
-        tmp.num_arg = 1;
+        input = ViewLine(cmd, 0, input);
+        cmd->num_arg = 1;
       } else {
-        tmp.num_arg = 0;
+        cmd->num_arg = 0;
       }
       break;
     case ARG_HOST_PORT:
@@ -116,11 +134,11 @@ int FtpCommandParse(const char *input, FtpCommand *cmd) {
       }
       input++;
       /* parse the host & port information (if any) */
-      input = ParseHostPort(&tmp.arg[0].host_port, input);
+      input = ParseHostPort(&cmd->host_port, input);
       if (input == NULL) {
         goto Parameter_Error;
       }
-      tmp.num_arg = 1;
+      cmd->num_arg = 1;
       break;
     case ARG_TYPE:
       if (*input != ' ') {
@@ -130,8 +148,7 @@ int FtpCommandParse(const char *input, FtpCommand *cmd) {
 
       c = toupper(*input);
       if ((c == 'A') || (c == 'E')) {
-        tmp.arg[0].string[0] = c;
-        tmp.arg[0].string[1] = '\0';
+        cmd->code[0] = c;
         input++;
         if (*input == ' ') {
           input++;
@@ -139,27 +156,25 @@ int FtpCommandParse(const char *input, FtpCommand *cmd) {
           if ((c != 'N') && (c != 'T') && (c != 'C')) {
             goto Parameter_Error;
           }
-          tmp.arg[1].string[0] = c;
-          tmp.arg[1].string[1] = '\0';
+          cmd->code[1] = c;
           input++;
-          tmp.num_arg = 2;
+          cmd->num_arg = 2;
         } else {
-          tmp.num_arg = 1;
+          cmd->num_arg = 1;
         }
       } else if (c == 'I') {
-        tmp.arg[0].string[0] = 'I';
-        tmp.arg[0].string[1] = '\0';
+        cmd->code[0] = 'I';
         input++;
-        tmp.num_arg = 1;
+        cmd->num_arg = 1;
       } else if (c == 'L') {
-        tmp.arg[0].string[0] = 'L';
-        tmp.arg[0].string[1] = '\0';
+        cmd->code[0] = 'L';
+        cmd->code[1] = '\0';
         input++;
-        input = ParseNumber(&tmp.arg[1].num, input, 255);
+        input = ParseNumber(&cmd->num, input, 255);
         if (input == NULL) {
           goto Parameter_Error;
         }
-        tmp.num_arg = 2;
+        cmd->num_arg = 2;
       } else {
         goto Parameter_Error;
       }
@@ -174,9 +189,8 @@ int FtpCommandParse(const char *input, FtpCommand *cmd) {
         goto Parameter_Error;
       }
       input++;
-      tmp.arg[0].string[0] = c;
-      tmp.arg[0].string[1] = '\0';
-      tmp.num_arg = 1;
+      cmd->code[0] = c;
+      cmd->num_arg = 1;
       break;
     case ARG_MODE:
       if (*input != ' ') {
@@ -188,50 +202,107 @@ int FtpCommandParse(const char *input, FtpCommand *cmd) {
         goto Parameter_Error;
       }
       input++;
-      tmp.arg[0].string[0] = c;
-      tmp.arg[0].string[1] = '\0';
-      tmp.num_arg = 1;
+      cmd->code[0] = c;
+      cmd->num_arg = 1;
       break;
     case ARG_OFFSET:
       if (*input != ' ') {
         goto Parameter_Error;
       }
       input++;
-      input = ParseOffset(&tmp.arg[0].offset, input);
+      input = ParseOffset(&cmd->offset, input);
       if (input == NULL) {
         goto Parameter_Error;
       }
-      tmp.num_arg = 1;
+      cmd->num_arg = 1;
       break;
     default:
       assert(0);
   }
 
   /* check for our ending newline */
-  if (*input != '\n') {
+  if ((input == NULL) || (*input != '\n')) {
 Parameter_Error:
     return COMMAND_PARAMETERS_ERROR;
   }
 
-  /* return our result */
-  *cmd = tmp;
+  /* end the line here, so a string argument can be used in place */
+  line[input - line] = '\0';
   return 0;
 }
 
-/* copy a string terminated with a newline */
-static const char *CopyLine(char *dst, const char *src) {
-  int i = 0;
+/* find the command a line starts with, NULL if there is none */
+const FtpCommandDef *FtpCommandLookup(const char *input) {
+  const FtpCommandDef *def;
+  uint32_t key;
+  int i;
 
-  assert(dst != NULL);
+  /* a verb is three or four letters */
+  key = 0;
+  for (i = 0; (i < 4) && isalpha((unsigned char)input[i]); ++i) {
+    key |= (uint32_t)(input[i] | 0x20) << (24 - 8 * i);
+  }
+  if ((i < 3) || isalpha((unsigned char)input[i])) {
+    return NULL;
+  }
+
+  def = &command_def[COMMAND_SLOT(key)];
+  return (def->key == key) ? def : NULL;
+}
+
+/* count a run of the command, and the nanoseconds it took */
+void FtpCommandRecord(const FtpCommandDef *def, unsigned long nsec) {
+  int slot;
+
+  slot = def - command_def;
+  __atomic_fetch_add(&command_stats[slot].count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&command_stats[slot].nsec, nsec, __ATOMIC_RELAXED);
+}
+
+/* log the counters of every command that has been run */
+void FtpCommandReport(void) {
+  unsigned long count, nsec;
+  char name[5];
+  int i;
+
+  for (i = 0; i < COMMAND_SLOTS; ++i) {
+    count = __atomic_load_n(&command_stats[i].count, __ATOMIC_RELAXED);
+    nsec = __atomic_load_n(&command_stats[i].nsec, __ATOMIC_RELAXED);
+    if (count > 0) {
+      CommandName(command_def[i].key, name);
+      FtpLog(LOG_INFO, "command %s: %lu calls, %lu us total, %lu us average",
+             name, count, nsec / 1000, nsec / 1000 / count);
+    }
+  }
+}
+
+/* unpack a key into the upper case verb */
+static void CommandName(uint32_t key, char *name) {
+  int i;
+
+  for (i = 0; i < 4; ++i) {
+    name[i] = toupper((key >> (24 - 8 * i)) & 0xFF);
+  }
+  name[4] = '\0';
+}
+
+/* point an argument at the rest of the line, up to its newline; */
+/* returns NULL if it is too long to be a path                     */
+static const char *ViewLine(FtpCommand *cmd, int n, const char *src) {
+  const char *end;
+
+  assert(cmd != NULL);
   assert(src != NULL);
 
-  while (i <= MAX_STRING_LEN && src[i] != '\0' && src[i] != '\n') {
-    dst[i] = src[i];
-    ++i;
+  end = src + strcspn(src, "\n");
+  if (end - src > MAX_STRING_LEN) {
+    return NULL;
   }
-  dst[i] = '\0';
 
-  return src + i;
+  cmd->arg[n].offset = src - cmd->line;
+  cmd->arg[n].length = end - src;
+
+  return end;
 }
 
 static const char *ParseHostPort(struct sockaddr_in *addr, const char *s) {
@@ -27,6 +27,7 @@
 
 #include <netinet/in.h>
 #include <limits.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 /* maximum possible number of arguments */
@@ -39,17 +40,50 @@
 /* maximum string length */
 #define MAX_STRING_LEN PATH_MAX
 
+struct FtpSession;
+struct FtpCommandDef;
+
+/* a string argument, as a view into the command line */
+typedef struct {
+  unsigned short offset;
+  unsigned short length;
+} FtpCommandArg;
+
+/* a parsed command; string arguments aren't copied but point into */
+/* the line, and the others are parsed into typed fields            */
 typedef struct {
   char command[5];
+  const struct FtpCommandDef *def;
   int num_arg;
-  union {
-    char string[MAX_STRING_LEN + 1];
-    struct sockaddr_in host_port;
-    int num;
-    off_t offset;
-  } arg[MAX_ARG];
+
+  /* the line parsed, NUL terminated where its newline was */
+  const char *line;
+  FtpCommandArg arg[MAX_ARG];
+
+  char code[MAX_ARG];             /* TYPE, STRU or MODE letters */
+  int num;                        /* TYPE L byte size */
+  off_t offset;                   /* REST offset */
+  struct sockaddr_in host_port;   /* PORT address */
 } FtpCommand;
 
-int FtpCommandParse(const char *input, FtpCommand *cmd);
+/* string argument n of a command, as a C string */
+#define FtpCommandString(cmd, n) ((cmd)->line + (cmd)->arg[n].offset)
+
+/* command flags */
+#define COMMAND_BLOCKS  1   /* may block for long on a data connection */
+#define COMMAND_LOGIN   2   /* only allowed once logged in */
+
+/* everything known about a command, found by FtpCommandLookup() */
+typedef struct FtpCommandDef {
+  uint32_t key;
+  int arg_type;
+  void (*func)(struct FtpSession *f, const FtpCommand *cmd);
+  int flags;
+} FtpCommandDef;
+
+int FtpCommandParse(char *line, FtpCommand *cmd);
+const FtpCommandDef *FtpCommandLookup(const char *input);
+void FtpCommandRecord(const FtpCommandDef *def, unsigned long nsec);
+void FtpCommandReport(void);
 
 #endif /* FTP_COMMAND_H */
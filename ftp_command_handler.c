@@ -1,5 +1,6 @@
 #include "ftp_command_handler.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -15,6 +16,16 @@
 #include "ftp_command.h"
 #include "ftp_log.h"
 #include "file_list.h"
+#include "ftp_list_cache.h"
+#include "ftp_stat.h"
+#include "ftp_xfer_log.h"
+#include "ftp_newline.h"
+#include "ftp_text_cache.h"
+#include "ftp_transfer.h"
+#include "ftp_read_hint.h"
+#include "ftp_file_cache.h"
+#include "ftp_passive_port.h"
+#include "ftp_pasv_pool.h"
 
 /*====== Ftp Access Control Commands Handler ================ */
 
@@ -25,7 +36,7 @@ void DoUser(FtpSession *f, const FtpCommand *cmd) {
   assert(cmd != NULL);
   assert(cmd->num_arg == 1);
 
-  user = cmd->arg[0].string;
+  user = FtpCommandString(cmd, 0);
   if (strcasecmp(user, "ftp") && strcasecmp(user, "anonymous")) {
     FtpLog(LOG_INFO, "%s attempted to log in as \"%s\"", f->client_addr_str, user);
     FtpSessionReply(f, 530, "Only anonymous FTP supported.");
@@ -41,8 +52,10 @@ void DoPass(FtpSession *f, const FtpCommand *cmd) {
   assert(cmd != NULL);
   assert(cmd->num_arg == 1);
 
-  password = cmd->arg[0].string;
+  password = FtpCommandString(cmd, 0);
   FtpLog(LOG_INFO, "%s reports e-mail address \"%s\"", f->client_addr_str, password);
+  f->logged_in = 1;
+  snprintf(f->email, sizeof(f->email), "%s", password);
   FtpSessionReply(f, 230, "User logged in, proceed.");
 }
 
@@ -86,7 +99,7 @@ void DoCwd(FtpSession *f, const FtpCommand *cmd){
   assert(cmd != NULL);
   assert(cmd->num_arg == 1);
 
-  ChangeDir(f, cmd->arg[0].string);
+  ChangeDir(f, FtpCommandString(cmd, 0));
 }
 
 void DoCdup(FtpSession *f, const FtpCommand *cmd){
@@ -98,9 +111,8 @@ void DoCdup(FtpSession *f, const FtpCommand *cmd){
 }
 
 /*====== Ftp Transfer Parameters Commands Handler =========== */
-static void InitPassivePort();
-static int GetPassivePort();
 static int SetPasv(FtpSession *f, struct sockaddr_in *bind_addr);
+static void ClosePasv(FtpSession *f);
 
 void DoPort(FtpSession *f, const FtpCommand *cmd){
   const struct sockaddr_in *host_port;
@@ -109,7 +121,7 @@ void DoPort(FtpSession *f, const FtpCommand *cmd){
   assert(cmd != NULL);
   assert(cmd->num_arg == 1);
 
-  host_port = &cmd->arg[0].host_port;
+  host_port = &cmd->host_port;
   assert(host_port->sin_family == AF_INET);
 
   if (ntohs(host_port->sin_port) < IPPORT_RESERVED) {
@@ -117,8 +129,7 @@ void DoPort(FtpSession *f, const FtpCommand *cmd){
   } else {
     /* close any outstanding PASSIVE port */
     if (f->data_channel == DATA_PASSIVE) {
-      close(f->server_fd);
-      f->server_fd = -1;
+      ClosePasv(f);
     }
     f->data_channel = DATA_PORT;
     f->data_port = *host_port;
@@ -136,9 +147,9 @@ void DoType(FtpSession *f, const FtpCommand *cmd){
   assert(cmd->num_arg >= 1);
   assert(cmd->num_arg <= 2);
 
-  type = cmd->arg[0].string[0];
+  type = cmd->code[0];
   if (cmd->num_arg == 2) {
-    form = cmd->arg[1].string[0];
+    form = cmd->code[1];
   } else {
     form = 0;
   }
@@ -168,7 +179,7 @@ void DoMode(FtpSession *f, const FtpCommand *cmd){
   assert(cmd != NULL);
   assert(cmd->num_arg == 1);
 
-  mode = cmd->arg[0].string[0];
+  mode = cmd->code[0];
   if (mode == 'S') {
     FtpSessionReply(f, 200, "Command okay.");
   } else {
@@ -184,7 +195,7 @@ void DoStru(FtpSession *f, const FtpCommand *cmd){
   assert(cmd != NULL);
   assert(cmd->num_arg == 1);
 
-  structure = cmd->arg[0].string[0];
+  structure = cmd->code[0];
   cmd_okay = 0;
   if (structure == 'F') {
     f->file_structure = STRU_F;
@@ -211,9 +222,25 @@ void DoPasv(FtpSession *f, const FtpCommand *cmd) {
   assert(cmd != NULL);
   assert(cmd->num_arg == 0);
 
-  socket_fd = SetPasv(f, &f->server_addr);
-  if (socket_fd == -1) {
-    return;
+  /* close any outstanding PASSIVE port first, so a client asking */
+  /* again doesn't hold two when the range is nearly used up       */
+  if (f->data_channel == DATA_PASSIVE) {
+    ClosePasv(f);
+    f->data_channel = DATA_PORT;
+  }
+
+  /* one already listening, if there is one ready */
+  socket_fd = -1;
+  if (FtpPasvPoolEnabled()) {
+    socket_fd = FtpPasvPoolGet(&f->server_addr.sin_addr, &port);
+  }
+  if (socket_fd != -1) {
+    f->server_addr.sin_port = htons(port);
+  } else {
+    socket_fd = SetPasv(f, &f->server_addr);
+    if (socket_fd == -1) {
+      return;
+    }
   }
 
   /* report port to client */
@@ -223,41 +250,9 @@ void DoPasv(FtpSession *f, const FtpCommand *cmd) {
                   addr >> 24,	(addr >> 16) & 0xff, (addr >> 8) & 0xff,
                   addr & 0xff, port >> 8, port & 0xff);
 
-  /* close any outstanding PASSIVE port */
-  if (f->data_channel == DATA_PASSIVE) {
-    close(f->server_fd);
-  }
   f->data_channel = DATA_PASSIVE;
   f->server_fd = socket_fd;
-}
-
-/* seed the random number generator used to pick a port */
-static void InitPassivePort() {
-  struct timeval tv;
-  unsigned short int seed[3];
-
-  gettimeofday(&tv, NULL);
-  seed[0] = (tv.tv_sec >> 16) & 0xFFFF;
-  seed[1] = tv.tv_sec & 0xFFFF;
-  seed[2] = tv.tv_usec & 0xFFFF;
-  seed48(seed);
-}
-
-/* pick a port to try to bind() for passive FTP connections */
-static int GetPassivePort() {
-  static pthread_once_t once_control = PTHREAD_ONCE_INIT;
-  static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-  int port;
-
-  /* initialize the random number generator the first time we're called */
-  pthread_once(&once_control, InitPassivePort);
-
-  /* pick a random port between 1024 and 65535, inclusive */
-  pthread_mutex_lock(&mutex);
-  port = (lrand48() % 64512) + 1024;
-  pthread_mutex_unlock(&mutex);
-
-  return port;
+  f->server_port = port;
 }
 
 static int SetPasv(FtpSession *f, struct sockaddr_in *bind_addr) {
@@ -273,30 +268,33 @@ static int SetPasv(FtpSession *f, struct sockaddr_in *bind_addr) {
     return -1;
   }
 
-  for (;;) {
-    port = GetPassivePort();
-    bind_addr->sin_port = htons(port);
-    if (bind(socket_fd, (struct sockaddr *)bind_addr, sizeof(struct sockaddr)) == 0) {
-      break;
-    }
-    if (errno != EADDRINUSE) {
-      FtpSessionReply(f, 500, "Error binding server port; %s.", strerror(errno));
-      close(socket_fd);
-      return -1;
-    }
+  port = FtpPassivePortBind(socket_fd, bind_addr);
+  if (port == -1) {
+    FtpSessionReply(f, 500, "Error binding server port; %s.", strerror(errno));
+    close(socket_fd);
+    return -1;
   }
 
   if (listen(socket_fd, 1) != 0) {
     FtpSessionReply(f, 500, "Error listening on server port; %s.", strerror(errno));
     close(socket_fd);
+    FtpPassivePortRelease(port);
     return -1;
   }
 
   return socket_fd;
 }
 
+/* close the socket passive connections come in on, freeing its port */
+static void ClosePasv(FtpSession *f) {
+  close(f->server_fd);
+  f->server_fd = -1;
+  FtpPassivePortRelease(f->server_port);
+}
+
 /*====== Ftp Service Commands Handler ======================= */
 static int OpenDataConnection(FtpSession *f);
+static int WriteFully(int fd, const char *buf, int buflen);
 static void GetAbsolutePath(char *fname, size_t fname_len,
                             const char *dir, const char *file);
 
@@ -320,30 +318,58 @@ void DoPwd(FtpSession *f, const FtpCommand *cmd) {
 void DoMdtm(FtpSession *f, const FtpCommand *cmd) {
   const char *file_name;
   char full_path[PATH_MAX + 1 + MAX_STRING_LEN];
-  struct stat stat_buf;
+  struct statx stat_buf;
+  time_t mtime_sec;
 
   assert(f != NULL);
   assert(cmd != NULL);
   assert(cmd->num_arg == 1);
 
   /* create an absolute name for file */
-  file_name = cmd->arg[0].string;
+  file_name = FtpCommandString(cmd, 0);
   GetAbsolutePath(full_path, sizeof(full_path), f->dir, file_name);
 
   /* get the file information */
-  if (stat(full_path, &stat_buf) != 0) {
+  if (!FtpStatPath(full_path, STATX_MTIME, &stat_buf)) {
     FtpSessionReply(f, 550, "Error getting file status; %s: %s.",
                     full_path, strerror(errno));
   } else {
     struct tm mtime;
     char time_buf[16];
 
-    gmtime_r(&stat_buf.st_mtime, &mtime);
+    mtime_sec = stat_buf.stx_mtime.tv_sec;
+    gmtime_r(&mtime_sec, &mtime);
     strftime(time_buf, sizeof(time_buf), "%4Y%2m%2d%2H%2M%2S", &mtime);
     FtpSessionReply(f, 213, time_buf);
   }
 }
 
+void DoSize(FtpSession *f, const FtpCommand *cmd) {
+  const char *file_name;
+  char full_path[PATH_MAX + 1 + MAX_STRING_LEN];
+  struct statx stat_buf;
+
+  assert(f != NULL);
+  assert(cmd != NULL);
+  assert(cmd->num_arg == 1);
+
+  /* create an absolute name for file */
+  file_name = FtpCommandString(cmd, 0);
+  GetAbsolutePath(full_path, sizeof(full_path), f->dir, file_name);
+
+  /* the size sent in ASCII mode isn't known without reading the file */
+  if (f->data_type != TYPE_I) {
+    FtpSessionReply(f, 550, "SIZE not available in ASCII mode.");
+  } else if (!FtpStatPath(full_path, STATX_TYPE | STATX_SIZE, &stat_buf)) {
+    FtpSessionReply(f, 550, "Error getting file status; %s: %s.",
+                    full_path, strerror(errno));
+  } else if (!S_ISREG(stat_buf.stx_mode)) {
+    FtpSessionReply(f, 550, "%s: not a plain file.", full_path);
+  } else {
+    FtpSessionReply(f, 213, "%llu", (unsigned long long)stat_buf.stx_size);
+  }
+}
+
 void DoRest(FtpSession *f, const FtpCommand *cmd) {
   assert(f != NULL);
   assert(cmd != NULL);
@@ -354,17 +380,99 @@ void DoRest(FtpSession *f, const FtpCommand *cmd) {
   } else if (f->file_structure != STRU_F) {
     FtpSessionReply(f, 555, "Restart only possible with FILE structure.");
   } else {
-    f->file_offset = cmd->arg[0].offset;
+    f->file_offset = cmd->offset;
     f->file_offset_command_number = f->command_number;
     FtpSessionReply(f, 350, "Restart okay, awaiting file retrieval request.");
   }
 }
 
-static void SendFileList(FtpSession *f, const FtpCommand *cmd,
-                         int (*PrintFileListFunc)(int fd, const char *dir)) {
+/* the listing writer moved some data along */
+static void ListProgress(void *f) {
+  FtpSessionTransferProgress((FtpSession *)f);
+}
+
+/* send a rendered listing in large writes */
+static int SendListingData(FtpSession *f, int fd, const char *data, int len) {
+  int amt_sent, amt_write;
+
+  for (amt_sent = 0; amt_sent < len; amt_sent += amt_write) {
+    amt_write = len - amt_sent;
+    if (amt_write > FTP_BUFFER_SIZE) {
+      amt_write = FTP_BUFFER_SIZE;
+    }
+    if (WriteFully(fd, data + amt_sent, amt_write) == -1) {
+      return 0;
+    }
+    FtpSessionTransferProgress(f);
+  }
+
+  return 1;
+}
+
+/* send the listing of dir_path, from the listing cache if it has */
+/* a current one */
+static int SendListing(FtpSession *f, int fd, const char *dir_path,
+                       int kind, int flags) {
+  struct stat dir_stat;
+  FtpListing *listing;
+  FtpBuffer out;
+  int cache, send_ok;
+
+  /* only sorted listings of directories are cached; they are looked */
+  /* at before they are listed, so a change made while rendering     */
+  /* makes the next one miss                                         */
+  cache = FtpListCacheEnabled() && !(flags & FILE_LIST_UNSORTED) &&
+          (stat(dir_path, &dir_stat) == 0) && S_ISDIR(dir_stat.st_mode);
+  if (cache) {
+    listing = FtpListCacheFind(&dir_stat, kind);
+    if (listing != NULL) {
+      send_ok = SendListingData(f, fd, listing->data, listing->len);
+      FtpListCacheRelease(listing);
+      return send_ok;
+    }
+  }
+
+  /* collect the listing into large writes, holding on to all of it */
+  /* while it is still small enough to cache                        */
+  if (!FtpBufferInit(&out, fd, FTP_BUFFER_SIZE)) {
+    return 0;
+  }
+  out.flushed = ListProgress;
+  out.arg = f;
+  if (cache) {
+    out.hold = FtpListCacheMaxListing();
+  }
+  if (kind == LISTING_FULL) {
+    send_ok = PrintFileFullList(&out, dir_path, flags);
+  } else {
+    send_ok = PrintFileNameList(&out, dir_path);
+  }
+
+  /* a listing that was streamed, not sorted, gave up its hold */
+  if (send_ok && cache && (out.hold > 0) && (out.written == 0)) {
+    listing = FtpListCacheInsert(&dir_stat, kind, out.data, out.len);
+    if (listing != NULL) {
+      /* the cache has the data now */
+      out.data = NULL;
+      out.len = 0;
+      send_ok = SendListingData(f, fd, listing->data, listing->len);
+      FtpListCacheRelease(listing);
+    }
+  }
+
+  send_ok = send_ok && FtpBufferFlush(&out);
+  if (out.error != 0) {
+    errno = out.error;
+  }
+  FtpBufferDestroy(&out);
+  return send_ok;
+}
+
+static void SendFileList(FtpSession *f, const FtpCommand *cmd, int kind) {
   int fd;
   char dir_path[PATH_MAX + 1];
-  int send_ok;
+  const char *path;
+  int flags, send_ok;
 
   assert(f != NULL);
   assert(cmd != NULL);
@@ -373,13 +481,25 @@ static void SendFileList(FtpSession *f, const FtpCommand *cmd,
   /* For exit */
   fd = -1;
 
-  /* Figures out what parameters to use */
-  if (cmd->num_arg == 0) {
+  /* Figures out what parameters to use, skipping any ls options */
+  /* ("LIST -la /pub"); -f or -U asks for an unsorted listing      */
+  flags = 0;
+  path = (cmd->num_arg == 1) ? FtpCommandString(cmd, 0) : "";
+  while (path[0] == '-') {
+    for (++path; (*path != '\0') && (*path != ' '); ++path) {
+      if ((*path == 'f') || (*path == 'U')) {
+        flags |= FILE_LIST_UNSORTED;
+      }
+    }
+    while (*path == ' ') {
+      ++path;
+    }
+  }
+  if (*path == '\0') {
     strcpy(dir_path, "./");
   } else {
-    assert(cmd->num_arg == 1);
-    GetAbsolutePath(dir_path, PATH_MAX, f->dir, cmd->arg[0].string);
-   /* strcpy(dir_path, cmd->arg[0].string); */
+    GetAbsolutePath(dir_path, PATH_MAX, f->dir, path);
+   /* strcpy(dir_path, FtpCommandString(cmd, 0)); */
   }
 
   /* Ready to list */
@@ -394,7 +514,8 @@ static void SendFileList(FtpSession *f, const FtpCommand *cmd,
 
   FtpSessionReply(f, 125, "Data connection already open; transfer starting.");
 
-  send_ok = PrintFileListFunc(fd, dir_path);
+  send_ok = SendListing(f, fd, dir_path, kind, flags);
+  FtpSessionTransferEnd(f);
 
   if (send_ok) {
     FtpSessionReply(f, 226, "Transfer complete.");
@@ -403,17 +524,18 @@ static void SendFileList(FtpSession *f, const FtpCommand *cmd,
   }
 
 exit:
+  FtpSessionTransferEnd(f);
   if (fd != -1) {
     close(fd);
   }
 }
 
 void DoList(FtpSession *f, const FtpCommand *cmd) {
-  SendFileList(f, cmd, PrintFileFullList);
+  SendFileList(f, cmd, LISTING_FULL);
 }
 
 void DoNlst(FtpSession *f, const FtpCommand *cmd) {
-  SendFileList(f, cmd, PrintFileNameList);
+  SendFileList(f, cmd, LISTING_NAMES);
 }
 
 void DoSyst(FtpSession *f, const FtpCommand *cmd) {
@@ -433,23 +555,6 @@ void DoStor(FtpSession *f, const FtpCommand *cmd){
   FtpSessionReply(f, 553, "Server will not store files.");
 }
 
-static int ConvertNewlines(char *dst, const char *src, int srclen) {
-  int i;
-  int dstlen;
-
-  assert(dst != NULL);
-  assert(src != NULL);
-
-  dstlen = 0;
-  for (i=0; i < srclen; ++i) {
-    if (src[i] == '\n') {
-      dst[dstlen++] = '\r';
-    }
-    dst[dstlen++] = src[i];
-  }
-  return dstlen;
-}
-
 static int WriteFully(int fd, const char *buf, int buflen) {
   int amt_written;
   int write_ret;
@@ -472,12 +577,60 @@ enum {
   kFileResetError,
   kFileReadingError,
   kFileWritingError,
-  kFileSendingError
+  kFileSendingError,
+  kFileMemoryError
 };
 
-static int SendFile(FtpSession *f, int file_fd, int out_fd, int *send_size) {
-  int file_size = 0;
+/* a file being sent, and its page cache hints (or NULL) */
+typedef struct {
+  FtpSession *f;
+  FtpReadHint *hint;
+} SendState;
+
+/* the file sender moved some data along */
+static void SendProgress(void *arg, off_t offset) {
+  SendState *state = (SendState *)arg;
+
+  FtpSessionTransferProgress(state->f);
+  if (state->hint != NULL) {
+    FtpReadHintAdvance(state->hint, offset);
+  }
+}
+
+/* sends len bytes of in_fd from offset, adding them to *send_size */
+/* as they go, and keeping hint (if not NULL) up to date           */
+static int SendFileRange(FtpSession *f, int in_fd, off_t offset, off_t len,
+                         int out_fd, FtpReadHint *hint, off_t *send_size) {
+  SendState state;
+
+  state.f = f;
+  state.hint = hint;
+  if (!FtpTransferFile(out_fd, in_fd, offset, len, send_size,
+                       SendProgress, &state)) {
+    FtpSessionReply(f, 550, "Error sending file; %s.",
+                    (errno == EIO) ? "file truncated" : strerror(errno));
+    return kFileSendingError;
+  }
+
+  return 0;
+}
+
+/* whether two stats are of the same file, unchanged */
+static int SameFile(const struct stat *a, const struct stat *b) {
+  return (a->st_dev == b->st_dev) && (a->st_ino == b->st_ino) &&
+         (a->st_size == b->st_size) &&
+         (a->st_mtim.tv_sec == b->st_mtim.tv_sec) &&
+         (a->st_mtim.tv_nsec == b->st_mtim.tv_nsec) &&
+         (a->st_ctim.tv_sec == b->st_ctim.tv_sec) &&
+         (a->st_ctim.tv_nsec == b->st_ctim.tv_nsec);
+}
+
+/* sends the file, adding the bytes sent to *send_size as it goes, */
+/* and what reading it cost to hint                                 */
+static int SendFile(FtpSession *f, int file_fd, int out_fd, FtpReadHint *hint,
+                    off_t *send_size) {
   struct stat stat_buf;
+  off_t read_offset;
 
   if (fstat(file_fd, &stat_buf) != 0) {
     FtpSessionReply(f, 550, "Error getting file information; %s.", strerror(errno));
@@ -491,59 +644,195 @@ static int SendFile(FtpSession *f, int file_fd, int out_fd, int *send_size) {
 
   /* if the last command was a REST command, restart at the */
   /* requested position in the file                         */
+  read_offset = 0;
   if ((f->file_offset_command_number == (f->command_number - 1)) && (f->file_offset > 0)) {
-    if (lseek(file_fd, f->file_offset, SEEK_SET) == -1) {
+    read_offset = lseek(file_fd, f->file_offset, SEEK_SET);
+    if (read_offset == -1) {
       FtpSessionReply(f, 550, "Error seeking to restart position; %s.", strerror(errno));
       return kFileResetError;
     }
   }
 
   if (f->data_type == TYPE_A) {
-    int read_ret = 0;
-    char buf[4096], converted_buf[8192];
+    int read_ret = 0, ret = 0;
+    char *buf, *converted_buf;
     int converted_buflen;
+    int cache_fd = -1;
+    off_t cache_len = 0;
+    FtpTextFile *text;
+    struct stat end_stat;
+
+    /* a restart is at an offset into the file as it is, which a */
+    /* converted copy doesn't map back to, so only whole files go */
+    /* through the cache: sent from it, or copied to it as sent   */
+    if (FtpTextCacheEnabled() &&
+        ((f->file_offset_command_number != (f->command_number - 1)) ||
+         (f->file_offset == 0))) {
+      text = FtpTextCacheFind(&stat_buf);
+      if (text != NULL) {
+        ret = SendFileRange(f, text->fd, 0, text->len, out_fd, NULL,
+                            send_size);
+        FtpTextCacheRelease(text);
+        return ret;
+      }
+      cache_fd = FtpTextCacheCreate(&stat_buf);
+    }
 
+    /* a big buffer, so there are few reads and writes, and the */
+    /* conversion runs over long stretches of the file           */
+    buf = (char *)malloc(NEWLINE_BUFFER_SIZE * 3);
+    if (buf == NULL) {
+      FtpSessionReply(f, 550, "Error sending file; out of memory.");
+      if (cache_fd != -1) {
+        close(cache_fd);
+      }
+      return kFileMemoryError;
+    }
+    converted_buf = buf + NEWLINE_BUFFER_SIZE;
+
+    FtpReadHintStart(hint, file_fd, stat_buf.st_size, read_offset);
     for (;;) {
-      read_ret = read(file_fd, buf, sizeof(buf));
+      read_ret = read(file_fd, buf, NEWLINE_BUFFER_SIZE);
       if (read_ret == -1) {
         FtpSessionReply(f, 550, "Error reading from file; %s.", strerror(errno));
-        return kFileReadingError;
+        ret = kFileReadingError;
+        break;
       }
       if (read_ret == 0) {
-        return 0;
+        break;
       }
-      converted_buflen = ConvertNewlines(converted_buf, buf, read_ret);
+      read_offset += read_ret;
+      converted_buflen = FtpConvertNewlines(converted_buf, buf, read_ret);
       if (WriteFully(out_fd, converted_buf, converted_buflen) == -1) {
         FtpSessionReply(f, 550, "Error writing to data connection; %s.", strerror(errno));
-        return kFileWritingError;
+        ret = kFileWritingError;
+        break;
       }
-      file_size += converted_buflen;
-    }
-  } else if (f->data_type == TYPE_I) {
-    int offset = 0, sendfile_ret = 0, amt_to_send;
-
-    offset = f->file_offset;
-    file_size = stat_buf.st_size - offset;
-    while (offset < stat_buf.st_size) {
-      amt_to_send = stat_buf.st_size - offset;
-      if (amt_to_send > 65536) {
-        amt_to_send = 65536;
+      FtpSessionTransferProgress(f);
+      FtpReadHintAdvance(hint, read_offset);
+      *send_size += converted_buflen;
+      if ((cache_fd != -1) &&
+          (WriteFully(cache_fd, converted_buf, converted_buflen) == -1)) {
+        close(cache_fd);
+        cache_fd = -1;
       }
-      sendfile_ret = sendfile(out_fd,
-                              file_fd,
-                              &offset,
-                              amt_to_send);
-      if (sendfile_ret != amt_to_send) {
-        FtpSessionReply(f, 550, "Error sending file; %s.", strerror(errno));
-        return kFileSendingError;
+      cache_len += converted_buflen;
+    }
+    FtpReadHintEnd(hint);
+    free(buf);
+
+    /* keep the copy if it is of all of the file, unchanged throughout */
+    if (cache_fd != -1) {
+      if ((ret == 0) && (fstat(file_fd, &end_stat) == 0) &&
+          SameFile(&stat_buf, &end_stat)) {
+        text = FtpTextCacheInsert(&stat_buf, cache_fd, cache_len);
+        if (text != NULL) {
+          FtpTextCacheRelease(text);
+        }
+      } else {
+        close(cache_fd);
       }
     }
+    return ret;
+  } else if (f->data_type == TYPE_I) {
+    int ret = 0;
+
+    if (f->file_offset < stat_buf.st_size) {
+      FtpReadHintStart(hint, file_fd, stat_buf.st_size, f->file_offset);
+      ret = SendFileRange(f, file_fd, f->file_offset,
+                          stat_buf.st_size - f->file_offset, out_fd, hint,
+                          send_size);
+      FtpReadHintEnd(hint);
+    }
+    return ret;
   }
 
-  *send_size = file_size;
   return 0;
 }
 
+/* reads all of a small file into the file cache, if it is asked for */
+/* often enough to be worth it, returning the copy or NULL            */
+static FtpCachedFile *CacheFile(const char *full_path, int file_fd) {
+  struct stat stat_buf, end_stat;
+  FtpCachedFile *cached;
+  char *data;
+  int len, read_ret;
+
+  if ((fstat(file_fd, &stat_buf) != 0) ||
+      !FtpFileCacheAdmit(full_path, &stat_buf)) {
+    return NULL;
+  }
+
+  data = (char *)malloc(stat_buf.st_size + 1);
+  if (data == NULL) {
+    return NULL;
+  }
+  for (len = 0; len < stat_buf.st_size; len += read_ret) {
+    read_ret = pread(file_fd, data + len, stat_buf.st_size - len, len);
+    if (read_ret <= 0) {
+      free(data);
+      return NULL;
+    }
+  }
+
+  /* a copy of a file changing as it was read would be of neither */
+  if ((fstat(file_fd, &end_stat) != 0) || !SameFile(&stat_buf, &end_stat)) {
+    free(data);
+    return NULL;
+  }
+
+  cached = FtpFileCacheInsert(full_path, &stat_buf, data, len);
+  if (cached == NULL) {
+    free(data);
+  }
+  return cached;
+}
+
+/* sends a file from the file cache in one write, adding the bytes */
+/* sent to *send_size                                              */
+static int SendCachedFile(FtpSession *f, const FtpCachedFile *cached,
+                          int out_fd, off_t *send_size) {
+  const char *data;
+  char *converted_buf;
+  off_t offset;
+  int len, ret;
+
+  /* restart where SendFile() would */
+  offset = f->file_offset;
+  if ((f->data_type == TYPE_A) &&
+      (f->file_offset_command_number != (f->command_number - 1))) {
+    offset = 0;
+  }
+  if (offset >= cached->len) {
+    return 0;
+  }
+  data = cached->data + offset;
+  len = cached->len - offset;
+
+  converted_buf = NULL;
+  if (f->data_type == TYPE_A) {
+    converted_buf = (char *)malloc(len * 2);
+    if (converted_buf == NULL) {
+      FtpSessionReply(f, 550, "Error sending file; out of memory.");
+      return kFileMemoryError;
+    }
+    len = FtpConvertNewlines(converted_buf, data, len);
+    data = converted_buf;
+  }
+
+  ret = 0;
+  if (WriteFully(out_fd, data, len) == -1) {
+    FtpSessionReply(f, 550, "Error writing to data connection; %s.", strerror(errno));
+    ret = kFileWritingError;
+  } else {
+    FtpSessionTransferProgress(f);
+    *send_size += len;
+  }
+
+  free(converted_buf);
+  return ret;
+}
+
 static struct timeval IntervalTime(struct timeval start, struct timeval end) {
   struct timeval interval;
 
@@ -562,12 +851,65 @@ static struct timeval IntervalTime(struct timeval start, struct timeval end) {
   return interval;
 }
 
+/* logs a transfer, to the transfer log if there is one, and what */
+/* reading the file cost                                          */
+static void LogTransfer(FtpSession *f, const char *full_path, off_t file_size,
+                        off_t offset, struct timeval start_timestamp,
+                        int complete, const FtpReadHint *hint) {
+  struct timeval end_timestamp, transfer_time;
+  FtpXferEvent event;
+
+  /* mark end time */
+  gettimeofday(&end_timestamp, NULL);
+
+  transfer_time = IntervalTime(start_timestamp, end_timestamp);
+
+  if (hint->started) {
+    FtpLog(LOG_DEBUG,
+           "%s read \"%s\": %lu major faults, %lu blocks in, "
+           "%lu.%06lu seconds stalled",
+           f->client_addr_str,
+           full_path,
+           hint->major_faults,
+           hint->blocks_in,
+           hint->stall_usec / 1000000,
+           hint->stall_usec % 1000000);
+  }
+
+  if (FtpXferLogEnabled()) {
+    event.end_time = end_timestamp.tv_sec;
+    event.bytes = file_size;
+    event.offset = offset;
+    event.duration_ms = transfer_time.tv_sec * 1000 +
+                        transfer_time.tv_usec / 1000;
+    event.client = f->client_addr.sin_addr.s_addr;
+    event.direction = 'o';
+    event.mode = (f->data_type == TYPE_I) ? 'b' : 'a';
+    event.result = complete ? XFER_COMPLETE : XFER_INCOMPLETE;
+    FtpXferLogRecord(&event, full_path, f->email);
+    return;
+  }
+
+  if (complete) {
+    FtpLog(LOG_INFO,
+           "%s retrieved \"%s\", %lld bytes in %d.%06d seconds",
+           f->client_addr_str,
+           full_path,
+           (long long)file_size,
+           transfer_time.tv_sec,
+           transfer_time.tv_usec);
+  }
+}
+
 void DoRetr(FtpSession *f, const FtpCommand *cmd){
   int file_fd, socket_fd;
   char full_path[PATH_MAX + 1 + MAX_STRING_LEN];
   const char *file_name;
-  int file_size;
-  struct timeval start_timestamp, end_timestamp, transfer_time;
+  off_t file_size;
+  int transferring, complete;
+  struct timeval start_timestamp;
+  FtpReadHint hint;
+  FtpCachedFile *cached;
 
   assert(f != NULL);
   assert(cmd != NULL);
@@ -576,16 +918,37 @@ void DoRetr(FtpSession *f, const FtpCommand *cmd){
   /* set up for exit */
   file_fd = -1;
   socket_fd = -1;
+  file_size = 0;
+  transferring = 0;
+  complete = 0;
+  hint.started = 0;
+  cached = NULL;
 
   /* create an absolute name for our file */
-  file_name = cmd->arg[0].string;
+  file_name = FtpCommandString(cmd, 0);
   GetAbsolutePath(full_path, sizeof(full_path), f->dir, file_name);
 
-  /* open file */
-  file_fd = open(full_path, O_RDONLY);
-  if (file_fd == -1) {
-    FtpSessionReply(f, 550, "Error opening file; %s.", strerror(errno));
-    goto exit_retr;
+  /* small files asked for often are sent from memory, without */
+  /* opening them                                               */
+  if (FtpFileCacheEnabled()) {
+    cached = FtpFileCacheFind(full_path);
+  }
+
+  if (cached == NULL) {
+    /* open file */
+    file_fd = open(full_path, O_RDONLY);
+    if (file_fd == -1) {
+      FtpSessionReply(f, 550, "Error opening file; %s.", strerror(errno));
+      goto exit_retr;
+    }
+
+    if (FtpFileCacheEnabled()) {
+      cached = CacheFile(full_path, file_fd);
+      if (cached != NULL) {
+        close(file_fd);
+        file_fd = -1;
+      }
+    }
   }
 
   /* ready to transfer */
@@ -593,6 +956,7 @@ void DoRetr(FtpSession *f, const FtpCommand *cmd){
 
   /* mark start time */
   gettimeofday(&start_timestamp, NULL);
+  transferring = 1;
 
   /* open data connection */
   socket_fd = OpenDataConnection(f);
@@ -601,39 +965,39 @@ void DoRetr(FtpSession *f, const FtpCommand *cmd){
   }
 
   /* Sends the file */
-  file_size = 0;
-  if (SendFile(f, file_fd, socket_fd, &file_size)) {
+  if (cached != NULL) {
+    if (SendCachedFile(f, cached, socket_fd, &file_size)) {
+      goto exit_retr;
+    }
+  } else if (SendFile(f, file_fd, socket_fd, &hint, &file_size)) {
     goto exit_retr;
   }
 
   /* disconnect */
+  FtpSessionTransferEnd(f);
   close(socket_fd);
   socket_fd = -1;
 
   FtpSessionReply(f, 226, "File transfer complete.");
-
-  /* mark end time */
-  gettimeofday(&end_timestamp, NULL);
-
-  transfer_time = IntervalTime(start_timestamp, end_timestamp);
-
-  /* Logs the transfer */
-  FtpLog(LOG_INFO,
-         "%s retrieved \"%s\", %ld bytes in %d.%06d seconds",
-         f->client_addr_str,
-         full_path,
-         file_size,
-         transfer_time.tv_sec,
-         transfer_time.tv_usec);
+  complete = 1;
 
 exit_retr:
+  /* Logs the transfer */
+  if (transferring) {
+    LogTransfer(f, full_path, file_size, f->file_offset, start_timestamp,
+                complete, &hint);
+  }
   f->file_offset = 0;
+  FtpSessionTransferEnd(f);
   if (socket_fd != -1) {
     close(socket_fd);
   }
   if (file_fd != -1) {
     close(file_fd);
   }
+  if (cached != NULL) {
+    FtpFileCacheRelease(cached);
+  }
 }
 
 /* convert the user-entered file name into a full path on our local drive */
@@ -674,22 +1038,29 @@ static int OpenDataConnection(FtpSession *f) {
       FtpSessionReply(f, 425, "Error creating socket; %s.", strerror(errno));
       return -1;
     }
+    FtpSessionTransferStart(f, socket_fd);
     if (connect(socket_fd, (struct sockaddr *)&f->data_port,
                 sizeof(f->data_port)) != 0) {
       FtpSessionReply(f, 425, "Error connecting; %s.", strerror(errno));
+      FtpSessionTransferEnd(f);
 	    close(socket_fd);
 	    return -1;
     }
   } else {
     assert(f->data_channel == DATA_PASSIVE);
     addr_len = sizeof(struct sockaddr_in);
+    /* a client that never connects is a stalled transfer too */
+    FtpSessionTransferStart(f, f->server_fd);
     socket_fd = accept(f->server_fd, (struct sockaddr *)&addr, &addr_len);
     if (socket_fd == -1) {
       FtpSessionReply(f, 425, "Error accepting connection; %s.", strerror(errno));
+      FtpSessionTransferEnd(f);
       return -1;
     }
+    FtpSessionTransferStart(f, socket_fd);
     if (memcmp(&f->client_addr.sin_addr, &addr.sin_addr, sizeof(struct in_addr)))	{
       FtpSessionReply(f, 425, "Error accepting connection; connection from invalid IP.");
+      FtpSessionTransferEnd(f);
       close(socket_fd);
       return -1;
     }
@@ -23,5 +23,6 @@ void DoNoop(FtpSession *f, const FtpCommand *cmd);
 void DoRest(FtpSession *f, const FtpCommand *cmd);
 void DoPasv(FtpSession *f, const FtpCommand *cmd);
 void DoMdtm(FtpSession *f, const FtpCommand *cmd);
+void DoSize(FtpSession *f, const FtpCommand *cmd);
 
 #endif /* FTP_COMMAND_HANDLER_H */
@@ -2,17 +2,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 #include "ftp_log.h"
 
 static const int kMaxAcceptErrorNum = 10;
 
+/* output space needed before running another command: room for the */
+/* longest reply and its CRLF                                        */
+static const int kReplySpace = MAX_REPLY_LEN + 2;
+
 static void *ConnectionHandler(FtpConnection *info);
+static void *ConnectionTransferHandler(FtpConnection *info);
+static int ConnectionAdmit(FtpConnection *info);
+static void ConnectionResume(FtpConnection *info, int may_block);
 static void ConnectionCleanup(FtpConnection *info);
 
-/* handle incoming connections */
-void *FtpConnectionAcceptor(FtpListener *f) {
+/* handle incoming connections on one of the listener's sockets */
+void *FtpConnectionAcceptor(FtpListenerShard *s) {
+  FtpListener *f = s->listener;
+  unsigned int next_event_loop;
   int num_error = 0, accept_fd;
   socklen_t addr_len;
   socklen_t tcp_nodelay = 1;
@@ -21,29 +31,37 @@ void *FtpConnectionAcceptor(FtpListener *f) {
   FtpConnection *info;
 
   pthread_t thread_id;
-  fd_set read_fds;
+  struct pollfd fds[2];
+
+  fds[0].fd = s->sock_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = f->shutdown_request_recv_fd;
+  fds[1].events = POLLIN;
 
   num_error = 0;
   while (1) {
-    FD_ZERO(&read_fds);
-    FD_SET(f->sock_fd, &read_fds);
-    FD_SET(f->shutdown_request_recv_fd, &read_fds);
-
     /* Waiting util at least one become ready for input */
-    select(FD_SETSIZE, &read_fds, NULL, NULL, NULL);
+    if (poll(fds, 2, -1) == -1) {
+      continue;
+    }
 
-    /* If data arrived on our pipe, we've been asked to exit */
-    if (FD_ISSET(f->shutdown_request_recv_fd, &read_fds)) {
-      close(f->sock_fd);
+    /* If data arrived on our pipe, we've been asked to exit; return */
+    /* rather than pthread_exit(), which needs libgcc_s in the chroot */
+    if (fds[1].revents != 0) {
+      close(s->sock_fd);
       FtpLog(LOG_INFO, "listener shut down, no longer accepting connections");
-      pthread_exit(NULL);
+      return NULL;
     }
 
     /* otherwise accept our pending connection (if any) */
     addr_len = sizeof(SockAddr4);
-    accept_fd = accept(f->sock_fd, (struct sockaddr *)&client_addr, &addr_len);
+    accept_fd = accept(s->sock_fd, (struct sockaddr *)&client_addr, &addr_len);
 
     if (accept_fd < 0) {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) {
+        /* the client went away before we got to it */
+        continue;
+      }
       if ((errno == ECONNABORTED) || (errno == ECONNRESET)) {
         FtpLog(LOG_ERROR, "interruption accepting FTP connection;");
       } else {
@@ -71,7 +89,7 @@ void *FtpConnectionAcceptor(FtpListener *f) {
       continue;
     }
 
-    info = (FtpConnection *)malloc(sizeof(FtpConnection));
+    info = (FtpConnection *)FtpSlabAlloc(&f->connection_slab);
     if (info == NULL) {
       FtpLog(LOG_ERROR, "out of memory, FTP server dropping connection");
       close(accept_fd);
@@ -79,24 +97,46 @@ void *FtpConnectionAcceptor(FtpListener *f) {
     }
 
     info->ftp_listener = f;
+    info->event_loop = NULL;
     /* Inits telnet session for ftp control connection */
     TelnetServerInit(&info->telnet_session, accept_fd, accept_fd);
     if (!FtpSessionInit(&info->ftp_session, &client_addr, &server_addr,
-                        &info->telnet_session, f->dir)) {
+                        &info->telnet_session, f->dir,
+                        f->inactivity_timeout, f->transfer_timeout)) {
       FtpLog(LOG_ERROR, "error initializing FTP session, FTP server exiting;");
       close(accept_fd);
       TelnetDestroy(&info->telnet_session);
-      free(info);
+      FtpSlabFree(&f->connection_slab, info);
       continue;
     }
 
-    /* Now, connection accepted */
-    if (pthread_create(&thread_id, NULL,
+    /* Now, connection accepted, so count it before we spend anything */
+    /* more on it; rejected clients get their 421 from this thread     */
+    if (!ConnectionAdmit(info)) {
+      ConnectionCleanup(info);
+    } else if (f->num_event_loops > 0) {
+      /* hand the connection to the next event loop in turn */
+      next_event_loop = __atomic_fetch_add(&f->next_event_loop, 1,
+                                           __ATOMIC_RELAXED);
+      info->event_loop = &f->event_loops[next_event_loop % f->num_event_loops];
+      info->ftp_session.reply_nowait = 1;
+      FtpSessionStart(&info->ftp_session);
+      if (!info->ftp_session.session_active ||
+          !FtpEventLoopWatch(info->event_loop, accept_fd, info, 0, 1, 1)) {
+        ConnectionCleanup(info);
+      }
+    } else if (f->worker_pool != NULL) {
+      if (!FtpWorkerPoolSubmit(f->worker_pool, info)) {
+        FtpSessionDrop(&info->ftp_session,
+                       "Server busy, please try again later");
+        FtpLog(LOG_ERROR, "%s worker queue full, dropping connection",
+               info->ftp_session.client_addr_str);
+        ConnectionCleanup(info);
+      }
+    } else if (pthread_create(&thread_id, NULL,
                        (void * (*)(void *))ConnectionHandler, info) != 0) {
       FtpLog(LOG_ERROR, "error creating new thread;");
-      close(accept_fd);
-      TelnetDestroy(&info->telnet_session);
-      free(info);
+      ConnectionCleanup(info);
     }
 
     num_error = 0;
@@ -104,8 +144,28 @@ void *FtpConnectionAcceptor(FtpListener *f) {
 }
 
 static void *ConnectionHandler(FtpConnection *info) {
+  int thread_cancel_old_type;
+
+  /* don't save state for pthread_join() */
+  pthread_detach(pthread_self());
+  pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, &thread_cancel_old_type);
+  /* set up our cleanup handler */
+  pthread_cleanup_push((void (*)())ConnectionCleanup, info);
+
+  /* handle the session */
+  FtpSessionRun(&info->ftp_session);
+
+  /* exunt (pop calls cleanup function) */
+  pthread_cleanup_pop(1);
+
+  /* return for form :) */
+  return NULL;
+}
+
+/* count a new connection, dropping it if there are too many already */
+static int ConnectionAdmit(FtpConnection *info) {
   FtpListener *f;
-  int num_connections = 0, thread_cancel_old_type;
+  int num_connections = 0;
   char *client_addr_str;
   uint16_t client_port;
   char drop_reason[80];
@@ -115,12 +175,6 @@ static void *ConnectionHandler(FtpConnection *info) {
   client_addr_str = inet_ntoa(info->ftp_session.client_addr.sin_addr);
   client_port = ntohs(info->ftp_session.client_addr.sin_port);
 
-  /* don't save state for pthread_join() */
-  pthread_detach(pthread_self());
-  pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, &thread_cancel_old_type);
-  /* set up our cleanup handler */
-  pthread_cleanup_push((void (*)())ConnectionCleanup, info);
-
   /* process global data */
   pthread_mutex_lock(&f->mutex);
 
@@ -131,26 +185,116 @@ static void *ConnectionHandler(FtpConnection *info) {
   FtpLog(LOG_INFO, "%s port %d connection requesting ...",
          client_addr_str, client_port);
 
-  /* handle the session */
   if (num_connections <= f->max_connections) {
-    FtpSessionRun(&info->ftp_session);
-  } else {
-    sprintf(drop_reason, "Too many users logged in (%d logins maximum)",
-            f->max_connections);
+    return 1;
+  }
 
-    FtpSessionDrop(&info->ftp_session, drop_reason);
+  sprintf(drop_reason, "Too many users logged in (%d logins maximum)",
+          f->max_connections);
 
-    FtpLog(LOG_ERROR, "%s port exceeds max users (%d), dropping connection",
-           client_addr_str, client_port, num_connections);
-  }
+  FtpSessionDrop(&info->ftp_session, drop_reason);
 
-  /* exunt (pop calls cleanup function) */
-  pthread_cleanup_pop(1);
+  FtpLog(LOG_ERROR, "%s port exceeds max users (%d), dropping connection",
+         client_addr_str, client_port, num_connections);
+
+  return 0;
+}
+
+/* called by a pool worker to run a whole session */
+void FtpConnectionServe(void *data) {
+  FtpConnection *info = (FtpConnection *)data;
+
+  FtpSessionRun(&info->ftp_session);
+  ConnectionCleanup(info);
+}
+
+/* called by a pool worker to run a command an event loop passed on */
+void FtpConnectionResume(void *data) {
+  ConnectionResume((FtpConnection *)data, 1);
+}
+
+/* called by an event loop when a control connection is readable */
+void FtpConnectionReady(void *data) {
+  ConnectionResume((FtpConnection *)data, 0);
+}
+
+/* runs a command that may block, and what follows it, off the event loop */
+static void *ConnectionTransferHandler(FtpConnection *info) {
+  /* don't save state for pthread_join() */
+  pthread_detach(pthread_self());
+
+  ConnectionResume(info, 1);
 
-  /* return for form :) */
   return NULL;
 }
 
+/* process every command already received, then give the connection back  */
+/* to its event loop; commands that may block are passed to the worker     */
+/* pool, or to a new thread if there is no pool or its queue is full       */
+static void ConnectionResume(FtpConnection *info, int may_block) {
+  char buf[2048];
+  int peek_ret, flush_ret;
+  pthread_t thread_id;
+
+  /* the loop must never wait on a client; a worker or thread of its */
+  /* own may, as with a thread per connection                         */
+  info->ftp_session.reply_nowait = !may_block;
+
+  for (;;) {
+    /* the client isn't reading its replies, so stop reading its */
+    /* commands until it does: the input buffer fills, and TCP    */
+    /* pushes back on the client, rather than the loop waiting    */
+    if (TelnetOutputRoom(&info->telnet_session, kReplySpace) < kReplySpace) {
+      if ((TelnetTryFlush(&info->telnet_session) != 0) &&
+          FtpEventLoopWatch(info->event_loop, info->telnet_session.in_fd,
+                            info, 1, 0, 1)) {
+        return;
+      }
+      break;
+    }
+
+    peek_ret = TelnetPeekLine(&info->telnet_session, buf, sizeof(buf));
+    if (peek_ret == TELNET_WOULD_BLOCK) {
+      /* the input has run dry, so send the replies to everything so */
+      /* far at once; whatever the socket won't take waits for it to */
+      /* become writable, and nothing else is left to do until the   */
+      /* client sends us something                                   */
+      flush_ret = TelnetTryFlush(&info->telnet_session);
+      if ((flush_ret != 0) &&
+          FtpEventLoopWatch(info->event_loop, info->telnet_session.in_fd,
+                            info, 1, 1, flush_ret == TELNET_WOULD_BLOCK)) {
+        return;
+      }
+      break;
+    }
+    if (peek_ret == 0) {
+      break;
+    }
+
+    if (!may_block && FtpSessionCommandBlocks(buf)) {
+      if ((info->ftp_listener->worker_pool != NULL) &&
+          FtpWorkerPoolSubmit(info->ftp_listener->worker_pool, info)) {
+        return;
+      }
+      if (pthread_create(&thread_id, NULL,
+                         (void * (*)(void *))ConnectionTransferHandler,
+                         info) == 0) {
+        return;
+      }
+      FtpLog(LOG_ERROR, "error creating new thread, blocking event loop;");
+    }
+
+    TelnetTryReadLine(&info->telnet_session, buf, sizeof(buf));
+    FtpSessionProcessLine(&info->ftp_session, buf);
+    if (!info->ftp_session.session_active) {
+      break;
+    }
+  }
+
+  FtpEventLoopForget(info->event_loop, info->telnet_session.in_fd);
+  ConnectionCleanup(info);
+}
+
 /* clean up a connection */
 static void ConnectionCleanup(FtpConnection *info) {
   FtpListener *f;
@@ -171,5 +315,5 @@ static void ConnectionCleanup(FtpConnection *info) {
   FtpSessionDestroy(&info->ftp_session);
   TelnetDestroy(&info->telnet_session);
 
-  free(info);
+  FtpSlabFree(&f->connection_slab, info);
 }
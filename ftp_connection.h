@@ -3,6 +3,8 @@
 
 #include "ftp_listener.h"
 #include "ftp_session.h"
+#include "ftp_event_loop.h"
+#include "ftp_worker_pool.h"
 #include "telnet_session.h"
 
 typedef struct sockaddr_in SockAddr4;
@@ -10,10 +12,15 @@ typedef struct sockaddr_in SockAddr4;
 /* information for a specific connection */
 typedef struct FtpConnection {
   FtpListener *ftp_listener;
+  /* loop watching the control connection, NULL with a thread per connection */
+  FtpEventLoop *event_loop;
   TelnetSession telnet_session;
   FtpSession ftp_session;
 } FtpConnection;
 
-void *FtpConnectionAcceptor(FtpListener *f);
+void *FtpConnectionAcceptor(FtpListenerShard *s);
+void FtpConnectionReady(void *data);
+void FtpConnectionServe(void *data);
+void FtpConnectionResume(void *data);
 
 #endif /* FTP_CONNECTION_H */
@@ -0,0 +1,97 @@
+#include "ftp_event_loop.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "ftp_log.h"
+
+/* number of ready descriptors fetched per epoll_wait() */
+static const int kMaxEvents = 64;
+
+static void *EventLoopRun(FtpEventLoop *loop);
+
+int FtpEventLoopInit(FtpEventLoop *loop, void (*handler)(void *data)) {
+  assert(loop != NULL);
+  assert(handler != NULL);
+
+  loop->epoll_fd = epoll_create(kMaxEvents);
+  if (loop->epoll_fd == -1) {
+    FtpLog(LOG_ERROR, "error creating epoll instance; %s", strerror(errno));
+    return 0;
+  }
+  loop->handler = handler;
+
+  return 1;
+}
+
+int FtpEventLoopStart(FtpEventLoop *loop) {
+  if (pthread_create(&loop->thread, NULL,
+                     (void *(*)(void *))EventLoopRun, loop) != 0) {
+    FtpLog(LOG_ERROR, "unable to create event loop thread");
+    return 0;
+  }
+
+  return 1;
+}
+
+/* wait for the descriptor to become readable, the handler then owns it */
+/* until it is watched again (one shot, so only one thread runs it);    */
+/* with want_write set it waits for writable, for flushing replies, or  */
+/* on a new descriptor so the handler runs at once and can see input    */
+/* that was buffered before it was added; without want_read it waits   */
+/* for writable alone, so a client sending more than it reads can't    */
+/* keep waking the loop while its replies back up                      */
+int FtpEventLoopWatch(FtpEventLoop *loop, int fd, void *data,
+                      int rearm, int want_read, int want_write) {
+  struct epoll_event event;
+
+  assert(want_read || want_write);
+
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLONESHOT;
+  if (want_read) {
+    event.events |= EPOLLIN | EPOLLRDHUP;
+  }
+  if (want_write) {
+    event.events |= EPOLLOUT;
+  }
+  event.data.ptr = data;
+
+  if (epoll_ctl(loop->epoll_fd, rearm ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                fd, &event) != 0) {
+    FtpLog(LOG_ERROR, "error watching connection; %s", strerror(errno));
+    return 0;
+  }
+
+  return 1;
+}
+
+void FtpEventLoopForget(FtpEventLoop *loop, int fd) {
+  struct epoll_event event;
+
+  /* pre-2.6.9 kernels want a non-NULL event even for EPOLL_CTL_DEL */
+  epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, &event);
+}
+
+static void *EventLoopRun(FtpEventLoop *loop) {
+  struct epoll_event events[kMaxEvents];
+  int num_events, i;
+
+  for (;;) {
+    num_events = epoll_wait(loop->epoll_fd, events, kMaxEvents, -1);
+    if (num_events == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      FtpLog(LOG_ERROR, "error waiting for events; %s", strerror(errno));
+      return NULL;
+    }
+
+    for (i = 0; i < num_events; ++i) {
+      loop->handler(events[i].data.ptr);
+    }
+  }
+}
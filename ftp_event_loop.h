@@ -0,0 +1,24 @@
+#ifndef FTP_EVENT_LOOP_H
+#define FTP_EVENT_LOOP_H
+
+#include <pthread.h>
+
+/* a thread waiting on many control connections at once */
+typedef struct FtpEventLoop {
+  /* epoll instance holding the watched connections */
+  int epoll_fd;
+
+  /* called with the registered data when its descriptor is ready */
+  void (*handler)(void *data);
+
+  /* thread identifier for the loop */
+  pthread_t thread;
+} FtpEventLoop;
+
+int FtpEventLoopInit(FtpEventLoop *loop, void (*handler)(void *data));
+int FtpEventLoopStart(FtpEventLoop *loop);
+int FtpEventLoopWatch(FtpEventLoop *loop, int fd, void *data,
+                      int rearm, int want_read, int want_write);
+void FtpEventLoopForget(FtpEventLoop *loop, int fd);
+
+#endif /* FTP_EVENT_LOOP_H */
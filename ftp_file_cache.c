@@ -0,0 +1,309 @@
+#include "ftp_file_cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "ftp_log.h"
+
+/* shards, each with its own lock and share of the bytes, and hash */
+/* buckets in each; both powers of 2                                */
+#define NUM_SHARDS 16
+#define NUM_BUCKETS 256
+
+/* counters of how often paths are asked for, a power of 2 */
+#define SKETCH_SIZE 4096
+
+/* times a path must be asked for, recently, to be cached; a file */
+/* fetched once is not worth pushing another out for              */
+static const int kAdmitCount = 2;
+
+/* counts are halved after this many requests, so what was popular */
+/* long ago stops counting                                          */
+static const int kSketchPeriod = SKETCH_SIZE * 4;
+
+/* a part of the cache, for the paths that hash to it */
+typedef struct {
+  FtpLru lru;
+
+  /* a count-min sketch of requests per path, and requests since */
+  /* its counts were last halved                                 */
+  unsigned char sketch[SKETCH_SIZE];
+  int requests;
+
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long rejected;
+
+  pthread_mutex_t mutex;
+} Shard;
+
+/* process-wide cache of the contents of small files, keyed by path */
+/* and bounded in bytes, sharded so sessions seldom share a lock     */
+static struct {
+  int enabled;
+  int max_file;
+  Shard shards[NUM_SHARDS];
+} cache;
+
+static unsigned long long Hash(const char *path);
+static Shard *ShardOf(unsigned long long hash);
+static void Count(Shard *s, unsigned long long hash);
+static int Estimate(const Shard *s, unsigned long long hash);
+static FtpCachedFile *Lookup(const Shard *s, unsigned long long hash,
+                             const char *path);
+static int Matches(const FtpCachedFile *c, const struct stat *st);
+static void Destroy(FtpLruEntry *e);
+
+/* keep up to max_bytes of files of up to max_file bytes */
+int FtpFileCacheInit(size_t max_bytes, int max_file) {
+  int i;
+
+  assert(max_bytes > 0);
+  assert(max_file > 0);
+
+  /* a file is kept in one shard, so can be no bigger than one */
+  if ((size_t)max_file > max_bytes / NUM_SHARDS) {
+    FtpLog(LOG_WARNING, "file cache of %lu bytes keeps files of up to %lu "
+           "bytes, not %d", (unsigned long)max_bytes,
+           (unsigned long)(max_bytes / NUM_SHARDS), max_file);
+    max_file = max_bytes / NUM_SHARDS;
+  }
+
+  for (i = 0; i < NUM_SHARDS; ++i) {
+    memset(&cache.shards[i], 0, sizeof(Shard));
+    if (!FtpLruInit(&cache.shards[i].lru, NUM_BUCKETS,
+                    max_bytes / NUM_SHARDS, Destroy, NULL)) {
+      return 0;
+    }
+    cache.shards[i].lru.max_entry = max_file;
+    pthread_mutex_init(&cache.shards[i].mutex, NULL);
+  }
+  cache.max_file = max_file;
+  cache.enabled = 1;
+
+  return 1;
+}
+
+int FtpFileCacheEnabled(void) {
+  return cache.enabled;
+}
+
+/* the file at path, if it is cached and still current, to be given */
+/* back with FtpFileCacheRelease(); counts the request either way   */
+FtpCachedFile *FtpFileCacheFind(const char *path) {
+  unsigned long long hash;
+  struct stat st;
+  int found;
+  Shard *s;
+  FtpCachedFile *c;
+
+  hash = Hash(path);
+  s = ShardOf(hash);
+
+  /* outside the lock, as it may wait on the disk */
+  found = (stat(path, &st) == 0);
+
+  pthread_mutex_lock(&s->mutex);
+
+  Count(s, hash);
+  c = found ? Lookup(s, hash, path) : NULL;
+
+  /* what the file used to hold is no use to anybody */
+  if ((c != NULL) && !Matches(c, &st)) {
+    FtpLruRemove(&s->lru, &c->entry);
+    c = NULL;
+  }
+
+  if (c == NULL) {
+    s->misses++;
+  } else {
+    s->hits++;
+    FtpLruUse(&s->lru, &c->entry);
+  }
+
+  pthread_mutex_unlock(&s->mutex);
+  return c;
+}
+
+/* whether the file at path, which st describes, should be read in */
+/* and cached: it is a small, regular file asked for often enough   */
+int FtpFileCacheAdmit(const char *path, const struct stat *st) {
+  unsigned long long hash;
+  Shard *s;
+  int admit;
+
+  if (!cache.enabled || !S_ISREG(st->st_mode) ||
+      (st->st_size > cache.max_file)) {
+    return 0;
+  }
+
+  hash = Hash(path);
+  s = ShardOf(hash);
+
+  pthread_mutex_lock(&s->mutex);
+  admit = (Estimate(s, hash) >= kAdmitCount) &&
+          FtpLruFits(&s->lru, (size_t)st->st_size);
+  if (!admit) {
+    s->rejected++;
+  }
+  pthread_mutex_unlock(&s->mutex);
+
+  return admit;
+}
+
+/* cache len bytes of data (from malloc) as the file at path, which st */
+/* describes, taking ownership of them; returns NULL, leaving data     */
+/* with the caller, if it won't fit or there is no memory              */
+FtpCachedFile *FtpFileCacheInsert(const char *path, const struct stat *st,
+                                  char *data, int len) {
+  unsigned long long hash;
+  FtpCachedFile *c, *old;
+  size_t path_len;
+  Shard *s;
+
+  hash = Hash(path);
+  s = ShardOf(hash);
+  if (!FtpLruFits(&s->lru, (size_t)len)) {
+    return NULL;
+  }
+
+  path_len = strlen(path);
+  c = (FtpCachedFile *)malloc(sizeof(FtpCachedFile) + path_len + 1);
+  if (c == NULL) {
+    return NULL;
+  }
+
+  c->data = data;
+  c->len = len;
+  memcpy(c + 1, path, path_len + 1);
+  c->path = (const char *)(c + 1);
+  c->dev = st->st_dev;
+  c->ino = st->st_ino;
+  c->mtime = st->st_mtim;
+  c->ctime = st->st_ctim;
+
+  pthread_mutex_lock(&s->mutex);
+
+  /* replace any other copy, e.g. by a session that missed too */
+  old = Lookup(s, hash, path);
+  if (old != NULL) {
+    FtpLruRemove(&s->lru, &old->entry);
+  }
+  FtpLruInsert(&s->lru, &c->entry, hash, len);
+
+  pthread_mutex_unlock(&s->mutex);
+  return c;
+}
+
+/* done sending a file from FtpFileCacheFind() or FtpFileCacheInsert() */
+void FtpFileCacheRelease(FtpCachedFile *c) {
+  Shard *s;
+
+  s = ShardOf(c->entry.hash);
+  pthread_mutex_lock(&s->mutex);
+  FtpLruRelease(&s->lru, &c->entry);
+  pthread_mutex_unlock(&s->mutex);
+}
+
+void FtpFileCacheStats(unsigned long *hits, unsigned long *misses,
+                       unsigned long *evictions, unsigned long *rejected,
+                       size_t *bytes, int *entries) {
+  int i;
+  Shard *s;
+
+  *hits = *misses = *evictions = *rejected = 0;
+  *bytes = 0;
+  *entries = 0;
+  for (i = 0; i < NUM_SHARDS; ++i) {
+    s = &cache.shards[i];
+    pthread_mutex_lock(&s->mutex);
+    *hits += s->hits;
+    *misses += s->misses;
+    *evictions += s->lru.evictions;
+    *rejected += s->rejected;
+    *bytes += s->lru.bytes;
+    *entries += s->lru.entries;
+    pthread_mutex_unlock(&s->mutex);
+  }
+}
+
+/* FNV-1a, with the bits mixed so shard, bucket and sketch each get */
+/* some of them                                                     */
+static unsigned long long Hash(const char *path) {
+  unsigned long long h;
+
+  h = 0xcbf29ce484222325ULL;
+  while (*path != '\0') {
+    h ^= (unsigned char)*path++;
+    h *= 0x100000001b3ULL;
+  }
+
+  return h * 0x9E3779B97F4A7C15ULL;
+}
+
+static Shard *ShardOf(unsigned long long hash) {
+  return &cache.shards[hash >> 60];
+}
+
+/* one more request for the path with this hash */
+static void Count(Shard *s, unsigned long long hash) {
+  unsigned char *a, *b;
+  int i;
+
+  a = &s->sketch[(hash >> 20) & (SKETCH_SIZE - 1)];
+  b = &s->sketch[(hash >> 40) & (SKETCH_SIZE - 1)];
+  if (*a < 255) {
+    (*a)++;
+  }
+  if (*b < 255) {
+    (*b)++;
+  }
+
+  if (++s->requests == kSketchPeriod) {
+    for (i = 0; i < SKETCH_SIZE; ++i) {
+      s->sketch[i] >>= 1;
+    }
+    s->requests = 0;
+  }
+}
+
+/* about how many times the path with this hash was asked for */
+static int Estimate(const Shard *s, unsigned long long hash) {
+  int a, b;
+
+  a = s->sketch[(hash >> 20) & (SKETCH_SIZE - 1)];
+  b = s->sketch[(hash >> 40) & (SKETCH_SIZE - 1)];
+
+  return (a < b) ? a : b;
+}
+
+/* the cached copy of the file at path, or NULL */
+static FtpCachedFile *Lookup(const Shard *s, unsigned long long hash,
+                             const char *path) {
+  FtpLruEntry *e;
+
+  for (e = FtpLruChain(&s->lru, hash); e != NULL; e = e->hash_next) {
+    if ((e->hash == hash) &&
+        (strcmp(((FtpCachedFile *)e)->path, path) == 0)) {
+      return (FtpCachedFile *)e;
+    }
+  }
+
+  return NULL;
+}
+
+/* whether the copy is of the file as it is now */
+static int Matches(const FtpCachedFile *c, const struct stat *st) {
+  return (c->dev == st->st_dev) && (c->ino == st->st_ino) &&
+         (c->len == st->st_size) &&
+         (c->mtime.tv_sec == st->st_mtim.tv_sec) &&
+         (c->mtime.tv_nsec == st->st_mtim.tv_nsec) &&
+         (c->ctime.tv_sec == st->st_ctim.tv_sec) &&
+         (c->ctime.tv_nsec == st->st_ctim.tv_nsec);
+}
+
+static void Destroy(FtpLruEntry *e) {
+  free(((FtpCachedFile *)e)->data);
+  free(e);
+}
@@ -0,0 +1,40 @@
+#ifndef FTP_FILE_CACHE_H
+#define FTP_FILE_CACHE_H
+
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "ftp_lru.h"
+
+/* a small file held in memory, as it was when last changed */
+typedef struct FtpCachedFile {
+  /* place in the cache, and a hash of the path */
+  FtpLruEntry entry;
+
+  /* its contents */
+  char *data;
+  int len;
+
+  /* where it is */
+  const char *path;
+
+  /* what it holds: the file, and when it last changed */
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  struct timespec ctime;
+} FtpCachedFile;
+
+int FtpFileCacheInit(size_t max_bytes, int max_file);
+int FtpFileCacheEnabled(void);
+FtpCachedFile *FtpFileCacheFind(const char *path);
+int FtpFileCacheAdmit(const char *path, const struct stat *st);
+FtpCachedFile *FtpFileCacheInsert(const char *path, const struct stat *st,
+                                  char *data, int len);
+void FtpFileCacheRelease(FtpCachedFile *c);
+void FtpFileCacheStats(unsigned long *hits, unsigned long *misses,
+                       unsigned long *evictions, unsigned long *rejected,
+                       size_t *bytes, int *entries);
+
+#endif /* FTP_FILE_CACHE_H */
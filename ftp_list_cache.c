@@ -0,0 +1,177 @@
+#include "ftp_list_cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <assert.h>
+
+/* hash buckets, a power of 2 */
+#define NUM_BUCKETS 1024
+
+/* seconds a listing is trusted for: a file changed in place leaves */
+/* its directory's times alone, so its size and date would go stale */
+static const int kMaxAge = 30;
+
+/* process-wide cache of rendered listings, bounded in bytes and */
+/* evicting the least recently used first */
+static struct {
+  int enabled;
+  FtpLru lru;
+
+  unsigned long hits;
+  unsigned long misses;
+
+  pthread_mutex_t mutex;
+} cache = { 0, { NULL }, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+static unsigned long long Hash(dev_t dev, ino_t ino, int kind);
+static FtpListing *Lookup(unsigned long long hash, const struct stat *dir,
+                          int kind);
+static int Matches(const FtpListing *l, const struct stat *dir, int kind);
+static void Destroy(FtpLruEntry *e);
+
+int FtpListCacheInit(size_t max_bytes) {
+  assert(max_bytes > 0);
+
+  if (!FtpLruInit(&cache.lru, NUM_BUCKETS, max_bytes, Destroy, NULL)) {
+    return 0;
+  }
+  cache.enabled = 1;
+
+  return 1;
+}
+
+int FtpListCacheEnabled(void) {
+  return cache.enabled;
+}
+
+/* the biggest listing the cache takes */
+int FtpListCacheMaxListing(void) {
+  if (cache.lru.max_bytes / 4 > INT_MAX) {
+    return INT_MAX;
+  }
+  return cache.lru.max_bytes / 4;
+}
+
+/* the listing of dir, if it is cached and still current, */
+/* to be given back with FtpListCacheRelease() */
+FtpListing *FtpListCacheFind(const struct stat *dir, int kind) {
+  FtpListing *l;
+
+  pthread_mutex_lock(&cache.mutex);
+
+  l = Lookup(Hash(dir->st_dev, dir->st_ino, kind), dir, kind);
+
+  /* an old rendering of the directory is no use to anybody */
+  if ((l != NULL) &&
+      (!Matches(l, dir, kind) || (time(NULL) - l->created > kMaxAge))) {
+    FtpLruRemove(&cache.lru, &l->entry);
+    l = NULL;
+  }
+
+  if (l == NULL) {
+    cache.misses++;
+  } else {
+    cache.hits++;
+    FtpLruUse(&cache.lru, &l->entry);
+  }
+
+  pthread_mutex_unlock(&cache.mutex);
+  return l;
+}
+
+/* cache len bytes of data (from malloc) as the listing of dir, taking  */
+/* ownership of them; returns NULL, leaving data with the caller, if it */
+/* won't fit or there is no memory */
+FtpListing *FtpListCacheInsert(const struct stat *dir, int kind,
+                               char *data, int len) {
+  unsigned long long hash;
+  FtpListing *l, *old;
+
+  if (!cache.enabled || !FtpLruFits(&cache.lru, (size_t)len)) {
+    return NULL;
+  }
+  l = (FtpListing *)malloc(sizeof(FtpListing));
+  if (l == NULL) {
+    return NULL;
+  }
+
+  l->data = data;
+  l->len = len;
+  l->dev = dir->st_dev;
+  l->ino = dir->st_ino;
+  l->mtime = dir->st_mtim;
+  l->ctime = dir->st_ctim;
+  l->kind = kind;
+  l->created = time(NULL);
+  hash = Hash(l->dev, l->ino, kind);
+
+  pthread_mutex_lock(&cache.mutex);
+
+  /* replace any other rendering, e.g. by a session that missed too */
+  old = Lookup(hash, dir, kind);
+  if (old != NULL) {
+    FtpLruRemove(&cache.lru, &old->entry);
+  }
+  FtpLruInsert(&cache.lru, &l->entry, hash, len);
+
+  pthread_mutex_unlock(&cache.mutex);
+  return l;
+}
+
+/* done sending a listing from FtpListCacheFind() or FtpListCacheInsert() */
+void FtpListCacheRelease(FtpListing *l) {
+  pthread_mutex_lock(&cache.mutex);
+  FtpLruRelease(&cache.lru, &l->entry);
+  pthread_mutex_unlock(&cache.mutex);
+}
+
+void FtpListCacheStats(unsigned long *hits, unsigned long *misses,
+                       unsigned long *evictions, size_t *bytes, int *entries) {
+  pthread_mutex_lock(&cache.mutex);
+  *hits = cache.hits;
+  *misses = cache.misses;
+  *evictions = cache.lru.evictions;
+  *bytes = cache.lru.bytes;
+  *entries = cache.lru.entries;
+  pthread_mutex_unlock(&cache.mutex);
+}
+
+static unsigned long long Hash(dev_t dev, ino_t ino, int kind) {
+  unsigned long long h;
+
+  h = ((unsigned long long)ino ^ ((unsigned long long)dev << 32)) * 2 + kind;
+
+  return h * 0x9E3779B97F4A7C15ULL;
+}
+
+/* the cached listing of dir, or NULL */
+static FtpListing *Lookup(unsigned long long hash, const struct stat *dir,
+                          int kind) {
+  FtpLruEntry *e;
+  FtpListing *l;
+
+  for (e = FtpLruChain(&cache.lru, hash); e != NULL; e = e->hash_next) {
+    l = (FtpListing *)e;
+    if ((l->dev == dir->st_dev) && (l->ino == dir->st_ino) &&
+        (l->kind == kind)) {
+      return l;
+    }
+  }
+
+  return NULL;
+}
+
+/* whether the listing is of the directory as it is now */
+static int Matches(const FtpListing *l, const struct stat *dir, int kind) {
+  return (l->kind == kind) &&
+         (l->mtime.tv_sec == dir->st_mtim.tv_sec) &&
+         (l->mtime.tv_nsec == dir->st_mtim.tv_nsec) &&
+         (l->ctime.tv_sec == dir->st_ctim.tv_sec) &&
+         (l->ctime.tv_nsec == dir->st_ctim.tv_nsec);
+}
+
+static void Destroy(FtpLruEntry *e) {
+  free(((FtpListing *)e)->data);
+  free(e);
+}
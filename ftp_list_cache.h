@@ -0,0 +1,44 @@
+#ifndef FTP_LIST_CACHE_H
+#define FTP_LIST_CACHE_H
+
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "ftp_lru.h"
+
+/* kinds of listing */
+#define LISTING_FULL   0
+#define LISTING_NAMES  1
+
+/* a rendered listing of a directory, as it was when last changed */
+typedef struct FtpListing {
+  /* place in the cache */
+  FtpLruEntry entry;
+
+  /* the bytes sent over the data connection */
+  char *data;
+  int len;
+
+  /* what it lists: the directory, when it last changed, and how */
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  struct timespec ctime;
+  int kind;
+
+  /* when it was rendered */
+  time_t created;
+} FtpListing;
+
+int FtpListCacheInit(size_t max_bytes);
+int FtpListCacheEnabled(void);
+int FtpListCacheMaxListing(void);
+FtpListing *FtpListCacheFind(const struct stat *dir, int kind);
+FtpListing *FtpListCacheInsert(const struct stat *dir, int kind,
+                               char *data, int len);
+void FtpListCacheRelease(FtpListing *l);
+void FtpListCacheStats(unsigned long *hits, unsigned long *misses,
+                       unsigned long *evictions, size_t *bytes, int *entries);
+
+#endif /* FTP_LIST_CACHE_H */
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "ftp_listener.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,24 +14,41 @@
 #include "ftpd.h"
 #include "ftp_log.h"
 #include "ftp_session.h"
+#include "ftp_command.h"
 #include "ftp_connection.h"
+#include "ftp_event_loop.h"
+#include "ftp_worker_pool.h"
+#include "ftp_timer.h"
+#include "ftp_list_cache.h"
+#include "file_list.h"
+#include "ftp_stat.h"
+#include "ftp_xfer_log.h"
+#include "ftp_text_cache.h"
+#include "ftp_read_hint.h"
+#include "ftp_file_cache.h"
+#include "ftp_passive_port.h"
+#include "ftp_pasv_pool.h"
 #include "telnet_session.h"
 
 static const int kAddrBufLen = 100;
 
-static int SocketSetup(char *address, int port);
+static int SocketSetup(char *address, int port, int reuseport);
 
 /* initialize an FTP listener */
 int FtpListenerInit(FtpListener *f, char *address, int port,
-                    int max_connections, int inactivity_timeout) {
+                    int max_connections, int inactivity_timeout,
+                    int num_shards) {
+  FtpListenerShard *shards;
   int sock_fd;
   int pipefds[2];
   char dir[PATH_MAX + 1];
+  int i, num_cpus;
 
   assert(f != NULL);
   assert(port >= 0);
   assert(port < 65536);
   assert(max_connections > 0);
+  assert(num_shards > 0);
 
   /* Gets current directory */
   if (getcwd(dir, sizeof(dir)) == NULL) {
@@ -38,25 +56,83 @@ int FtpListenerInit(FtpListener *f, char *address, int port,
     return 0;
   }
 
-  /* Sets up socket */
-  sock_fd = SocketSetup(address, port);
-  if (-1 == sock_fd) {
-    FtpLog(LOG_ERROR, "error setting up socket;");
+  shards = (FtpListenerShard *)malloc(sizeof(FtpListenerShard) * num_shards);
+  if (shards == NULL) {
+    FtpLog(LOG_ERROR, "out of memory creating listener shards");
     return 0;
   }
 
-  /* Creates a pipe to wake up our listening thread */
+  /* Sets up sockets, pinning each acceptor of a sharded listener */
+  /* to its own processor */
+  num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  for (i = 0; i < num_shards; ++i) {
+    sock_fd = SocketSetup(address, port, num_shards > 1);
+    if (-1 == sock_fd) {
+      FtpLog(LOG_ERROR, "error setting up socket;");
+      while (--i >= 0) {
+        close(shards[i].sock_fd);
+      }
+      free(shards);
+      return 0;
+    }
+    shards[i].listener = f;
+    shards[i].sock_fd = sock_fd;
+    shards[i].cpu = ((num_shards > 1) && (num_cpus > 0)) ? i % num_cpus : -1;
+  }
+
+  /* Preallocates a connection object for every client we allow */
+  if (!FtpSlabInit(&f->connection_slab, sizeof(FtpConnection),
+                   max_connections)) {
+    for (i = 0; i < num_shards; ++i) {
+      close(shards[i].sock_fd);
+    }
+    free(shards);
+    return 0;
+  }
+
+  /* Creates a pipe to wake up our listening threads */
   if (pipe(pipefds) != 0) {
-    close(sock_fd);
+    for (i = 0; i < num_shards; ++i) {
+      close(shards[i].sock_fd);
+    }
+    free(shards);
     FtpLog(LOG_ERROR, "error creating pipe for internal use;");
     return 0;
   }
 
   /* Loads the values into the structure */
-  f->sock_fd = sock_fd;
+  f->num_shards = num_shards;
+  f->shards = shards;
   f->max_connections = max_connections;
   f->num_connections = 0;
   f->inactivity_timeout = inactivity_timeout;
+  f->transfer_timeout = 0;
+  f->list_cache_size = 0;
+  f->list_sort_limit = 0;
+  f->list_stream = 0;
+  f->list_spill_fd = -1;
+  f->stat_engine = "sync";
+  f->stat_threads = 0;
+  f->text_cache_size = 0;
+  f->text_cache_policy = 0;
+  f->text_cache_fd = -1;
+  f->xfer_log_dir_fd = -1;
+  f->xfer_log_name = NULL;
+  f->xfer_log_size = 0;
+  f->xfer_log_keep = 0;
+  f->read_ahead = 0;
+  f->drop_behind_size = 0;
+  f->file_cache_size = 0;
+  f->file_cache_max_file = 0;
+  f->pasv_port_low = IPPORT_RESERVED;
+  f->pasv_port_high = 65535;
+  f->pasv_pool_size = 0;
+  f->num_event_loops = 0;
+  f->event_loops = NULL;
+  f->next_event_loop = 0;
+  f->num_workers = 0;
+  f->worker_queue_depth = 0;
+  f->worker_pool = NULL;
   f->shutdown_request_send_fd = pipefds[1];
   f->shutdown_request_recv_fd = pipefds[0];
   pthread_mutex_init(&f->mutex, NULL);
@@ -71,23 +147,128 @@ int FtpListenerInit(FtpListener *f, char *address, int port,
 
 /* Ready to accept connections */
 int FtpListenerStart(FtpListener *f) {
-  pthread_t thread_id;
+  int i, pasv_pool_size;
+
+  /* start the timer wheel, workers and event loops before any */
+  /* connection can be handed to them */
+  if (((f->inactivity_timeout > 0) || (f->transfer_timeout > 0)) &&
+      !FtpTimerWheelStart()) {
+    FtpLog(LOG_ERROR, "unable to start timer wheel");
+    return 0;
+  }
+
+  SetFileListLimits(f->list_sort_limit, f->list_stream, f->list_spill_fd);
+
+  if (!FtpStatInit(f->stat_engine, f->stat_threads)) {
+    FtpLog(LOG_ERROR, "unable to start metadata engine");
+    return 0;
+  }
+  FtpLog(LOG_INFO, "looking up file metadata with %s", FtpStatEngine());
+
+  if ((f->text_cache_size > 0) && (f->text_cache_fd != -1) &&
+      !FtpTextCacheInit(f->text_cache_fd, (size_t)f->text_cache_size << 20,
+                        f->text_cache_policy)) {
+    FtpLog(LOG_ERROR, "unable to start text cache");
+    return 0;
+  }
 
-  if (pthread_create(&thread_id, NULL,
-                     (void *(*)(void *))FtpConnectionAcceptor, f)) {
-    FtpLog(LOG_ERROR, "unable to create ftp listening thread");
+  if ((f->xfer_log_dir_fd != -1) &&
+      !FtpXferLogInit(f->xfer_log_dir_fd, f->xfer_log_name,
+                      f->xfer_log_size, f->xfer_log_keep)) {
+    FtpLog(LOG_ERROR, "unable to start transfer log");
     return 0;
   }
 
+  FtpReadHintInit((off_t)f->read_ahead << 20, (off_t)f->drop_behind_size << 20);
+
+  if (!FtpPassivePortInit(f->pasv_port_low, f->pasv_port_high)) {
+    FtpLog(LOG_ERROR, "unable to set up passive ports");
+    return 0;
+  }
+
+  /* idle pooled sockets may hold no more than a quarter of the ports */
+  pasv_pool_size = f->pasv_pool_size;
+  if (pasv_pool_size > (f->pasv_port_high - f->pasv_port_low + 1) / 4) {
+    pasv_pool_size = (f->pasv_port_high - f->pasv_port_low + 1) / 4;
+  }
+  if ((pasv_pool_size > 0) && !FtpPasvPoolInit(pasv_pool_size)) {
+    FtpLog(LOG_ERROR, "unable to start passive socket pool");
+    return 0;
+  }
+
+  if ((f->file_cache_size > 0) &&
+      !FtpFileCacheInit((size_t)f->file_cache_size << 20,
+                        f->file_cache_max_file << 10)) {
+    FtpLog(LOG_ERROR, "unable to start file cache");
+    return 0;
+  }
+
+  if ((f->list_cache_size > 0) &&
+      !FtpListCacheInit((size_t)f->list_cache_size << 20)) {
+    FtpLog(LOG_ERROR, "unable to start listing cache");
+    return 0;
+  }
+
+  if (f->num_workers > 0) {
+    f->worker_pool = (FtpWorkerPool *)malloc(sizeof(FtpWorkerPool));
+    if (f->worker_pool == NULL) {
+      FtpLog(LOG_ERROR, "out of memory creating worker pool");
+      return 0;
+    }
+    if (!FtpWorkerPoolInit(f->worker_pool, f->num_workers,
+                           f->worker_queue_depth,
+                           (f->num_event_loops > 0) ? FtpConnectionResume
+                                                    : FtpConnectionServe)) {
+      FtpLog(LOG_ERROR, "unable to start worker pool");
+      return 0;
+    }
+  }
+
+  if (f->num_event_loops > 0) {
+    f->event_loops = (FtpEventLoop *)malloc(sizeof(FtpEventLoop) *
+                                            f->num_event_loops);
+    if (f->event_loops == NULL) {
+      FtpLog(LOG_ERROR, "out of memory creating event loops");
+      return 0;
+    }
+    for (i = 0; i < f->num_event_loops; ++i) {
+      if (!FtpEventLoopInit(&f->event_loops[i], FtpConnectionReady) ||
+          !FtpEventLoopStart(&f->event_loops[i])) {
+        FtpLog(LOG_ERROR, "unable to start event loop %d", i);
+        return 0;
+      }
+    }
+  }
+
+  for (i = 0; i < f->num_shards; ++i) {
+    if (pthread_create(&f->shards[i].thread, NULL,
+                       (void *(*)(void *))FtpConnectionAcceptor,
+                       &f->shards[i])) {
+      FtpLog(LOG_ERROR, "unable to create ftp listening thread");
+      return 0;
+    }
+    if (f->shards[i].cpu != -1) {
+      cpu_set_t cpus;
+
+      CPU_ZERO(&cpus);
+      CPU_SET(f->shards[i].cpu, &cpus);
+      if (pthread_setaffinity_np(f->shards[i].thread,
+                                 sizeof(cpus), &cpus) != 0) {
+        FtpLog(LOG_WARNING, "unable to pin listening thread to cpu %d",
+               f->shards[i].cpu);
+      }
+    }
+  }
+
   f->listener_running = 1;
-  f->listener_thread = thread_id;
 
   return 1;
 }
 
 
 void FtpListenerStop(FtpListener *f) {
-  /* write a byte to the listening thread - this will wake it up */
+  /* write a byte to the listening threads - nobody reads it, so */
+  /* this will wake all of them up */
   write(f->shutdown_request_send_fd, "", 1);
 
   /* wait for client connections to complete */
@@ -98,9 +279,83 @@ void FtpListenerStop(FtpListener *f) {
   }
 
   pthread_mutex_unlock(&f->mutex);
+
+  FtpStatShutdown();
+  FtpXferLogShutdown();
+  FtpPasvPoolShutdown();
+}
+
+/* log the listener's counters */
+void FtpListenerReport(FtpListener *f) {
+  unsigned long hits, misses, evictions;
+  unsigned long rejected;
+  unsigned long allocated, collisions, exhausted, avg_nsec, max_nsec;
+  int in_use, ports, pooled;
+  unsigned long files, major_faults, blocks_in, stall_usec;
+  size_t bytes;
+  int entries;
+
+  pthread_mutex_lock(&f->mutex);
+  FtpLog(LOG_INFO, "connections: %d of %d", f->num_connections,
+         f->max_connections);
+  pthread_mutex_unlock(&f->mutex);
+
+  FtpSlabStats(&f->connection_slab, &hits, &misses);
+  FtpLog(LOG_INFO, "connection pool: %lu hits, %lu misses", hits, misses);
+
+  if (FtpListCacheEnabled()) {
+    FtpListCacheStats(&hits, &misses, &evictions, &bytes, &entries);
+    FtpLog(LOG_INFO, "listing cache: %lu hits, %lu misses (%lu%% hits), "
+           "%lu evictions, %lu bytes in %d listings", hits, misses,
+           (hits + misses > 0) ? (hits * 100) / (hits + misses) : 0UL,
+           evictions, (unsigned long)bytes, entries);
+  }
+
+  if (FtpTextCacheEnabled()) {
+    FtpTextCacheStats(&hits, &misses, &evictions, &bytes, &entries);
+    FtpLog(LOG_INFO, "text cache: %lu hits, %lu misses (%lu%% hits), "
+           "%lu evictions, %lu bytes in %d files", hits, misses,
+           (hits + misses > 0) ? (hits * 100) / (hits + misses) : 0UL,
+           evictions, (unsigned long)bytes, entries);
+  }
+
+  if (FtpFileCacheEnabled()) {
+    FtpFileCacheStats(&hits, &misses, &evictions, &rejected, &bytes,
+                      &entries);
+    FtpLog(LOG_INFO, "file cache: %lu hits, %lu misses (%lu%% hits), "
+           "%lu evictions, %lu not admitted, %lu bytes in %d files", hits,
+           misses, (hits + misses > 0) ? (hits * 100) / (hits + misses) : 0UL,
+           evictions, rejected, (unsigned long)bytes, entries);
+  }
+
+  FtpPassivePortStats(&in_use, &ports, &allocated, &collisions, &exhausted,
+                      &avg_nsec, &max_nsec);
+  FtpLog(LOG_INFO, "passive ports: %d of %d in use, %lu allocated in "
+         "%lu ns on average (%lu ns at most), %lu taken elsewhere, "
+         "%lu times none free", in_use, ports, allocated, avg_nsec,
+         max_nsec, collisions, exhausted);
+
+  if (FtpPasvPoolEnabled()) {
+    FtpPasvPoolStats(&hits, &misses, &pooled);
+    FtpLog(LOG_INFO, "passive socket pool: %lu hits, %lu misses (%lu%% hits), "
+           "%d listening", hits, misses,
+           (hits + misses > 0) ? (hits * 100) / (hits + misses) : 0UL,
+           pooled);
+  }
+
+  FtpReadHintStats(&files, &major_faults, &blocks_in, &stall_usec);
+  FtpLog(LOG_INFO, "file reads: %lu files, %lu major faults, %lu blocks in, "
+         "%lu.%06lu seconds stalled", files, major_faults, blocks_in,
+         stall_usec / 1000000, stall_usec % 1000000);
+
+  FtpCommandReport();
+
+  if (FtpLogDropped() > 0) {
+    FtpLog(LOG_INFO, "log: %lu lines dropped", FtpLogDropped());
+  }
 }
 
-static int SocketSetup(char *address, int port) {
+static int SocketSetup(char *address, int port, int reuseport) {
   struct sockaddr_in sock_addr;
   int reuseaddr = 1;
   int sock_fd;
@@ -167,6 +422,13 @@ static int SocketSetup(char *address, int port) {
     return -1;
   }
 
+  if (reuseport && setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT,
+                              (void *)&reuseaddr, sizeof(int)) != 0) {
+    close(sock_fd);
+    FtpLog(LOG_ERROR, "error setting socket to reuse port; %s", strerror(errno));
+    return -1;
+  }
+
   if (bind(sock_fd, (struct sockaddr *)&sock_addr,
            sizeof(struct sockaddr_in)) != 0)  {
     close(sock_fd);
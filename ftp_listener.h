@@ -5,19 +5,91 @@
 
 #include <limits.h>
 #include <pthread.h>
+#include "ftp_slab.h"
 
+struct FtpEventLoop;
+struct FtpWorkerPool;
+struct FtpListener;
+
+/* one listening socket and the thread accepting on it */
 typedef struct {
+  /* listener this shard belongs to */
+  struct FtpListener *listener;
+
   /* file descriptor incoming connections arrive on */
   int sock_fd;
 
+  /* processor the accepting thread is pinned to, -1 for none */
+  int cpu;
+
+  /* thread identifier for the accepting thread */
+  pthread_t thread;
+} FtpListenerShard;
+
+typedef struct FtpListener {
+  /* listening sockets, several bound to the same port with SO_REUSEPORT */
+  /* so the kernel spreads incoming connections over their acceptors    */
+  int num_shards;
+  FtpListenerShard *shards;
+
   /* maximum number of connections */
   int max_connections;
 
   /* current number of connections */
   int num_connections;
 
-  /* timeout (in seconds) for connections */
+  /* recycles FtpConnection objects, preallocated for max_connections */
+  FtpSlab connection_slab;
+
+  /* timeout (in seconds) for connections waiting between commands, */
+  /* and for transfers making no progress (0 to wait forever)        */
   int inactivity_timeout;
+  int transfer_timeout;
+
+  /* megabytes of rendered directory listings to keep (0 for none) */
+  int list_cache_size;
+
+  /* entries a listing sorts in memory (0 for no limit), whether bigger */
+  /* directories are listed unsorted instead, and the directory their   */
+  /* sorted runs are spilled to (or -1)                                 */
+  int list_sort_limit;
+  int list_stream;
+  int list_spill_fd;
+
+  /* how the files of a listing are looked up, see FtpStatInit() */
+  const char *stat_engine;
+  int stat_threads;
+
+  /* megabytes of text files converted for ASCII transfers to keep */
+  /* (0 for none), which to drop first, and where they are kept     */
+  int text_cache_size;
+  int text_cache_policy;
+  int text_cache_fd;
+
+  /* file in xfer_log_dir_fd recording transfers (-1 for none), the */
+  /* bytes it is rotated at (0 for never), and rotated files kept    */
+  int xfer_log_dir_fd;
+  const char *xfer_log_name;
+  long xfer_log_size;
+  int xfer_log_keep;
+
+  /* megabytes read ahead of a download (0 for the kernel's default), */
+  /* and megabytes from which downloads drop what they have sent from */
+  /* the page cache (0 for never)                                     */
+  int read_ahead;
+  int drop_behind_size;
+
+  /* megabytes of small files to keep in memory (0 for none), and */
+  /* kilobytes in the biggest one kept                             */
+  int file_cache_size;
+  int file_cache_max_file;
+
+  /* ports passive data connections are made to, inclusive */
+  int pasv_port_low;
+  int pasv_port_high;
+
+  /* passive sockets kept listening for each address (0 for none) */
+  int pasv_pool_size;
 
   /* starting directory */
   char dir[PATH_MAX + 1];
@@ -25,13 +97,26 @@ typedef struct {
   /* boolean defining whether listener is running or not */
   int listener_running;
 
+  /* number of event loops sharing control connections (0 for a thread */
+  /* per connection), the loops, and the loop getting the next one      */
+  int num_event_loops;
+  struct FtpEventLoop *event_loops;
+  unsigned int next_event_loop;
+
+  /* size of the pre-spawned worker pool (0 for none), the depth of its */
+  /* hand-off queue, and the pool; with event loops the workers run    */
+  /* commands that may block, otherwise they run whole sessions        */
+  int num_workers;
+  int worker_queue_depth;
+  struct FtpWorkerPool *worker_pool;
+
   /* thread identifier for listener */
   pthread_t listener_thread;
 
-  /* end of pipe to wake up listening thread with */
+  /* end of pipe to wake up listening threads with */
   int shutdown_request_send_fd;
 
-  /* end of pipe listening thread waits on */
+  /* end of pipe listening threads wait on */
   int shutdown_request_recv_fd;
 
   /* mutext to lock changes to this structure */
@@ -43,6 +128,10 @@ typedef struct {
 } FtpListener;
 
 int FtpListenerInit(FtpListener *f, char *address, int port,
-                    int max_connections, int inactivity_timeout);
+                    int max_connections, int inactivity_timeout,
+                    int num_shards);
+int FtpListenerStart(FtpListener *f);
+void FtpListenerStop(FtpListener *f);
+void FtpListenerReport(FtpListener *f);
 
 #endif // FTP_SERVER_H
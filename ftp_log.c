@@ -1,6 +1,17 @@
+#define _GNU_SOURCE
 #include "ftp_log.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/uio.h>
 #include <assert.h>
 
 static const char *log_header[] = {
@@ -9,17 +20,369 @@ static const char *log_header[] = {
 
 static const int kMaxCode = sizeof(log_header) / sizeof(log_header[0]);
 
-int FtpLog(int code, const char *fmt, ...) {
+int ftp_log_level = LOG_DEBUG;
+
+/* longest line logged; longer ones are cut short */
+#define LOG_LINE_LEN 1024
+
+/* bytes of lines each thread may have waiting to be written */
+#define LOG_RING_SIZE (16 * 1024)
+
+/* spans gathered into one writev() */
+#define LOG_IOV_MAX 64
+
+/* one thread's lines, waiting for the flusher; the thread only moves */
+/* tail and the flusher only moves head, so neither takes a lock       */
+typedef struct LogRing {
+  char data[LOG_RING_SIZE];
+  unsigned long head;
+  unsigned long tail;
+
+  /* set once the thread has exited, so the flusher frees it when empty */
+  int orphaned;
+
+  struct LogRing *next;
+} LogRing;
+
+/* a thread's last formatted second, as "YYYY-MM-DD HH:MM:SS" */
+typedef struct {
+  time_t second;
+  char text[20];
+} LogClock;
+
+static void FormatLine(char *line, int *len, int code,
+                       const char *fmt, va_list ap);
+static void WriteSync(const char *line, int len);
+static LogRing *GetRing(void);
+static void OrphanRing(LogRing *r);
+static void *FlushRun(void *arg);
+static int FlushRings(void);
+static int AnyPending(void);
+
+static struct {
+  /* 0 writes each line as it is logged */
+  int running;
+  int policy;
+
+  /* every thread's ring, added to under the mutex */
+  pthread_mutex_t mutex;
+  LogRing *rings;
+  pthread_key_t ring_key;
+
+  /* the flusher, and how it is woken when it has gone to sleep */
+  pthread_t flusher;
+  sem_t wake;
+  int sleeping;
+  int stopping;
+
+  unsigned long dropped;
+} logger = { 0 };
+
+static __thread LogClock log_clock = { -1, "" };
+
+int FtpLogWrite(int code, const char *fmt, ...) {
+  char line[LOG_LINE_LEN];
+  unsigned long head, tail, pos;
+  int len, first;
   va_list ap;
+  LogRing *r;
 
   assert(code < kMaxCode);
 
   va_start(ap, fmt);
-  printf("%s: ", log_header[code]);
-  vprintf(fmt, ap);
-
-  putchar('\n');
+  FormatLine(line, &len, code, fmt, ap);
   va_end(ap);
 
+  r = __atomic_load_n(&logger.running, __ATOMIC_ACQUIRE) ? GetRing() : NULL;
+  if (r == NULL) {
+    WriteSync(line, len);
+    return 0;
+  }
+
+  /* wait for room, or give up on the line */
+  tail = r->tail;
+  for (;;) {
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    if (tail + len - head <= LOG_RING_SIZE) {
+      break;
+    }
+    if (logger.policy == LOG_OVERFLOW_DROP) {
+      __atomic_fetch_add(&logger.dropped, 1, __ATOMIC_RELAXED);
+      return 0;
+    }
+    if (__atomic_exchange_n(&logger.sleeping, 0, __ATOMIC_SEQ_CST)) {
+      sem_post(&logger.wake);
+    }
+    usleep(100);
+  }
+
+  pos = tail % LOG_RING_SIZE;
+  first = LOG_RING_SIZE - pos;
+  if (first >= len) {
+    memcpy(r->data + pos, line, len);
+  } else {
+    memcpy(r->data + pos, line, first);
+    memcpy(r->data, line + first, len - first);
+  }
+  __atomic_store_n(&r->tail, tail + len, __ATOMIC_SEQ_CST);
+
+  /* wake the flusher if it went to sleep before seeing this */
+  if (__atomic_load_n(&logger.sleeping, __ATOMIC_SEQ_CST) &&
+      __atomic_exchange_n(&logger.sleeping, 0, __ATOMIC_SEQ_CST)) {
+    sem_post(&logger.wake);
+  }
+
   return 0;
 }
+
+void FtpLogSetLevel(int level) {
+  assert((level >= 0) && (level < kMaxCode));
+
+  __atomic_store_n(&ftp_log_level, level, __ATOMIC_RELAXED);
+}
+
+/* the level named, ignoring case, or -1 */
+int FtpLogParseLevel(const char *name) {
+  int level;
+
+  for (level = 0; level < kMaxCode; ++level) {
+    if (strcasecmp(name, log_header[level]) == 0) {
+      return level;
+    }
+  }
+
+  return -1;
+}
+
+const char *FtpLogLevelName(int level) {
+  assert((level >= 0) && (level < kMaxCode));
+
+  return log_header[level];
+}
+
+/* start writing lines from a background thread; until then, and after */
+/* FtpLogStop(), each is written as it is logged                       */
+int FtpLogStart(int overflow_policy) {
+  sigset_t all_signals, old_signals;
+  int ret;
+
+  assert((overflow_policy == LOG_OVERFLOW_DROP) ||
+         (overflow_policy == LOG_OVERFLOW_BLOCK));
+
+  if (pthread_key_create(&logger.ring_key,
+                         (void (*)(void *))OrphanRing) != 0) {
+    return 0;
+  }
+  pthread_mutex_init(&logger.mutex, NULL);
+  sem_init(&logger.wake, 0, 0);
+  logger.policy = overflow_policy;
+  logger.sleeping = 0;
+  logger.stopping = 0;
+
+  /* signals are left to the threads that wait for them */
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+  ret = pthread_create(&logger.flusher, NULL, FlushRun, NULL);
+  pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+  if (ret != 0) {
+    pthread_key_delete(logger.ring_key);
+    return 0;
+  }
+  __atomic_store_n(&logger.running, 1, __ATOMIC_RELEASE);
+
+  /* lines still waiting at exit() are written out too */
+  atexit(FtpLogStop);
+
+  return 1;
+}
+
+/* write out everything logged so far, and go back to writing each line */
+/* as it is logged                                                      */
+void FtpLogStop(void) {
+  if (!__atomic_exchange_n(&logger.running, 0, __ATOMIC_ACQ_REL)) {
+    return;
+  }
+
+  __atomic_store_n(&logger.stopping, 1, __ATOMIC_SEQ_CST);
+  sem_post(&logger.wake);
+  pthread_join(logger.flusher, NULL);
+}
+
+unsigned long FtpLogDropped(void) {
+  return __atomic_load_n(&logger.dropped, __ATOMIC_RELAXED);
+}
+
+/* "YYYY-MM-DD HH:MM:SS.mmm Header: message\n" */
+static void FormatLine(char *line, int *len, int code,
+                       const char *fmt, va_list ap) {
+  struct timespec now;
+  struct tm tm;
+  int n;
+
+  /* one localtime_r() a second for each thread */
+  clock_gettime(CLOCK_REALTIME, &now);
+  if (now.tv_sec != log_clock.second) {
+    localtime_r(&now.tv_sec, &tm);
+    strftime(log_clock.text, sizeof(log_clock.text), "%Y-%m-%d %H:%M:%S",
+             &tm);
+    log_clock.second = now.tv_sec;
+  }
+
+  n = snprintf(line, LOG_LINE_LEN, "%s.%03ld %s: ", log_clock.text,
+               now.tv_nsec / 1000000, log_header[code]);
+  n += vsnprintf(line + n, LOG_LINE_LEN - n, fmt, ap);
+  if (n > LOG_LINE_LEN - 1) {
+    n = LOG_LINE_LEN - 1;
+  }
+  line[n++] = '\n';
+  *len = n;
+}
+
+static void WriteSync(const char *line, int len) {
+  int amt_written, write_ret;
+
+  for (amt_written = 0; amt_written < len; amt_written += write_ret) {
+    write_ret = write(STDOUT_FILENO, line + amt_written, len - amt_written);
+    if (write_ret <= 0) {
+      return;
+    }
+  }
+}
+
+/* the calling thread's ring, added to the flusher's list on first use */
+static LogRing *GetRing(void) {
+  LogRing *r;
+
+  r = (LogRing *)pthread_getspecific(logger.ring_key);
+  if (r != NULL) {
+    return r;
+  }
+
+  r = (LogRing *)malloc(sizeof(LogRing));
+  if (r == NULL) {
+    return NULL;
+  }
+  r->head = r->tail = 0;
+  r->orphaned = 0;
+
+  pthread_mutex_lock(&logger.mutex);
+  r->next = logger.rings;
+  logger.rings = r;
+  pthread_mutex_unlock(&logger.mutex);
+
+  pthread_setspecific(logger.ring_key, r);
+  return r;
+}
+
+static void OrphanRing(LogRing *r) {
+  __atomic_store_n(&r->orphaned, 1, __ATOMIC_RELEASE);
+}
+
+static void *FlushRun(void *arg) {
+  (void)arg;
+
+  for (;;) {
+    if (FlushRings()) {
+      continue;
+    }
+    if (__atomic_load_n(&logger.stopping, __ATOMIC_SEQ_CST)) {
+      break;
+    }
+
+    /* sleep, unless a line came in while deciding to */
+    __atomic_store_n(&logger.sleeping, 1, __ATOMIC_SEQ_CST);
+    if (AnyPending() || __atomic_load_n(&logger.stopping, __ATOMIC_SEQ_CST)) {
+      __atomic_store_n(&logger.sleeping, 0, __ATOMIC_SEQ_CST);
+      continue;
+    }
+    sem_wait(&logger.wake);
+  }
+
+  /* lines logged once running was cleared are written as they come */
+  while (FlushRings()) {
+  }
+
+  return NULL;
+}
+
+/* write out what every ring holds, in as few writev() calls as fit; */
+/* frees rings of exited threads once empty, and returns whether     */
+/* there was anything to write                                       */
+static int FlushRings(void) {
+  struct iovec iov[LOG_IOV_MAX];
+  LogRing *owner[LOG_IOV_MAX];
+  unsigned long head, tail, pos;
+  int num_iov, i, wrote_any;
+  ssize_t written;
+  LogRing *r, **link;
+  size_t len;
+
+  wrote_any = 0;
+  do {
+    /* gather the waiting spans; a ring that wraps gives two */
+    num_iov = 0;
+    pthread_mutex_lock(&logger.mutex);
+    link = &logger.rings;
+    while (((r = *link) != NULL) && (num_iov + 2 <= LOG_IOV_MAX)) {
+      head = r->head;
+      tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+      if ((head == tail) && __atomic_load_n(&r->orphaned, __ATOMIC_ACQUIRE)) {
+        /* the thread is gone, and nothing more will come from it */
+        *link = r->next;
+        free(r);
+        continue;
+      }
+      while (head != tail) {
+        pos = head % LOG_RING_SIZE;
+        len = tail - head;
+        if (len > LOG_RING_SIZE - pos) {
+          len = LOG_RING_SIZE - pos;
+        }
+        iov[num_iov].iov_base = r->data + pos;
+        iov[num_iov].iov_len = len;
+        owner[num_iov++] = r;
+        head += len;
+      }
+      link = &r->next;
+    }
+    pthread_mutex_unlock(&logger.mutex);
+
+    if (num_iov == 0) {
+      break;
+    }
+    wrote_any = 1;
+
+    /* hand back what was written; lines that can't be written are lost */
+    written = writev(STDOUT_FILENO, iov, num_iov);
+    for (i = 0; i < num_iov; ++i) {
+      len = iov[i].iov_len;
+      if ((written >= 0) && ((size_t)written < len)) {
+        len = written;
+      }
+      if (written >= 0) {
+        written -= len;
+      }
+      __atomic_store_n(&owner[i]->head, owner[i]->head + len,
+                       __ATOMIC_RELEASE);
+      if (len < iov[i].iov_len) {
+        break;
+      }
+    }
+  } while (num_iov == LOG_IOV_MAX);
+
+  return wrote_any;
+}
+
+static int AnyPending(void) {
+  LogRing *r;
+  int pending;
+
+  pending = 0;
+  pthread_mutex_lock(&logger.mutex);
+  for (r = logger.rings; (r != NULL) && !pending; r = r->next) {
+    pending = (__atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) != r->head);
+  }
+  pthread_mutex_unlock(&logger.mutex);
+
+  return pending;
+}
@@ -6,6 +6,29 @@
 #define LOG_WARNING 2
 #define LOG_ERROR 3
 
-int FtpLog(int code, const char *fmt, ...);
+/* what to do with a line when its thread's buffer is full */
+#define LOG_OVERFLOW_DROP 0
+#define LOG_OVERFLOW_BLOCK 1
+
+/* calls below this level are compiled out, arguments and all */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_DEBUG
+#endif
+
+/* lines below this level are skipped before they are formatted */
+extern int ftp_log_level;
+
+#define FtpLog(code, ...) \
+  ((((code) >= LOG_MIN_LEVEL) && \
+    ((code) >= __atomic_load_n(&ftp_log_level, __ATOMIC_RELAXED))) ? \
+   FtpLogWrite((code), __VA_ARGS__) : 0)
+
+int FtpLogWrite(int code, const char *fmt, ...);
+void FtpLogSetLevel(int level);
+int FtpLogParseLevel(const char *name);
+const char *FtpLogLevelName(int level);
+int FtpLogStart(int overflow_policy);
+void FtpLogStop(void);
+unsigned long FtpLogDropped(void);
 
 #endif /* FTP_LOG_H */
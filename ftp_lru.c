@@ -0,0 +1,148 @@
+#include "ftp_lru.h"
+#include <stdlib.h>
+#include <assert.h>
+
+#include "ftp_log.h"
+
+static FtpLruEntry **Bucket(const FtpLru *lru, unsigned long long hash);
+static void Unref(FtpLru *lru, FtpLruEntry *e);
+
+/* a table of num_buckets (a power of 2) chains, holding up to max_bytes; */
+/* destroy frees entries, and victim, if not NULL, picks which to evict   */
+int FtpLruInit(FtpLru *lru, int num_buckets, size_t max_bytes,
+               void (*destroy)(FtpLruEntry *e),
+               FtpLruEntry *(*victim)(const FtpLru *lru)) {
+  assert(lru != NULL);
+  assert((num_buckets > 0) && ((num_buckets & (num_buckets - 1)) == 0));
+  assert(max_bytes > 0);
+  assert(destroy != NULL);
+
+  lru->buckets = (FtpLruEntry **)calloc(num_buckets, sizeof(FtpLruEntry *));
+  if (lru->buckets == NULL) {
+    FtpLog(LOG_ERROR, "out of memory allocating %d cache buckets",
+           num_buckets);
+    return 0;
+  }
+  lru->num_buckets = num_buckets;
+  lru->max_bytes = max_bytes;
+  lru->bytes = 0;
+  lru->max_entry = max_bytes / 4;
+  lru->entries = 0;
+  lru->evictions = 0;
+  lru->lru_head = NULL;
+  lru->lru_tail = NULL;
+  lru->destroy = destroy;
+  lru->victim = victim;
+
+  return 1;
+}
+
+/* whether an entry of size bytes is worth making room for */
+int FtpLruFits(const FtpLru *lru, size_t size) {
+  return size <= lru->max_entry;
+}
+
+/* the first entry whose hash might be this one; the rest follow on */
+/* hash_next, and the caller compares keys                          */
+FtpLruEntry *FtpLruChain(const FtpLru *lru, unsigned long long hash) {
+  return *Bucket(lru, hash);
+}
+
+/* a session is about to send an entry: move it to the head of the */
+/* LRU list and hold it for the session until FtpLruRelease()       */
+void FtpLruUse(FtpLru *lru, FtpLruEntry *e) {
+  e->refs++;
+
+  if (e == lru->lru_head) {
+    return;
+  }
+  e->lru_prev->lru_next = e->lru_next;
+  if (e->lru_next != NULL) {
+    e->lru_next->lru_prev = e->lru_prev;
+  } else {
+    lru->lru_tail = e->lru_prev;
+  }
+  e->lru_prev = NULL;
+  e->lru_next = lru->lru_head;
+  lru->lru_head->lru_prev = e;
+  lru->lru_head = e;
+}
+
+/* add an entry of size bytes, which must fit, evicting others to make */
+/* room; it is held both by the table and for the caller               */
+void FtpLruInsert(FtpLru *lru, FtpLruEntry *e, unsigned long long hash,
+                  size_t size) {
+  FtpLruEntry **bucket;
+
+  assert(FtpLruFits(lru, size));
+
+  while (lru->bytes + size > lru->max_bytes) {
+    assert(lru->lru_tail != NULL);
+    FtpLruRemove(lru, (lru->victim != NULL) ? lru->victim(lru)
+                                             : lru->lru_tail);
+    lru->evictions++;
+  }
+
+  e->hash = hash;
+  e->size = size;
+  e->refs = 2;
+
+  bucket = Bucket(lru, hash);
+  e->hash_next = *bucket;
+  *bucket = e;
+
+  e->lru_prev = NULL;
+  e->lru_next = lru->lru_head;
+  if (lru->lru_head != NULL) {
+    lru->lru_head->lru_prev = e;
+  } else {
+    lru->lru_tail = e;
+  }
+  lru->lru_head = e;
+
+  lru->bytes += size;
+  lru->entries++;
+}
+
+/* take an entry out of the table; sessions still sending it keep it */
+/* until they are done                                               */
+void FtpLruRemove(FtpLru *lru, FtpLruEntry *e) {
+  FtpLruEntry **p;
+
+  for (p = Bucket(lru, e->hash); *p != e; p = &(*p)->hash_next) {
+    assert(*p != NULL);
+  }
+  *p = e->hash_next;
+
+  if (e->lru_prev != NULL) {
+    e->lru_prev->lru_next = e->lru_next;
+  } else {
+    lru->lru_head = e->lru_next;
+  }
+  if (e->lru_next != NULL) {
+    e->lru_next->lru_prev = e->lru_prev;
+  } else {
+    lru->lru_tail = e->lru_prev;
+  }
+
+  lru->bytes -= e->size;
+  lru->entries--;
+  Unref(lru, e);
+}
+
+/* done sending an entry from FtpLruUse() or FtpLruInsert() */
+void FtpLruRelease(FtpLru *lru, FtpLruEntry *e) {
+  Unref(lru, e);
+}
+
+/* the middle bits, as callers' hashes are multiplicative and some */
+/* use the top ones for themselves                                 */
+static FtpLruEntry **Bucket(const FtpLru *lru, unsigned long long hash) {
+  return &lru->buckets[(hash >> 32) & (lru->num_buckets - 1)];
+}
+
+static void Unref(FtpLru *lru, FtpLruEntry *e) {
+  if (--e->refs == 0) {
+    lru->destroy(e);
+  }
+}
@@ -0,0 +1,58 @@
+#ifndef FTP_LRU_H
+#define FTP_LRU_H
+
+#include <stddef.h>
+
+/* something cached: the first member of what a cache holds, found by */
+/* a hash of its key and freed once neither the cache nor any session  */
+/* sending it still wants it                                           */
+typedef struct FtpLruEntry {
+  unsigned long long hash;
+  size_t size;
+
+  /* sessions sending it, plus one while it is in the cache */
+  int refs;
+
+  /* hash chain, and place on the least recently used list */
+  struct FtpLruEntry *hash_next;
+  struct FtpLruEntry *lru_prev;
+  struct FtpLruEntry *lru_next;
+} FtpLruEntry;
+
+/* hash table of entries, bounded in bytes and evicting the least */
+/* recently used first, unless told otherwise; it has no lock, so */
+/* its users keep it under one of their own                       */
+typedef struct FtpLru {
+  FtpLruEntry **buckets;
+  int num_buckets;
+
+  size_t max_bytes;
+  size_t bytes;
+
+  /* biggest entry taken; a quarter of max_bytes unless a user needs */
+  /* more, as one that big pushes out that much                      */
+  size_t max_entry;
+  int entries;
+  unsigned long evictions;
+
+  /* most recently used at the head */
+  FtpLruEntry *lru_head;
+  FtpLruEntry *lru_tail;
+
+  /* frees an entry nobody wants any more, and picks the one to evict */
+  void (*destroy)(FtpLruEntry *e);
+  FtpLruEntry *(*victim)(const struct FtpLru *lru);
+} FtpLru;
+
+int FtpLruInit(FtpLru *lru, int num_buckets, size_t max_bytes,
+               void (*destroy)(FtpLruEntry *e),
+               FtpLruEntry *(*victim)(const FtpLru *lru));
+int FtpLruFits(const FtpLru *lru, size_t size);
+FtpLruEntry *FtpLruChain(const FtpLru *lru, unsigned long long hash);
+void FtpLruUse(FtpLru *lru, FtpLruEntry *e);
+void FtpLruInsert(FtpLru *lru, FtpLruEntry *e, unsigned long long hash,
+                  size_t size);
+void FtpLruRemove(FtpLru *lru, FtpLruEntry *e);
+void FtpLruRelease(FtpLru *lru, FtpLruEntry *e);
+
+#endif /* FTP_LRU_H */
@@ -0,0 +1,271 @@
+#include "ftp_newline.h"
+#include <string.h>
+#include <assert.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define NEWLINE_X86 1
+#endif
+
+static int ConvertScalar(char *dst, const char *src, int len);
+#ifdef NEWLINE_X86
+static int ConvertSse2(char *dst, const char *src, int len);
+static int ConvertAvx2(char *dst, const char *src, int len);
+#endif
+
+/* the kernel the processor runs best, picked on first use */
+static int (*convert)(char *dst, const char *src, int len);
+static const char *convert_name;
+
+static void PickKernel(void);
+
+/* copies len bytes from src to dst, with each LF expanded to CR LF; */
+/* dst must have room for 2 * len bytes, and the new length returned */
+int FtpConvertNewlines(char *dst, const char *src, int len) {
+  assert(dst != NULL);
+  assert(src != NULL);
+  assert(len >= 0);
+
+  if (convert == NULL) {
+    PickKernel();
+  }
+  return convert(dst, src, len);
+}
+
+const char *FtpNewlineKernel(void) {
+  if (convert == NULL) {
+    PickKernel();
+  }
+  return convert_name;
+}
+
+/* racing threads pick the same one, so there is no need for a lock */
+static void PickKernel(void) {
+#ifdef NEWLINE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    convert_name = "avx2";
+    convert = ConvertAvx2;
+    return;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    convert_name = "sse2";
+    convert = ConvertSse2;
+    return;
+  }
+#endif
+  convert_name = "scalar";
+  convert = ConvertScalar;
+}
+
+/* a word at a time where there are no LFs, then a byte at a time */
+static int ConvertScalar(char *dst, const char *src, int len) {
+  const unsigned long ones = ~0UL / 0xff;
+  unsigned long w;
+  int i, n;
+
+  n = 0;
+  for (i = 0; i < len; ) {
+    if (i + (int)sizeof(w) <= len) {
+      memcpy(&w, src + i, sizeof(w));
+      w ^= ones * '\n';
+      if (((w - ones) & ~w & (ones << 7)) == 0) {
+        memcpy(dst + n, src + i, sizeof(w));
+        i += sizeof(w);
+        n += sizeof(w);
+        continue;
+      }
+    }
+    if (src[i] == '\n') {
+      dst[n++] = '\r';
+    }
+    dst[n++] = src[i++];
+  }
+
+  return n;
+}
+
+#ifdef NEWLINE_X86
+/* each step copies a whole vector to dst, then keeps only what comes */
+/* before its first LF, if any, and goes on from just after the LF;   */
+/* the copy past it is overwritten by what follows, and never runs    */
+/* beyond 2 * len as a vector is only loaded whole                    */
+static int ConvertSse2(char *dst, const char *src, int len) {
+  const __m128i lf = _mm_set1_epi8('\n');
+  __m128i v;
+  unsigned int mask;
+  int i, n, p;
+
+  i = n = 0;
+  while (i + 16 <= len) {
+    v = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm_storeu_si128((__m128i *)(dst + n), v);
+    mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+    if (mask == 0) {
+      i += 16;
+      n += 16;
+      continue;
+    }
+    p = __builtin_ctz(mask);
+    n += p;
+    dst[n++] = '\r';
+    dst[n++] = '\n';
+    i += p + 1;
+  }
+
+  return n + ConvertScalar(dst + n, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static int ConvertAvx2(char *dst, const char *src, int len) {
+  const __m256i lf = _mm256_set1_epi8('\n');
+  __m256i v;
+  unsigned int mask;
+  int i, n, p;
+
+  i = n = 0;
+  while (i + 32 <= len) {
+    v = _mm256_loadu_si256((const __m256i *)(src + i));
+    _mm256_storeu_si256((__m256i *)(dst + n), v);
+    mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf));
+    if (mask == 0) {
+      i += 32;
+      n += 32;
+      continue;
+    }
+    p = __builtin_ctz(mask);
+    n += p;
+    dst[n++] = '\r';
+    dst[n++] = '\n';
+    i += p + 1;
+  }
+
+  return n + ConvertSse2(dst + n, src + i, len - i);
+}
+#endif /* NEWLINE_X86 */
+
+#ifdef NEWLINE_BENCHMARK
+/* compares the kernels above with the old byte at a time conversion, */
+/* on text and on random (binary-like) data                           */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* the conversion SendFile() used to do, 4KB at a time */
+static int LegacyConvert(char *dst, const char *src, int srclen) {
+  int i;
+  int dstlen;
+
+  dstlen = 0;
+  for (i=0; i < srclen; ++i) {
+    if (src[i] == '\n') {
+      dst[dstlen++] = '\r';
+    }
+    dst[dstlen++] = src[i];
+  }
+  return dstlen;
+}
+
+static double Elapsed(const struct timespec *start) {
+  struct timespec end;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* MB/s converting all of src in chunks of chunk bytes, and the output */
+static double Run(int (*f)(char *, const char *, int), char *dst,
+                  const char *src, int len, int chunk, int rounds,
+                  long *out_len) {
+  struct timespec start;
+  int r, i, amt;
+
+  *out_len = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (r = 0; r < rounds; ++r) {
+    for (i = 0; i < len; i += chunk) {
+      amt = (len - i < chunk) ? len - i : chunk;
+      *out_len += f(dst, src + i, amt);
+    }
+  }
+  return (double)len * rounds / (1024 * 1024) / Elapsed(&start);
+}
+
+int main(int argc, char *argv[]) {
+  static const char *kinds[] = { "text", "binary" };
+  static char check_in[300], check_out[600];
+  int (*kernels[4])(char *, const char *, int);
+  const char *names[4];
+  char *src, *dst;
+  long legacy_len, out_len;
+  int len, rounds, num_kernels, kind, i, k, line, expect;
+  double legacy, mbs;
+
+  len = 64 * 1024 * 1024;
+  rounds = (argc > 1) ? atoi(argv[1]) : 4;
+  src = (char *)malloc(len);
+  dst = (char *)malloc(2 * NEWLINE_BUFFER_SIZE);
+  if ((src == NULL) || (dst == NULL)) {
+    return 1;
+  }
+
+  num_kernels = 0;
+  names[num_kernels] = "scalar";
+  kernels[num_kernels++] = ConvertScalar;
+#ifdef NEWLINE_X86
+  names[num_kernels] = "sse2";
+  kernels[num_kernels++] = ConvertSse2;
+  if (__builtin_cpu_supports("avx2")) {
+    names[num_kernels] = "avx2";
+    kernels[num_kernels++] = ConvertAvx2;
+  }
+#endif
+
+  srand(1);
+  for (kind = 0; kind < 2; ++kind) {
+    /* lines of 20 to 100 printable characters, or random bytes */
+    line = 0;
+    for (i = 0; i < len; ++i) {
+      if (kind == 1) {
+        src[i] = rand() & 0xff;
+      } else if (line == 0) {
+        src[i] = '\n';
+        line = 20 + rand() % 81;
+      } else {
+        src[i] = ' ' + rand() % 95;
+        line--;
+      }
+    }
+
+    legacy = Run(LegacyConvert, dst, src, len, 4096, rounds, &legacy_len);
+    printf("%-6s legacy (4KB)   %8.1f MB/s\n", kinds[kind], legacy);
+    for (k = 0; k < num_kernels; ++k) {
+      mbs = Run(kernels[k], dst, src, len, NEWLINE_BUFFER_SIZE, rounds,
+                &out_len);
+      printf("%-6s %-6s (256KB) %8.1f MB/s (%.1fx)%s\n", kinds[kind],
+             names[k], mbs, mbs / legacy,
+             (out_len == legacy_len) ? "" : " WRONG LENGTH");
+    }
+  }
+
+  /* every kernel must give exactly what the old loop gave */
+  for (i = 0; i < 100000; ++i) {
+    len = rand() % sizeof(check_in);
+    for (k = 0; k < len; ++k) {
+      check_in[k] = (rand() % 4 == 0) ? '\n' : 'a' + rand() % 26;
+    }
+    expect = LegacyConvert(check_out, check_in, len);
+    for (k = 0; k < num_kernels; ++k) {
+      if ((kernels[k](dst, check_in, len) != expect) ||
+          (memcmp(dst, check_out, expect) != 0)) {
+        printf("%s differs on %d bytes\n", names[k], len);
+        return 1;
+      }
+    }
+  }
+
+  free(src);
+  free(dst);
+  return 0;
+}
+#endif /* NEWLINE_BENCHMARK */
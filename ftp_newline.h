@@ -0,0 +1,10 @@
+#ifndef FTP_NEWLINE_H
+#define FTP_NEWLINE_H
+
+/* bytes of a file converted at a time for an ASCII transfer */
+#define NEWLINE_BUFFER_SIZE (256 * 1024)
+
+int FtpConvertNewlines(char *dst, const char *src, int len);
+const char *FtpNewlineKernel(void);
+
+#endif /* FTP_NEWLINE_H */
@@ -0,0 +1,313 @@
+#include "ftp_passive_port.h"
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <assert.h>
+
+/* ports for passive connections, one bit each, set while in use; */
+/* taken and given back with atomic operations, so no lock         */
+static struct {
+  int low;
+  int num_ports;
+  int num_words;
+  unsigned long long *words;
+
+  int in_use;
+  unsigned long allocated;
+  unsigned long collisions;
+  unsigned long exhausted;
+  unsigned long total_nsec;
+  unsigned long max_nsec;
+} pool;
+
+/* where in the pool this thread looks next, moved to a random place */
+/* after each port it takes, so threads rarely race for a word and   */
+/* clients can't guess the next port; and the generator for that     */
+static __thread unsigned int cursor;
+static __thread unsigned int rand_state;
+
+static int Take(void);
+static void Give(int index);
+static unsigned int Random(void);
+static void NoteLatency(const struct timespec *start);
+
+/* hand out ports from low to high, inclusive */
+int FtpPassivePortInit(int low, int high) {
+  int i;
+
+  assert(low > 0);
+  assert(high >= low);
+  assert(high <= 65535);
+
+  pool.low = low;
+  pool.num_ports = high - low + 1;
+  pool.num_words = (pool.num_ports + 63) / 64;
+  pool.words = (unsigned long long *)calloc(pool.num_words,
+                                            sizeof(unsigned long long));
+  if (pool.words == NULL) {
+    return 0;
+  }
+
+  /* the bits past the last port are never free */
+  for (i = pool.num_ports; i < pool.num_words * 64; ++i) {
+    pool.words[i / 64] |= 1ULL << (i % 64);
+  }
+
+  return 1;
+}
+
+/* binds fd to addr at a free port from the pool, returning the port, */
+/* or -1 with errno set if none can be bound                          */
+int FtpPassivePortBind(int fd, struct sockaddr_in *addr) {
+  struct timespec start;
+  int index, tries, reuse;
+
+  assert(pool.words != NULL);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  /* a port a data connection has just been closed on lingers in */
+  /* TIME_WAIT; it is free to listen on all the same              */
+  reuse = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+  for (tries = 0; tries < pool.num_ports; ++tries) {
+    index = Take();
+    if (index == -1) {
+      break;
+    }
+    addr->sin_port = htons(pool.low + index);
+    if (bind(fd, (struct sockaddr *)addr, sizeof(struct sockaddr_in)) == 0) {
+      __atomic_add_fetch(&pool.in_use, 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&pool.allocated, 1, __ATOMIC_RELAXED);
+      NoteLatency(&start);
+      return pool.low + index;
+    }
+    Give(index);
+    if (errno != EADDRINUSE) {
+      return -1;
+    }
+
+    /* taken by some other program */
+    __atomic_add_fetch(&pool.collisions, 1, __ATOMIC_RELAXED);
+  }
+
+  __atomic_add_fetch(&pool.exhausted, 1, __ATOMIC_RELAXED);
+  errno = EADDRNOTAVAIL;
+  return -1;
+}
+
+/* the socket bound to port by FtpPassivePortBind() is closed */
+void FtpPassivePortRelease(int port) {
+  assert((port >= pool.low) && (port < pool.low + pool.num_ports));
+
+  Give(port - pool.low);
+  __atomic_sub_fetch(&pool.in_use, 1, __ATOMIC_RELAXED);
+}
+
+void FtpPassivePortStats(int *in_use, int *ports, unsigned long *allocated,
+                         unsigned long *collisions, unsigned long *exhausted,
+                         unsigned long *avg_nsec, unsigned long *max_nsec) {
+  *in_use = __atomic_load_n(&pool.in_use, __ATOMIC_RELAXED);
+  *ports = pool.num_ports;
+  *allocated = __atomic_load_n(&pool.allocated, __ATOMIC_RELAXED);
+  *collisions = __atomic_load_n(&pool.collisions, __ATOMIC_RELAXED);
+  *exhausted = __atomic_load_n(&pool.exhausted, __ATOMIC_RELAXED);
+  *avg_nsec = (*allocated > 0) ?
+              __atomic_load_n(&pool.total_nsec, __ATOMIC_RELAXED) / *allocated :
+              0;
+  *max_nsec = __atomic_load_n(&pool.max_nsec, __ATOMIC_RELAXED);
+}
+
+/* marks a free port in use, returning its index, or -1 if all are; */
+/* looks from this thread's cursor to the end of the pool, then     */
+/* from the start back round to it                                  */
+static int Take(void) {
+  unsigned long long free_bits, bit;
+  int word, i, index;
+
+  /* a thread's first port is from anywhere */
+  if (rand_state == 0) {
+    cursor = Random() % pool.num_ports;
+  }
+
+  word = cursor / 64;
+  for (i = 0; i <= pool.num_words; ++i) {
+    free_bits = ~__atomic_load_n(&pool.words[word], __ATOMIC_RELAXED);
+    if (i == 0) {
+      free_bits &= ~0ULL << (cursor % 64);
+    }
+    while (free_bits != 0) {
+      bit = free_bits & -free_bits;
+      if ((__atomic_fetch_or(&pool.words[word], bit, __ATOMIC_ACQUIRE) &
+           bit) == 0) {
+        index = word * 64 + __builtin_ctzll(bit);
+        cursor = Random() % pool.num_ports;
+        return index;
+      }
+      free_bits &= ~bit;
+    }
+    word = (word + 1 == pool.num_words) ? 0 : word + 1;
+  }
+
+  return -1;
+}
+
+static void Give(int index) {
+  __atomic_fetch_and(&pool.words[index / 64], ~(1ULL << (index % 64)),
+                     __ATOMIC_RELEASE);
+}
+
+/* xorshift, seeded differently for each thread */
+static unsigned int Random(void) {
+  static unsigned int threads;
+  struct timespec now;
+
+  if (rand_state == 0) {
+    clock_gettime(CLOCK_REALTIME, &now);
+    rand_state = (unsigned int)now.tv_nsec ^ (unsigned int)now.tv_sec ^
+                 (__atomic_add_fetch(&threads, 1, __ATOMIC_RELAXED) *
+                  0x9E3779B9U);
+    if (rand_state == 0) {
+      rand_state = 1;
+    }
+  }
+  rand_state ^= rand_state << 13;
+  rand_state ^= rand_state >> 17;
+  rand_state ^= rand_state << 5;
+
+  return rand_state;
+}
+
+static void NoteLatency(const struct timespec *start) {
+  struct timespec now;
+  unsigned long nsec, max;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  nsec = (now.tv_sec - start->tv_sec) * 1000000000UL +
+         (now.tv_nsec - start->tv_nsec);
+  __atomic_add_fetch(&pool.total_nsec, nsec, __ATOMIC_RELAXED);
+  max = __atomic_load_n(&pool.max_nsec, __ATOMIC_RELAXED);
+  while ((nsec > max) &&
+         !__atomic_compare_exchange_n(&pool.max_nsec, &max, nsec, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+#ifdef PASSIVE_PORT_BENCHMARK
+/* compares taking and giving back ports with the old way: a random */
+/* port drawn under a mutex, tried until one is free, with a range   */
+/* kept partly in use                                                */
+#include <stdio.h>
+#include <string.h>
+
+static pthread_mutex_t legacy_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char *legacy_used;
+
+/* GetPassivePort(), with the failed bind()s it led to */
+static int LegacyTake(void) {
+  int port;
+
+  for (;;) {
+    pthread_mutex_lock(&legacy_mutex);
+    port = lrand48() % pool.num_ports;
+    if (!legacy_used[port]) {
+      legacy_used[port] = 1;
+      pthread_mutex_unlock(&legacy_mutex);
+      return port;
+    }
+    pthread_mutex_unlock(&legacy_mutex);
+  }
+}
+
+static void LegacyGive(int port) {
+  pthread_mutex_lock(&legacy_mutex);
+  legacy_used[port] = 0;
+  pthread_mutex_unlock(&legacy_mutex);
+}
+
+static int use_legacy;
+static int rounds;
+
+static void *Run(void *arg) {
+  int held[8];
+  int i, j;
+
+  (void)arg;
+  for (j = 0; j < 8; ++j) {
+    held[j] = use_legacy ? LegacyTake() : Take();
+  }
+  for (i = 0; i < rounds; ++i) {
+    j = i % 8;
+    if (use_legacy) {
+      LegacyGive(held[j]);
+      held[j] = LegacyTake();
+    } else {
+      Give(held[j]);
+      held[j] = Take();
+    }
+  }
+  for (j = 0; j < 8; ++j) {
+    if (use_legacy) {
+      LegacyGive(held[j]);
+    } else {
+      Give(held[j]);
+    }
+  }
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  static const int kThreads[] = { 1, 2, 4 };
+  static const int kBusy[] = { 0, 50, 90 };
+  pthread_t threads[4];
+  struct timespec start, end;
+  int b, t, i, n, busy;
+  double nsec[2];
+
+  rounds = (argc > 1) ? atoi(argv[1]) : 200000;
+  if (!FtpPassivePortInit(50000, 50999)) {
+    return 1;
+  }
+  legacy_used = (unsigned char *)calloc(pool.num_ports, 1);
+  srand48(1);
+
+  printf("1000 ports  threads  legacy ns/op  bitmap ns/op\n");
+  for (b = 0; b < 3; ++b) {
+    /* hold this share of the range */
+    busy = pool.num_ports * kBusy[b] / 100;
+    for (i = 0; i < busy; ++i) {
+      legacy_used[i] = 1;
+      pool.words[i / 64] |= 1ULL << (i % 64);
+    }
+    for (t = 0; t < 3; ++t) {
+      n = kThreads[t];
+      for (use_legacy = 1; use_legacy >= 0; --use_legacy) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < n; ++i) {
+          pthread_create(&threads[i], NULL, Run, NULL);
+        }
+        for (i = 0; i < n; ++i) {
+          pthread_join(threads[i], NULL);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        nsec[use_legacy] = ((end.tv_sec - start.tv_sec) * 1e9 +
+                            (end.tv_nsec - start.tv_nsec)) /
+                           ((double)rounds * n);
+      }
+      printf("%3d%% busy   %7d  %12.1f  %12.1f\n", kBusy[b], n, nsec[1],
+             nsec[0]);
+    }
+    for (i = 0; i < busy; ++i) {
+      legacy_used[i] = 0;
+      pool.words[i / 64] &= ~(1ULL << (i % 64));
+    }
+  }
+
+  free(legacy_used);
+  return 0;
+}
+#endif /* PASSIVE_PORT_BENCHMARK */
@@ -0,0 +1,13 @@
+#ifndef FTP_PASSIVE_PORT_H
+#define FTP_PASSIVE_PORT_H
+
+#include <netinet/in.h>
+
+int FtpPassivePortInit(int low, int high);
+int FtpPassivePortBind(int fd, struct sockaddr_in *addr);
+void FtpPassivePortRelease(int port);
+void FtpPassivePortStats(int *in_use, int *ports, unsigned long *allocated,
+                         unsigned long *collisions, unsigned long *exhausted,
+                         unsigned long *avg_nsec, unsigned long *max_nsec);
+
+#endif /* FTP_PASSIVE_PORT_H */
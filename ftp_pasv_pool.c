@@ -0,0 +1,271 @@
+#include "ftp_pasv_pool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <assert.h>
+
+#include "ftp_passive_port.h"
+#include "ftp_log.h"
+
+/* addresses sockets are kept for; a server seldom has more */
+#define MAX_ADDRESSES 16
+
+/* listening sockets bound to one address, ready for PASV; only ever */
+/* fresh ones, as a socket whose port one client has been told of     */
+/* could be connected to by that client to spoil another's transfer   */
+typedef struct {
+  struct in_addr addr;
+  int *fds;
+  int *ports;
+  int count;
+} AddrPool;
+
+/* process-wide pool of passive sockets, bound and listening ahead of */
+/* the PASV commands that need them, and kept full by a thread of its */
+/* own                                                                 */
+static struct {
+  int enabled;
+  int size;
+
+  AddrPool addrs[MAX_ADDRESSES];
+  int num_addrs;
+
+  unsigned long hits;
+  unsigned long misses;
+
+  int stopping;
+  pthread_t filler;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+} pool;
+
+static AddrPool *Find(const struct in_addr *addr, int add);
+static int Open(const struct in_addr *addr, int *port);
+static int Unused(int fd);
+static void Discard(int fd, int port);
+static void *FillRun(void *arg);
+
+/* keep up to size sockets listening on each address PASV is used on */
+int FtpPasvPoolInit(int size) {
+  assert(size > 0);
+
+  pool.size = size;
+  pool.num_addrs = 0;
+  pool.stopping = 0;
+  pthread_mutex_init(&pool.mutex, NULL);
+  pthread_cond_init(&pool.cond, NULL);
+
+  if (pthread_create(&pool.filler, NULL, FillRun, NULL) != 0) {
+    FtpLog(LOG_ERROR, "error starting passive socket pool thread");
+    return 0;
+  }
+  pool.enabled = 1;
+
+  return 1;
+}
+
+int FtpPasvPoolEnabled(void) {
+  return pool.enabled;
+}
+
+/* a socket listening on addr, and its port, or -1 if there are none */
+/* ready; the pool is topped up in the background either way         */
+int FtpPasvPoolGet(const struct in_addr *addr, int *port) {
+  AddrPool *a;
+  int fd;
+
+  for (;;) {
+    fd = -1;
+    pthread_mutex_lock(&pool.mutex);
+
+    a = Find(addr, 1);
+    if ((a != NULL) && (a->count > 0)) {
+      a->count--;
+      fd = a->fds[a->count];
+      *port = a->ports[a->count];
+    }
+
+    /* wake the filler at half full, so it works in batches */
+    if ((a != NULL) && (a->count <= pool.size / 2)) {
+      pthread_cond_signal(&pool.cond);
+    }
+
+    pthread_mutex_unlock(&pool.mutex);
+
+    /* a client may have connected to a socket while it sat here */
+    if ((fd == -1) || Unused(fd)) {
+      break;
+    }
+    Discard(fd, *port);
+  }
+
+  pthread_mutex_lock(&pool.mutex);
+  if (fd == -1) {
+    pool.misses++;
+  } else {
+    pool.hits++;
+  }
+  pthread_mutex_unlock(&pool.mutex);
+
+  return fd;
+}
+
+/* stop filling the pool, and close what is in it */
+void FtpPasvPoolShutdown(void) {
+  int i;
+
+  if (!pool.enabled) {
+    return;
+  }
+
+  pthread_mutex_lock(&pool.mutex);
+  pool.stopping = 1;
+  pthread_cond_signal(&pool.cond);
+  pthread_mutex_unlock(&pool.mutex);
+  pthread_join(pool.filler, NULL);
+
+  for (i = 0; i < pool.num_addrs; ++i) {
+    while (pool.addrs[i].count > 0) {
+      pool.addrs[i].count--;
+      Discard(pool.addrs[i].fds[pool.addrs[i].count],
+              pool.addrs[i].ports[pool.addrs[i].count]);
+    }
+  }
+}
+
+void FtpPasvPoolStats(unsigned long *hits, unsigned long *misses,
+                      int *pooled) {
+  int i;
+
+  pthread_mutex_lock(&pool.mutex);
+  *hits = pool.hits;
+  *misses = pool.misses;
+  *pooled = 0;
+  for (i = 0; i < pool.num_addrs; ++i) {
+    *pooled += pool.addrs[i].count;
+  }
+  pthread_mutex_unlock(&pool.mutex);
+}
+
+/* the sockets for addr, added if asked and there is room, or NULL; */
+/* called with the mutex held                                        */
+static AddrPool *Find(const struct in_addr *addr, int add) {
+  AddrPool *a;
+  int i;
+
+  for (i = 0; i < pool.num_addrs; ++i) {
+    if (pool.addrs[i].addr.s_addr == addr->s_addr) {
+      return &pool.addrs[i];
+    }
+  }
+  if (!add || (pool.num_addrs == MAX_ADDRESSES)) {
+    return NULL;
+  }
+
+  a = &pool.addrs[pool.num_addrs];
+  a->fds = (int *)malloc(pool.size * sizeof(int));
+  a->ports = (int *)malloc(pool.size * sizeof(int));
+  if ((a->fds == NULL) || (a->ports == NULL)) {
+    free(a->fds);
+    free(a->ports);
+    return NULL;
+  }
+  a->addr = *addr;
+  a->count = 0;
+  pool.num_addrs++;
+
+  return a;
+}
+
+/* a new socket listening on addr at a passive port, or -1 */
+static int Open(const struct in_addr *addr, int *port) {
+  struct sockaddr_in bind_addr;
+  int fd;
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1) {
+    return -1;
+  }
+
+  memset(&bind_addr, 0, sizeof(bind_addr));
+  bind_addr.sin_family = AF_INET;
+  bind_addr.sin_addr = *addr;
+  *port = FtpPassivePortBind(fd, &bind_addr);
+  if (*port == -1) {
+    close(fd);
+    return -1;
+  }
+
+  if (listen(fd, 1) != 0) {
+    Discard(fd, *port);
+    return -1;
+  }
+
+  return fd;
+}
+
+/* whether nobody has connected to a socket yet */
+static int Unused(int fd) {
+  struct pollfd pfd;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  return poll(&pfd, 1, 0) == 0;
+}
+
+static void Discard(int fd, int port) {
+  close(fd);
+  FtpPassivePortRelease(port);
+}
+
+/* opens sockets for the addresses that are short of them, sleeping  */
+/* while none are, or for a second after running out of ports        */
+static void *FillRun(void *arg) {
+  struct timespec wait;
+  AddrPool *a;
+  struct in_addr addr;
+  int i, fd, port;
+
+  (void)arg;
+  pthread_mutex_lock(&pool.mutex);
+  while (!pool.stopping) {
+    a = NULL;
+    for (i = 0; i < pool.num_addrs; ++i) {
+      if (pool.addrs[i].count < pool.size) {
+        a = &pool.addrs[i];
+        break;
+      }
+    }
+    if (a == NULL) {
+      pthread_cond_wait(&pool.cond, &pool.mutex);
+      continue;
+    }
+
+    addr = a->addr;
+    pthread_mutex_unlock(&pool.mutex);
+    fd = Open(&addr, &port);
+    pthread_mutex_lock(&pool.mutex);
+
+    if (fd == -1) {
+      clock_gettime(CLOCK_REALTIME, &wait);
+      wait.tv_sec++;
+      pthread_cond_timedwait(&pool.cond, &pool.mutex, &wait);
+    } else if ((a->count < pool.size) && !pool.stopping) {
+      a->fds[a->count] = fd;
+      a->ports[a->count] = port;
+      a->count++;
+    } else {
+      Discard(fd, port);
+    }
+  }
+  pthread_mutex_unlock(&pool.mutex);
+
+  return NULL;
+}
@@ -0,0 +1,13 @@
+#ifndef FTP_PASV_POOL_H
+#define FTP_PASV_POOL_H
+
+#include <netinet/in.h>
+
+int FtpPasvPoolInit(int size);
+int FtpPasvPoolEnabled(void);
+int FtpPasvPoolGet(const struct in_addr *addr, int *port);
+void FtpPasvPoolShutdown(void);
+void FtpPasvPoolStats(unsigned long *hits, unsigned long *misses,
+                      int *pooled);
+
+#endif /* FTP_PASV_POOL_H */
@@ -0,0 +1,142 @@
+#define _GNU_SOURCE
+#include "ftp_read_hint.h"
+#include <string.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <assert.h>
+
+/* how far ahead of a send to read (0 to leave it to the kernel), and */
+/* how big a file must be to drop what has been sent of it from the   */
+/* page cache (0 to never drop), set once before any transfer         */
+static off_t read_window = 0;
+static off_t drop_threshold = 0;
+
+/* totals over finished transfers */
+static struct {
+  unsigned long files;
+  unsigned long major_faults;
+  unsigned long blocks_in;
+  unsigned long stall_usec;
+} totals;
+
+/* what is dropped from the page cache at a time, a power of 2 so */
+/* there are few calls, and how far behind a send it is dropped    */
+static const off_t kDropStep = 8 * 1024 * 1024;
+static const off_t kDropLag = 16 * 1024 * 1024;
+
+static void Sample(FtpReadHint *h, unsigned long *faults,
+                   unsigned long *blocks, struct timespec *now);
+
+void FtpReadHintInit(off_t window, off_t drop_size) {
+  assert(window >= 0);
+  assert(drop_size >= 0);
+
+  read_window = window;
+  drop_threshold = drop_size;
+}
+
+/* about to send fd, size bytes long, from offset */
+void FtpReadHintStart(FtpReadHint *h, int fd, off_t size, off_t offset) {
+  assert(h != NULL);
+  assert(fd >= 0);
+
+  memset(h, 0, sizeof(FtpReadHint));
+  h->started = 1;
+  h->fd = fd;
+  h->size = size;
+  h->ahead = offset;
+  h->behind = offset & ~(kDropStep - 1);
+  h->drop = (drop_threshold > 0) && (size >= drop_threshold);
+
+  if (read_window > 0) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    h->ahead = (size - offset > read_window) ? offset + read_window : size;
+    readahead(fd, offset, h->ahead - offset);
+  }
+
+  Sample(h, &h->last_faults, &h->last_blocks, &h->last_time);
+}
+
+/* sent up to offset: count what that cost, keep the read ahead window */
+/* full, and drop what is well behind                                  */
+void FtpReadHintAdvance(FtpReadHint *h, off_t offset) {
+  unsigned long faults, blocks;
+  struct timespec now;
+
+  assert(h != NULL);
+  assert(h->started);
+
+  /* a send that read from disk waited for it */
+  Sample(h, &faults, &blocks, &now);
+  if ((faults > h->last_faults) || (blocks > h->last_blocks)) {
+    h->major_faults += faults - h->last_faults;
+    h->blocks_in += blocks - h->last_blocks;
+    h->stall_usec += (now.tv_sec - h->last_time.tv_sec) * 1000000L +
+                     (now.tv_nsec - h->last_time.tv_nsec) / 1000;
+  }
+
+  /* top up once half the window is sent */
+  if ((read_window > 0) && (h->ahead < h->size) &&
+      (h->ahead - offset < read_window / 2)) {
+    off_t end;
+
+    end = (h->size - offset > read_window) ? offset + read_window : h->size;
+    readahead(h->fd, h->ahead, end - h->ahead);
+    h->ahead = end;
+  }
+
+  /* drop what was sent long enough ago to have left the socket, in */
+  /* whole steps so no large page straddles the edge and is kept     */
+  if (h->drop) {
+    off_t end;
+
+    end = (offset - kDropLag) & ~(kDropStep - 1);
+    if (end - h->behind >= kDropStep) {
+      posix_fadvise(h->fd, h->behind, end - h->behind, POSIX_FADV_DONTNEED);
+      h->behind = end;
+    }
+  }
+
+  /* don't count the reads just asked for against the next send */
+  Sample(h, &h->last_faults, &h->last_blocks, &h->last_time);
+}
+
+/* done sending */
+void FtpReadHintEnd(FtpReadHint *h) {
+  assert(h != NULL);
+  assert(h->started);
+
+  if (h->drop && (h->behind < h->size)) {
+    posix_fadvise(h->fd, h->behind, h->size - h->behind, POSIX_FADV_DONTNEED);
+    h->behind = h->size;
+  }
+
+  __atomic_add_fetch(&totals.files, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&totals.major_faults, h->major_faults, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&totals.blocks_in, h->blocks_in, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&totals.stall_usec, h->stall_usec, __ATOMIC_RELAXED);
+}
+
+void FtpReadHintStats(unsigned long *files, unsigned long *major_faults,
+                      unsigned long *blocks_in, unsigned long *stall_usec) {
+  *files = __atomic_load_n(&totals.files, __ATOMIC_RELAXED);
+  *major_faults = __atomic_load_n(&totals.major_faults, __ATOMIC_RELAXED);
+  *blocks_in = __atomic_load_n(&totals.blocks_in, __ATOMIC_RELAXED);
+  *stall_usec = __atomic_load_n(&totals.stall_usec, __ATOMIC_RELAXED);
+}
+
+/* this thread's major faults and blocks read so far, and the time */
+static void Sample(FtpReadHint *h, unsigned long *faults,
+                   unsigned long *blocks, struct timespec *now) {
+  struct rusage usage;
+
+  if (getrusage(RUSAGE_THREAD, &usage) == 0) {
+    *faults = usage.ru_majflt;
+    *blocks = usage.ru_inblock;
+  } else {
+    *faults = h->last_faults;
+    *blocks = h->last_blocks;
+  }
+  clock_gettime(CLOCK_MONOTONIC, now);
+}
@@ -0,0 +1,40 @@
+#ifndef FTP_READ_HINT_H
+#define FTP_READ_HINT_H
+
+#include <time.h>
+#include <sys/types.h>
+
+/* page cache hints for one file being sent, and what reading it cost */
+typedef struct {
+  /* whether FtpReadHintStart() was called */
+  int started;
+
+  int fd;
+  off_t size;
+
+  /* read ahead up to here, and dropped from the page cache up to */
+  /* here (if the file is big enough to drop at all)               */
+  off_t ahead;
+  off_t behind;
+  int drop;
+
+  /* major faults and blocks read from disk while sending, and the */
+  /* microseconds spent on sends that had to wait for either       */
+  unsigned long major_faults;
+  unsigned long blocks_in;
+  unsigned long stall_usec;
+
+  /* counts when last looked at, and when */
+  unsigned long last_faults;
+  unsigned long last_blocks;
+  struct timespec last_time;
+} FtpReadHint;
+
+void FtpReadHintInit(off_t window, off_t drop_size);
+void FtpReadHintStart(FtpReadHint *h, int fd, off_t size, off_t offset);
+void FtpReadHintAdvance(FtpReadHint *h, off_t offset);
+void FtpReadHintEnd(FtpReadHint *h);
+void FtpReadHintStats(unsigned long *files, unsigned long *major_faults,
+                      unsigned long *blocks_in, unsigned long *stall_usec);
+
+#endif /* FTP_READ_HINT_H */
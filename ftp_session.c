@@ -10,6 +10,8 @@
 #include <errno.h>
 #include <pthread.h>
 #include <arpa/ftp.h>
+#include <stddef.h>
+#include <time.h>
 #include <assert.h>
 
 #include "ftpd.h"
@@ -17,41 +19,25 @@
 #include "ftp_command.h"
 #include "ftp_command_handler.h"
 #include "ftp_log.h"
-
-struct {
-  char *name;
-  void (*func)(FtpSession *f, const FtpCommand *cmd);
-} command_func[] = {
-  { "user", DoUser  },
-  { "pass", DoPass  },
-  { "cwd",  DoCwd   },
-  { "cdup", DoCdup  },
-  { "quit", DoQuit  },
-  { "pwd",  DoPwd   },
-  { "retr", DoRetr  },
-  { "stor", DoStor  },
-  { "noop", DoNoop  },
-  { "list", DoList  },
-  { "nlst", DoNlst  },
-  { "rest", DoRest  },
-  { "mdtm", DoMdtm  },
-  { "port", DoPort  },
-  { "pasv", DoPasv  },
-  { "type", DoType  },
-  { "stru", DoStru  },
-  { "mode", DoMode  },
-};
-
-static const int kCommandFuncNum = sizeof(command_func) / sizeof(command_func[0]);
+#include "ftp_passive_port.h"
 
 static void GetAddrStr(const struct sockaddr_in *s, char *buf, int bufsiz);
-static void SendReadme(const FtpSession *f, int code);
+static void SendReadme(FtpSession *f, int code);
+static int QueueReply(FtpSession *f, const char *s, int line);
+static int CheckTimeouts(FtpTimer *t);
+static int MinTimeout(int a, int b);
+
+/* seconds an idle client gets to take its 421 before the control */
+/* connection is shut down outright                                */
+static const int kDropGrace = 10;
 
 int FtpSessionInit(FtpSession *f,
                    const struct sockaddr_in *client_addr,
                    const struct sockaddr_in *server_addr,
                    TelnetSession *t,
-                   const char *dir) {
+                   const char *dir,
+                   int idle_timeout,
+                   int transfer_timeout) {
   assert(f != NULL);
   assert(client_addr != NULL);
   assert(server_addr != NULL);
@@ -60,7 +46,11 @@ int FtpSessionInit(FtpSession *f,
   assert(strlen(dir) <= PATH_MAX);
 
   f->session_active = 1;
+  f->logged_in = 0;
+  f->email[0] = '\0';
   f->command_number = 0;
+  f->line_overflow = 0;
+  f->reply_nowait = 0;
 
   f->data_type = TYPE_A;
   f->file_structure = STRU_F;
@@ -80,6 +70,22 @@ int FtpSessionInit(FtpSession *f,
   f->data_channel = DATA_PORT;
   f->data_port = *client_addr;
   f->server_fd = -1;
+  f->server_port = 0;
+
+  f->idle_timeout = idle_timeout;
+  f->transfer_timeout = transfer_timeout;
+  f->last_activity = FtpTimerNow();
+  f->transfer_activity = f->last_activity;
+  f->transfer_fd = -1;
+  f->transfer_active = 0;
+  pthread_mutex_init(&f->transfer_mutex, NULL);
+  f->transfer_stalled = 0;
+  f->timed_out = 0;
+
+  FtpTimerInit(&f->timer, CheckTimeouts);
+  if (MinTimeout(idle_timeout, transfer_timeout) > 0) {
+    FtpTimerSet(&f->timer, MinTimeout(idle_timeout, transfer_timeout));
+  }
 
   return 1;
 }
@@ -92,7 +98,7 @@ void FtpSessionDrop(FtpSession *f, const char *reason) {
 }
 
 void FtpSessionReply(FtpSession *f, int code, const char *fmt, ...) {
-  char buf[256];
+  char buf[MAX_REPLY_LEN + 1];
   va_list ap;
 
   assert(code >= 100);
@@ -110,76 +116,248 @@ void FtpSessionReply(FtpSession *f, int code, const char *fmt, ...) {
 
   //syslog(LOG_DEBUG, "%s %s", f->client_addr_str, buf);
 
-  /* send the output to the other side */
-  TelnetPrintLine(f->telnet_session, buf);
+  /* queue the reply, it goes out with any others once the input runs */
+  /* dry; a preliminary reply means we're about to wait, so send now   */
+  QueueReply(f, buf, 1);
+  if (code < 200) {
+    if (f->reply_nowait) {
+      TelnetTryFlush(f->telnet_session);
+    } else {
+      TelnetFlush(f->telnet_session);
+    }
+  }
 }
 
 void FtpSessionRun(FtpSession *f) {
   char buf[2048];
-  int len = 0, i = 0, cmd_parse_ret = 0;
-  FtpCommand cmd;
+  int read_ret;
 
   /* say hello */
+  FtpSessionStart(f);
+
+  /* process commands; pipelined commands are all answered before */
+  /* the replies are sent, in a single write */
+  while (f->session_active) {
+    read_ret = TelnetTryReadLine(f->telnet_session, buf, sizeof(buf));
+    if (read_ret == TELNET_WOULD_BLOCK) {
+      if (!TelnetFlush(f->telnet_session)) {
+        break;
+      }
+      read_ret = TelnetReadLine(f->telnet_session, buf, sizeof(buf));
+    }
+    if (!read_ret) {
+      break;
+    }
+    FtpSessionProcessLine(f, buf);
+  }
+  TelnetFlush(f->telnet_session);
+}
+
+void FtpSessionStart(FtpSession *f) {
   SendReadme(f, 220);
   FtpSessionReply(f, 220, "Service ready for new user.");
+}
 
-  /* process commands */
-  while (f->session_active &&
-        TelnetReadLine(f->telnet_session, buf, sizeof(buf))) {
-    /* increase our command count */
-    if (f->command_number == ULONG_MAX) {
-      f->command_number = 0;
-    } else {
-      f->command_number++;
-    }
+/* handle a single line read from the control connection */
+void FtpSessionProcessLine(FtpSession *f, char *buf) {
+  int len = 0, cmd_parse_ret = 0;
+  FtpCommand cmd;
+  struct timespec start, end;
 
-    /* make sure we read a whole line */
-    len = strlen(buf);
-    if (buf[len-1] != '\n') {
-      FtpSessionReply(f, 500, "Command line too long.");
-      while (TelnetReadLine(f->telnet_session, buf, sizeof(buf))) {
-        len = strlen(buf);
-        if (buf[len-1] == '\n') {
-          break;
-        }
-      }
-      goto next_command;
-    }
+  len = strlen(buf);
+  f->last_activity = FtpTimerNow();
 
-    /* parse the line */
-    if ((cmd_parse_ret = FtpCommandParse(buf, &cmd)) != 0) {
-      if (cmd_parse_ret == COMMAND_PARAMETERS_ERROR) {
-        FtpSessionReply(f, 501, "Syntax error in parameters or arguments of command %s.", buf);
-      } else {
-        FtpSessionReply(f, 500, "Syntax error, command %s unrecognized.", buf);
-      }
-      goto next_command;
+  /* skip the remains of a line we already complained about */
+  if (f->line_overflow) {
+    if ((len > 0) && (buf[len-1] == '\n')) {
+      f->line_overflow = 0;
     }
+    return;
+  }
 
-    FtpLog(LOG_INFO, "%s", cmd.command);
+  /* increase our command count */
+  if (f->command_number == ULONG_MAX) {
+    f->command_number = 0;
+  } else {
+    f->command_number++;
+  }
 
-    /* dispatch the command */
-    for (i = 0; i < kCommandFuncNum; i++) {
-      if (strcasecmp(cmd.command, command_func[i].name) == 0) {
-        (command_func[i].func)(f, &cmd);
-        goto next_command;
-      }
+  /* make sure we read a whole line */
+  if (buf[len-1] != '\n') {
+    FtpSessionReply(f, 500, "Command line too long.");
+    f->line_overflow = 1;
+    return;
+  }
+
+  /* parse the line */
+  if ((cmd_parse_ret = FtpCommandParse(buf, &cmd)) != 0) {
+    if (cmd_parse_ret == COMMAND_PARAMETERS_ERROR) {
+      FtpSessionReply(f, 501, "Syntax error in parameters or arguments of command %s.", buf);
+    } else {
+      FtpSessionReply(f, 500, "Syntax error, command %s unrecognized.", buf);
     }
+    return;
+  }
+
+  FtpLog(LOG_DEBUG, "%s", cmd.command);
 
-    /* oops, we don't have this command (shouldn't happen - shrug) */
+  if ((cmd.def->flags & COMMAND_LOGIN) && !f->logged_in) {
+    FtpSessionReply(f, 530, "Please login with USER and PASS.");
+    FtpCommandRecord(cmd.def, 0);
+    return;
+  }
+
+  /* oops, we don't have this command */
+  if (cmd.def->func == NULL) {
     FtpSessionReply(f, 502, "Command not implemented.");
+    FtpCommandRecord(cmd.def, 0);
+    return;
+  }
 
-next_command: {}
+  /* the client may be waiting on a queued reply (a 227, say) */
+  /* before it opens the data connection we'd wait for        */
+  if (cmd.def->flags & COMMAND_BLOCKS) {
+    TelnetFlush(f->telnet_session);
   }
+
+  /* dispatch the command, timing it for the command counters */
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  (cmd.def->func)(f, &cmd);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  FtpCommandRecord(cmd.def, (end.tv_sec - start.tv_sec) * 1000000000UL +
+                            end.tv_nsec - start.tv_nsec);
+}
+
+/* check whether the command on a line may block on a data connection */
+int FtpSessionCommandBlocks(const char *buf) {
+  const FtpCommandDef *def;
+
+  def = FtpCommandLookup(buf);
+  return (def != NULL) && (def->flags & COMMAND_BLOCKS);
 }
 
 void FtpSessionDestroy(FtpSession *f) {
+  char reason[80];
+
+  /* the timer has stopped reading an idle client; say goodbye from */
+  /* here, where no other replies can be half sent                  */
+  if (__atomic_load_n(&f->timed_out, __ATOMIC_ACQUIRE)) {
+    FtpLog(LOG_INFO, "%s idle for %d seconds, dropping connection",
+           f->client_addr_str, f->idle_timeout);
+    snprintf(reason, sizeof(reason),
+             "Timeout (%d seconds): closing control connection",
+             f->idle_timeout);
+    FtpSessionDrop(f, reason);
+    if (f->reply_nowait) {
+      TelnetTryFlush(f->telnet_session);
+    } else {
+      TelnetFlush(f->telnet_session);
+    }
+  }
+
+  /* once cancelled, the timer can't touch our sockets any more */
+  FtpTimerCancel(&f->timer);
+  pthread_mutex_destroy(&f->transfer_mutex);
+
   if (f->server_fd != -1) {
     close(f->server_fd);
     f->server_fd = -1;
+    FtpPassivePortRelease(f->server_port);
+  }
+}
+
+/* a transfer is starting, or moving on to a new socket; fd is */
+/* shut down if the transfer stalls, -1 for nothing to shut    */
+void FtpSessionTransferStart(FtpSession *f, int fd) {
+  pthread_mutex_lock(&f->transfer_mutex);
+  f->transfer_active = 1;
+  f->transfer_fd = fd;
+  f->transfer_activity = FtpTimerNow();
+  pthread_mutex_unlock(&f->transfer_mutex);
+}
+
+/* the transfer is over; must be called before its socket is closed */
+void FtpSessionTransferEnd(FtpSession *f) {
+  int stalled;
+
+  pthread_mutex_lock(&f->transfer_mutex);
+  f->transfer_active = 0;
+  f->transfer_fd = -1;
+  f->last_activity = FtpTimerNow();
+  stalled = f->transfer_stalled;
+  f->transfer_stalled = 0;
+  pthread_mutex_unlock(&f->transfer_mutex);
+
+  if (stalled > 0) {
+    FtpLog(LOG_WARNING, "%s transfer stalled for %d seconds, aborted",
+           f->client_addr_str, stalled);
   }
 }
 
+/* timer callback: drop a stalled transfer or an idle client; it runs */
+/* under the wheel's lock, so it neither logs nor writes to a socket  */
+static int CheckTimeouts(FtpTimer *t) {
+  FtpSession *f;
+  time_t now;
+  int idle;
+
+  f = (FtpSession *)((char *)t - offsetof(FtpSession, timer));
+  now = FtpTimerNow();
+
+  pthread_mutex_lock(&f->transfer_mutex);
+  if (f->transfer_active) {
+    /* the client is busy with the transfer, only watch its progress */
+    idle = now - f->transfer_activity;
+    if ((f->transfer_timeout > 0) && (idle >= f->transfer_timeout)) {
+      f->transfer_stalled = idle;
+      if (f->transfer_fd != -1) {
+        shutdown(f->transfer_fd, SHUT_RDWR);
+      }
+      f->transfer_activity = now;
+      idle = 0;
+    }
+    pthread_mutex_unlock(&f->transfer_mutex);
+    return MinTimeout((f->transfer_timeout > 0) ? f->transfer_timeout - idle : 0,
+                      f->idle_timeout);
+  }
+  pthread_mutex_unlock(&f->transfer_mutex);
+
+  /* the client had its chance to read the 421, but its session is */
+  /* still stuck sending it replies                                */
+  if (__atomic_load_n(&f->timed_out, __ATOMIC_ACQUIRE)) {
+    shutdown(f->telnet_session->in_fd, SHUT_RDWR);
+    return 0;
+  }
+
+  /* check at least every transfer timeout, in case one starts */
+  if (f->idle_timeout <= 0) {
+    return f->transfer_timeout;
+  }
+
+  idle = now - f->last_activity;
+  if (idle < f->idle_timeout) {
+    return MinTimeout(f->idle_timeout - idle, f->transfer_timeout);
+  }
+
+  /* wake whoever is reading the control connection, so the session */
+  /* ends and sends the 421 itself                                   */
+  __atomic_store_n(&f->timed_out, 1, __ATOMIC_RELEASE);
+  shutdown(f->telnet_session->in_fd, SHUT_RD);
+
+  return kDropGrace;
+}
+
+/* smallest of two timeouts, where 0 means none */
+static int MinTimeout(int a, int b) {
+  if (a <= 0) {
+    return b;
+  }
+  if ((b <= 0) || (a < b)) {
+    return a;
+  }
+  return b;
+}
+
 static void GetAddrStr(const struct sockaddr_in *s, char *buf, int bufsiz) {
     unsigned int addr;
     int port;
@@ -202,7 +380,7 @@ static void GetAddrStr(const struct sockaddr_in *s, char *buf, int bufsiz) {
              port);
 }
 
-static void SendReadme(const FtpSession *f, int code) {
+static void SendReadme(FtpSession *f, int code) {
   char file_path[PATH_MAX + 1];
   struct stat stat_buf;
   char buf[4096], code_str[8];
@@ -249,24 +427,24 @@ static void SendReadme(const FtpSession *f, int code) {
   /* read and send */
   read_ret = read(fd, buf, sizeof(buf));
   if (read_ret > 0) {
-    TelnetPrint(f->telnet_session, code_str);
+    QueueReply(f, code_str, 0);
     while (read_ret > 0) {
       p = buf;
       len = read_ret;
       nl = memchr(p, '\n', len);
       while ((len > 0) && (nl != NULL)) {
         *nl = '\0';
-        TelnetPrintLine(f->telnet_session, p);
+        QueueReply(f, p, 1);
         line_len = nl - p;
         len -= line_len + 1;
         if (len > 0) {
-          TelnetPrint(f->telnet_session, code_str);
+          QueueReply(f, code_str, 0);
         }
         p = nl+1;
         nl = memchr(p, '\n', len);
       }
       if (len > 0) {
-        TelnetPrint(f->telnet_session, p);
+        QueueReply(f, p, 0);
       }
 
       read_ret = read(fd, buf, sizeof(buf));
@@ -280,3 +458,28 @@ exit_SendReadme:
   }
 }
 
+/* queue s (as a line if asked) for the client; on an event loop this */
+/* must never wait, so a client that leaves its replies unread until   */
+/* neither the buffer nor the socket will take more is dropped         */
+static int QueueReply(FtpSession *f, const char *s, int line) {
+  int ret;
+
+  if (!f->reply_nowait) {
+    return line ? TelnetQueueLine(f->telnet_session, s) :
+                  TelnetQueue(f->telnet_session, s);
+  }
+
+  ret = line ? TelnetTryQueueLine(f->telnet_session, s) :
+               TelnetTryQueue(f->telnet_session, s);
+  if (ret == TELNET_WOULD_BLOCK) {
+    if (f->session_active) {
+      FtpLog(LOG_WARNING, "%s not reading replies, dropping connection",
+             f->client_addr_str);
+    }
+    f->session_active = 0;
+    return 0;
+  }
+
+  return ret;
+}
+
@@ -5,7 +5,9 @@
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <arpa/ftp.h>
+#include <pthread.h>
 #include "telnet_session.h"
+#include "ftp_timer.h"
 
 /* data path chosen */
 #define DATA_PORT     0
@@ -16,14 +18,29 @@
         "2001:3333:DEAD:BEEF:0666:0013:0069:0042 port 65535" */
 #define ADDRPORT_STRLEN 58
 
+/* longest reply FtpSessionReply() sends, not counting the CRLF */
+#define MAX_REPLY_LEN 255
+
 /* structure encapsulating an FTP session's information */
-typedef struct {
+typedef struct FtpSession {
   /* flag whether session is active */
   int session_active;
 
+  /* set once the client has logged in, and the e-mail address it */
+  /* gave as its password, for the transfer log                     */
+  int logged_in;
+  char email[64];
+
   /* incremented for each command */
   unsigned long command_number;
 
+  /* set while discarding the rest of an overlong command line */
+  int line_overflow;
+
+  /* set while running on an event loop, where replies are queued */
+  /* without ever waiting for the client to read them             */
+  int reply_nowait;
+
   /* options about transfer set by user */
   int data_type;
   int file_structure;
@@ -50,14 +67,48 @@ typedef struct {
   int data_channel;
   struct sockaddr_in data_port;
   int server_fd;
+  int server_port;
+
+  /* seconds a client may sit between commands, and a transfer may go */
+  /* without progress, before being dropped (0 to wait forever)       */
+  int idle_timeout;
+  int transfer_timeout;
+
+  /* when the last command arrived and the transfer last made progress */
+  time_t last_activity;
+  time_t transfer_activity;
+
+  /* socket of the running transfer, shut down if it stalls */
+  /* (-1 when there is none), and the lock guarding it      */
+  int transfer_fd;
+  int transfer_active;
+  pthread_mutex_t transfer_mutex;
+
+  /* set by the timer, which only marks a stalled transfer or an idle */
+  /* client: logging and the 421 are left to the session's own thread */
+  int transfer_stalled;
+  int timed_out;
+
+  /* checks the two timeouts above */
+  FtpTimer timer;
 } FtpSession;
 
 int FtpSessionInit(FtpSession *f, const struct sockaddr_in *client_addr,
                    const struct sockaddr_in *server_addr,
-                   TelnetSession *t, const char *dir);
+                   TelnetSession *t, const char *dir,
+                   int idle_timeout, int transfer_timeout);
 void FtpSessionDrop(FtpSession *f, const char *reason);
 void FtpSessionRun(FtpSession *f);
+void FtpSessionStart(FtpSession *f);
+void FtpSessionProcessLine(FtpSession *f, char *buf);
+int FtpSessionCommandBlocks(const char *buf);
 void FtpSessionReply(FtpSession *f, int code, const char *fmt, ...);
 void FtpSessionDestroy(FtpSession *f);
+void FtpSessionTransferStart(FtpSession *f, int fd);
+void FtpSessionTransferEnd(FtpSession *f);
+
+/* note that the running transfer moved some data */
+#define FtpSessionTransferProgress(f) \
+  ((f)->transfer_activity = FtpTimerNow())
 
 #endif /* FTP_SESSION_H */
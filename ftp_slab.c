@@ -0,0 +1,244 @@
+#include "ftp_slab.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "ftp_log.h"
+
+/* objects a thread keeps for itself, and how many move at a time */
+/* between a thread's cache and the shared free list */
+#define CACHE_SIZE 16
+#define CACHE_BATCH (CACHE_SIZE / 2)
+
+/* objects are aligned so two threads never share a cache line */
+static const size_t kObjectAlign = 64;
+
+typedef struct {
+  FtpSlab *slab;
+  int count;
+  void *objects[CACHE_SIZE];
+} SlabCache;
+
+static SlabCache *GetCache(FtpSlab *s);
+static void PutShared(FtpSlab *s, void *p);
+static void FlushCache(SlabCache *cache);
+
+/* preallocate room for num_objects objects of object_size bytes */
+int FtpSlabInit(FtpSlab *s, size_t object_size, int num_objects) {
+  int i;
+
+  assert(s != NULL);
+  assert(object_size >= sizeof(void *));
+  assert(num_objects > 0);
+
+  s->object_size = (object_size + kObjectAlign - 1) & ~(kObjectAlign - 1);
+  if (posix_memalign((void **)&s->memory, kObjectAlign,
+                     s->object_size * num_objects) != 0) {
+    FtpLog(LOG_ERROR, "out of memory preallocating %d objects", num_objects);
+    return 0;
+  }
+  s->memory_end = s->memory + s->object_size * num_objects;
+
+  /* chain the objects so the lowest addresses are handed out first */
+  s->free_list = NULL;
+  for (i = num_objects - 1; i >= 0; --i) {
+    *(void **)(s->memory + s->object_size * i) = s->free_list;
+    s->free_list = s->memory + s->object_size * i;
+  }
+  s->num_free = num_objects;
+  pthread_mutex_init(&s->mutex, NULL);
+
+  s->hits = 0;
+  s->misses = 0;
+
+  if (pthread_key_create(&s->cache_key,
+                         (void (*)(void *))FlushCache) != 0) {
+    FtpLog(LOG_ERROR, "error creating slab cache key");
+    free(s->memory);
+    return 0;
+  }
+
+  return 1;
+}
+
+void *FtpSlabAlloc(FtpSlab *s) {
+  SlabCache *cache;
+  void *p;
+
+  cache = GetCache(s);
+
+  /* refill an empty cache from the shared list */
+  if ((cache != NULL) && (cache->count == 0)) {
+    pthread_mutex_lock(&s->mutex);
+    while ((cache->count < CACHE_BATCH) && (s->free_list != NULL)) {
+      cache->objects[cache->count++] = s->free_list;
+      s->free_list = *(void **)s->free_list;
+      s->num_free--;
+    }
+    pthread_mutex_unlock(&s->mutex);
+  }
+
+  if ((cache != NULL) && (cache->count > 0)) {
+    __atomic_fetch_add(&s->hits, 1, __ATOMIC_RELAXED);
+    return cache->objects[--cache->count];
+  }
+
+  /* more objects live than we preallocated for */
+  __atomic_fetch_add(&s->misses, 1, __ATOMIC_RELAXED);
+  p = malloc(s->object_size);
+
+  return p;
+}
+
+void FtpSlabFree(FtpSlab *s, void *p) {
+  SlabCache *cache;
+
+  assert(p != NULL);
+
+  /* overflow objects go back to malloc, so the slab never grows */
+  if (((char *)p < s->memory) || ((char *)p >= s->memory_end)) {
+    free(p);
+    return;
+  }
+
+  /* only threads that allocate have a cache; one that just frees, */
+  /* e.g. an event loop or worker freeing what the acceptor          */
+  /* allocated, would strand objects in one nothing takes from       */
+  cache = (SlabCache *)pthread_getspecific(s->cache_key);
+  if (cache == NULL) {
+    pthread_mutex_lock(&s->mutex);
+    PutShared(s, p);
+    pthread_mutex_unlock(&s->mutex);
+    return;
+  }
+
+  /* make room by giving half the cache back to the shared list */
+  if (cache->count == CACHE_SIZE) {
+    pthread_mutex_lock(&s->mutex);
+    while (cache->count > CACHE_SIZE - CACHE_BATCH) {
+      PutShared(s, cache->objects[--cache->count]);
+    }
+    pthread_mutex_unlock(&s->mutex);
+  }
+
+  cache->objects[cache->count++] = p;
+}
+
+void FtpSlabStats(FtpSlab *s, unsigned long *hits, unsigned long *misses) {
+  *hits = __atomic_load_n(&s->hits, __ATOMIC_RELAXED);
+  *misses = __atomic_load_n(&s->misses, __ATOMIC_RELAXED);
+}
+
+/* find the calling thread's cache, creating it the first time */
+static SlabCache *GetCache(FtpSlab *s) {
+  SlabCache *cache;
+
+  cache = (SlabCache *)pthread_getspecific(s->cache_key);
+  if (cache == NULL) {
+    cache = (SlabCache *)malloc(sizeof(SlabCache));
+    if (cache == NULL) {
+      return NULL;
+    }
+    cache->slab = s;
+    cache->count = 0;
+    pthread_setspecific(s->cache_key, cache);
+  }
+
+  return cache;
+}
+
+/* push an object on the shared list; called with the mutex held */
+static void PutShared(FtpSlab *s, void *p) {
+  *(void **)p = s->free_list;
+  s->free_list = p;
+  s->num_free++;
+}
+
+/* give a departing thread's objects back to the shared list */
+static void FlushCache(SlabCache *cache) {
+  FtpSlab *s = cache->slab;
+
+  pthread_mutex_lock(&s->mutex);
+  while (cache->count > 0) {
+    PutShared(s, cache->objects[--cache->count]);
+  }
+  pthread_mutex_unlock(&s->mutex);
+
+  free(cache);
+}
+
+#ifdef SLAB_BENCHMARK
+/* one thread allocates every object, as the acceptor does, and hands */
+/* them to others to free, as event loops and workers do; the freeing */
+/* threads live on, so nothing they keep is flushed back at exit, and */
+/* with all objects live at once none should come from malloc         */
+#include <stdio.h>
+
+#define NUM_OBJECTS 256
+#define MAX_FREERS 8
+
+static FtpSlab slab;
+static pthread_barrier_t allocated, freed;
+static void *handed[MAX_FREERS][NUM_OBJECTS];
+static int num_handed[MAX_FREERS];
+static int rounds;
+
+static void *FreeRun(void *arg) {
+  int r, i, t;
+
+  t = (int)(long)arg;
+  for (r = 0; r < rounds; ++r) {
+    pthread_barrier_wait(&allocated);
+    for (i = 0; i < num_handed[t]; ++i) {
+      FtpSlabFree(&slab, handed[t][i]);
+    }
+    pthread_barrier_wait(&freed);
+  }
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  static const int kFreers[] = { 1, 2, 4, 8 };
+  pthread_t threads[MAX_FREERS];
+  unsigned long hits, misses, last_hits, last_misses;
+  int r, f, n, i;
+
+  rounds = (argc > 1) ? atoi(argv[1]) : 1000;
+  if (!FtpSlabInit(&slab, 512, NUM_OBJECTS)) {
+    return 1;
+  }
+
+  printf("freeing threads  allocations  from slab  from malloc\n");
+  last_hits = last_misses = 0;
+  for (f = 0; f < 4; ++f) {
+    n = kFreers[f];
+    pthread_barrier_init(&allocated, NULL, n + 1);
+    pthread_barrier_init(&freed, NULL, n + 1);
+    for (i = 0; i < n; ++i) {
+      pthread_create(&threads[i], NULL, FreeRun, (void *)(long)i);
+    }
+    for (r = 0; r < rounds; ++r) {
+      memset(num_handed, 0, sizeof(num_handed));
+      for (i = 0; i < NUM_OBJECTS; ++i) {
+        handed[i % n][num_handed[i % n]++] = FtpSlabAlloc(&slab);
+      }
+      pthread_barrier_wait(&allocated);
+      pthread_barrier_wait(&freed);
+    }
+    for (i = 0; i < n; ++i) {
+      pthread_join(threads[i], NULL);
+    }
+    pthread_barrier_destroy(&allocated);
+    pthread_barrier_destroy(&freed);
+
+    FtpSlabStats(&slab, &hits, &misses);
+    printf("%15d  %11lu  %9lu  %11lu\n", n,
+           (hits - last_hits) + (misses - last_misses), hits - last_hits,
+           misses - last_misses);
+    last_hits = hits;
+    last_misses = misses;
+  }
+
+  return (misses > 0);
+}
+#endif /* SLAB_BENCHMARK */
@@ -0,0 +1,35 @@
+#ifndef FTP_SLAB_H
+#define FTP_SLAB_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/* fixed-size object allocator recycling objects through a shared free */
+/* list, with a small cache in front of it for each thread             */
+typedef struct {
+  /* size of each object, rounded up to a cache line */
+  size_t object_size;
+
+  /* block objects are preallocated in, and its end */
+  char *memory;
+  char *memory_end;
+
+  /* free objects, linked through their first word */
+  void *free_list;
+  int num_free;
+  pthread_mutex_t mutex;
+
+  /* allocations served from the slab, and those that fell back to malloc */
+  unsigned long hits;
+  unsigned long misses;
+
+  /* per-thread cache, flushed back to the free list when a thread exits */
+  pthread_key_t cache_key;
+} FtpSlab;
+
+int FtpSlabInit(FtpSlab *s, size_t object_size, int num_objects);
+void *FtpSlabAlloc(FtpSlab *s);
+void FtpSlabFree(FtpSlab *s, void *p);
+void FtpSlabStats(FtpSlab *s, unsigned long *hits, unsigned long *misses);
+
+#endif /* FTP_SLAB_H */
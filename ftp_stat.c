@@ -0,0 +1,540 @@
+#define _GNU_SOURCE
+#include "ftp_stat.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <errno.h>
+#include <poll.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "ftp_log.h"
+
+/* submission queue entries of each thread's ring */
+static const unsigned int kRingEntries = 256;
+
+/* a thread's io_uring, mapped by hand as there is no liburing here */
+typedef struct {
+  int fd;
+  unsigned int entries;
+
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  struct io_uring_sqe *sqes;
+
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  unsigned int cq_entries;
+  struct io_uring_cqe *cqes;
+
+  void *ring;
+  size_t ring_size;
+  size_t sqes_size;
+} StatRing;
+
+/* a batch the helper threads share out, one request at a time */
+typedef struct StatBatch {
+  FtpStatRequest *req;
+  int n;
+  unsigned int mask;
+
+  /* next request to hand out, and requests finished */
+  int next;
+  int done;
+
+  struct StatBatch *queue_next;
+} StatBatch;
+
+/* a way of looking up a batch of files */
+typedef struct {
+  const char *name;
+  int (*start)(int num_threads);
+  void (*batch)(FtpStatRequest *req, int n, unsigned int mask);
+  void (*stop)(void);
+} StatEngine;
+
+static int UringStart(int num_threads);
+static void UringBatch(FtpStatRequest *req, int n, unsigned int mask);
+static void UringStop(void);
+static StatRing *GetRing(void);
+static int Reap(StatRing *r, FtpStatRequest *req);
+static void FreeRing(StatRing *r);
+static int PoolStart(int num_threads);
+static void PoolBatch(FtpStatRequest *req, int n, unsigned int mask);
+static void PoolStop(void);
+static void *PoolRun(void *arg);
+static int PoolTake(StatBatch **batch);
+static void SyncBatch(FtpStatRequest *req, int n, unsigned int mask);
+static void StatOne(FtpStatRequest *req, unsigned int mask);
+
+static const StatEngine kEngines[] = {
+  { "uring",   UringStart, UringBatch, UringStop },
+  { "threads", PoolStart,  PoolBatch,  PoolStop },
+  { "sync",    NULL,       SyncBatch,  NULL }
+};
+
+static const int kNumEngines = sizeof(kEngines) / sizeof(kEngines[0]);
+
+/* the engine in use; batches are looked up one at a time until set */
+static const StatEngine *engine = &kEngines[2];
+
+/* each thread's ring, made the first time it looks up a batch */
+static pthread_key_t ring_key;
+
+/* helper threads, and the batches they are working through */
+static struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t work;
+  pthread_cond_t finished;
+  StatBatch *head;
+  StatBatch *tail;
+  int running;
+  int num_threads;
+  pthread_t *threads;
+} pool = {
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+  PTHREAD_COND_INITIALIZER, NULL, NULL, 0, 0, NULL
+};
+
+/* start the named engine; one that can't start falls back to the next */
+/* (io_uring to helper threads, helper threads to looking up in turn)  */
+int FtpStatInit(const char *name, int num_threads) {
+  int i;
+
+  assert(name != NULL);
+
+  for (i = 0; (i < kNumEngines) && (strcmp(kEngines[i].name, name) != 0);
+       ++i) {
+  }
+  if (i == kNumEngines) {
+    FtpLog(LOG_ERROR, "unknown metadata engine %s", name);
+    return 0;
+  }
+
+  for (; i < kNumEngines; ++i) {
+    if ((kEngines[i].start == NULL) || kEngines[i].start(num_threads)) {
+      engine = &kEngines[i];
+      return 1;
+    }
+    FtpLog(LOG_WARNING, "metadata engine %s unavailable, trying %s",
+           kEngines[i].name, kEngines[i + 1].name);
+  }
+
+  return 0;
+}
+
+const char *FtpStatEngine(void) {
+  return engine->name;
+}
+
+/* look up every request, in whatever order they complete; each gets */
+/* its error, 0 if its stx holds at least the fields in mask          */
+void FtpStatBatch(FtpStatRequest *req, int n, unsigned int mask) {
+  assert((n == 0) || (req != NULL));
+
+  if (n == 1) {
+    /* nothing to overlap a single lookup with */
+    StatOne(req, mask);
+  } else if (n > 1) {
+    engine->batch(req, n, mask);
+  }
+}
+
+/* look up a single path, as stat() does */
+int FtpStatPath(const char *path, unsigned int mask, struct statx *stx) {
+  FtpStatRequest req;
+
+  req.dir_fd = AT_FDCWD;
+  req.name = path;
+  req.flags = 0;
+  FtpStatBatch(&req, 1, mask);
+  if (req.error != 0) {
+    errno = req.error;
+    return 0;
+  }
+  memcpy(stx, &req.stx, sizeof(req.stx));
+
+  return 1;
+}
+
+void FtpStatShutdown(void) {
+  if (engine->stop != NULL) {
+    engine->stop();
+  }
+  engine = &kEngines[2];
+}
+
+static void StatOne(FtpStatRequest *req, unsigned int mask) {
+  if (statx(req->dir_fd, req->name, req->flags, mask, &req->stx) == 0) {
+    req->error = 0;
+  } else {
+    req->error = errno;
+  }
+}
+
+static void SyncBatch(FtpStatRequest *req, int n, unsigned int mask) {
+  int i;
+
+  for (i = 0; i < n; ++i) {
+    StatOne(&req[i], mask);
+  }
+}
+
+/* check io_uring is there, and can statx(), with a throwaway ring */
+static int UringStart(int num_threads) {
+  struct io_uring_probe *probe;
+  size_t probe_size;
+  StatRing *r;
+  int ok;
+
+  (void)num_threads;
+
+  if (pthread_key_create(&ring_key, (void (*)(void *))FreeRing) != 0) {
+    return 0;
+  }
+  r = GetRing();
+  if (r == NULL) {
+    pthread_key_delete(ring_key);
+    return 0;
+  }
+
+  probe_size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+  probe = (struct io_uring_probe *)calloc(1, probe_size);
+  ok = (probe != NULL) &&
+       (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE,
+                probe, 256) == 0) &&
+       (probe->last_op >= IORING_OP_STATX) &&
+       (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+
+  FreeRing(r);
+  pthread_setspecific(ring_key, NULL);
+  if (!ok) {
+    pthread_key_delete(ring_key);
+  }
+  return ok;
+}
+
+static void UringStop(void) {
+  StatRing *r;
+
+  /* other threads' rings go with them */
+  r = (StatRing *)pthread_getspecific(ring_key);
+  if (r != NULL) {
+    FreeRing(r);
+    pthread_setspecific(ring_key, NULL);
+  }
+}
+
+/* queue up to a ring full of statx() calls at a time, topping it up */
+/* as they complete; the kernel overlaps any that have to wait       */
+static void UringBatch(FtpStatRequest *req, int n, unsigned int mask) {
+  struct io_uring_sqe *sqe;
+  struct pollfd pfd;
+  unsigned int head, tail, idx;
+  int submitted, to_submit, in_flight, completed, ret, i;
+  StatRing *r;
+
+  r = GetRing();
+  if (r == NULL) {
+    SyncBatch(req, n, mask);
+    return;
+  }
+
+  /* -1 until completed */
+  for (i = 0; i < n; ++i) {
+    req[i].error = -1;
+  }
+
+  submitted = to_submit = in_flight = completed = 0;
+  while (completed < n) {
+    /* fill the submission queue */
+    head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    tail = *r->sq_tail;
+    while ((submitted < n) && (tail - head < r->entries) &&
+           (in_flight < (int)r->cq_entries)) {
+      idx = tail & *r->sq_mask;
+      sqe = &r->sqes[idx];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = IORING_OP_STATX;
+      sqe->fd = req[submitted].dir_fd;
+      sqe->addr = (uintptr_t)req[submitted].name;
+      sqe->len = mask;
+      sqe->off = (uintptr_t)&req[submitted].stx;
+      sqe->statx_flags = req[submitted].flags;
+      sqe->user_data = submitted;
+      r->sq_array[idx] = idx;
+      tail++;
+      submitted++;
+      to_submit++;
+      in_flight++;
+    }
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+    /* hand them over, and wait for at least one to complete */
+    ret = syscall(__NR_io_uring_enter, r->fd, to_submit, 1,
+                  IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret >= 0) {
+      to_submit -= ret;
+    } else if ((errno != EINTR) && (errno != EAGAIN) && (errno != EBUSY)) {
+      /* the kernel won't take the rest, so wait out those it holds, */
+      /* polling the ring rather than entering it again, and look    */
+      /* the rest up here; the ring may have queued entries, so it   */
+      /* isn't used again                                            */
+      FtpLog(LOG_WARNING, "io_uring_enter failed; %s", strerror(errno));
+      pfd.fd = r->fd;
+      pfd.events = POLLIN;
+      for (in_flight -= to_submit; in_flight > 0; in_flight -= ret) {
+        ret = Reap(r, req);
+        if (ret == 0) {
+          poll(&pfd, 1, -1);
+        }
+      }
+      pthread_setspecific(ring_key, NULL);
+      FreeRing(r);
+      for (i = 0; i < n; ++i) {
+        if (req[i].error == -1) {
+          StatOne(&req[i], mask);
+        }
+      }
+      return;
+    }
+
+    ret = Reap(r, req);
+    completed += ret;
+    in_flight -= ret;
+  }
+}
+
+/* collects whatever has completed, in any order; returns how many */
+static int Reap(StatRing *r, FtpStatRequest *req) {
+  struct io_uring_cqe *cqe;
+  unsigned int head, tail;
+  int reaped;
+
+  reaped = 0;
+  head = *r->cq_head;
+  tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    cqe = &r->cqes[head & *r->cq_mask];
+    req[cqe->user_data].error = (cqe->res < 0) ? -cqe->res : 0;
+    head++;
+    reaped++;
+  }
+  __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+  return reaped;
+}
+
+/* the calling thread's ring, set up on first use */
+static StatRing *GetRing(void) {
+  struct io_uring_params params;
+  StatRing *r;
+  char *ring;
+
+  r = (StatRing *)pthread_getspecific(ring_key);
+  if (r != NULL) {
+    return r;
+  }
+
+  r = (StatRing *)malloc(sizeof(StatRing));
+  if (r == NULL) {
+    return NULL;
+  }
+  memset(&params, 0, sizeof(params));
+  r->fd = syscall(__NR_io_uring_setup, kRingEntries, &params);
+  if (r->fd == -1) {
+    free(r);
+    return NULL;
+  }
+  fcntl(r->fd, F_SETFD, FD_CLOEXEC);
+
+  /* one mapping holds both rings on any kernel with IORING_OP_STATX */
+  r->ring = MAP_FAILED;
+  r->sqes = MAP_FAILED;
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    FreeRing(r);
+    return NULL;
+  }
+  r->ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  if (r->ring_size < params.cq_off.cqes +
+                     params.cq_entries * sizeof(struct io_uring_cqe)) {
+    r->ring_size = params.cq_off.cqes +
+                   params.cq_entries * sizeof(struct io_uring_cqe);
+  }
+  r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  r->ring = mmap(NULL, r->ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  r->sqes = (struct io_uring_sqe *)mmap(NULL, r->sqes_size,
+                                        PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE,
+                                        r->fd, IORING_OFF_SQES);
+  if ((r->ring == MAP_FAILED) || (r->sqes == MAP_FAILED)) {
+    FreeRing(r);
+    return NULL;
+  }
+
+  ring = (char *)r->ring;
+  r->entries = params.sq_entries;
+  r->sq_head = (unsigned int *)(ring + params.sq_off.head);
+  r->sq_tail = (unsigned int *)(ring + params.sq_off.tail);
+  r->sq_mask = (unsigned int *)(ring + params.sq_off.ring_mask);
+  r->sq_array = (unsigned int *)(ring + params.sq_off.array);
+  r->cq_entries = params.cq_entries;
+  r->cq_head = (unsigned int *)(ring + params.cq_off.head);
+  r->cq_tail = (unsigned int *)(ring + params.cq_off.tail);
+  r->cq_mask = (unsigned int *)(ring + params.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+
+  pthread_setspecific(ring_key, r);
+  return r;
+}
+
+static void FreeRing(StatRing *r) {
+  if (r->ring != MAP_FAILED) {
+    munmap(r->ring, r->ring_size);
+  }
+  if (r->sqes != MAP_FAILED) {
+    munmap(r->sqes, r->sqes_size);
+  }
+  close(r->fd);
+  free(r);
+}
+
+static int PoolStart(int num_threads) {
+  int i;
+
+  if (num_threads <= 0) {
+    return 0;
+  }
+  pool.threads = (pthread_t *)malloc(sizeof(pthread_t) * num_threads);
+  if (pool.threads == NULL) {
+    return 0;
+  }
+  pool.running = 1;
+  for (i = 0; i < num_threads; ++i) {
+    if (pthread_create(&pool.threads[i], NULL, PoolRun, NULL) != 0) {
+      FtpLog(LOG_ERROR, "unable to create metadata thread %d", i);
+      pool.num_threads = i;
+      PoolStop();
+      return 0;
+    }
+  }
+  pool.num_threads = num_threads;
+
+  return 1;
+}
+
+static void PoolStop(void) {
+  int i;
+
+  pthread_mutex_lock(&pool.mutex);
+  pool.running = 0;
+  pthread_cond_broadcast(&pool.work);
+  pthread_mutex_unlock(&pool.mutex);
+
+  for (i = 0; i < pool.num_threads; ++i) {
+    pthread_join(pool.threads[i], NULL);
+  }
+  free(pool.threads);
+  pool.threads = NULL;
+  pool.num_threads = 0;
+}
+
+/* queue the batch for the helpers, and work through it alongside them, */
+/* so it finishes even when they are all busy with other batches        */
+static void PoolBatch(FtpStatRequest *req, int n, unsigned int mask) {
+  StatBatch batch, *b;
+  int i;
+
+  batch.req = req;
+  batch.n = n;
+  batch.mask = mask;
+  batch.next = 0;
+  batch.done = 0;
+  batch.queue_next = NULL;
+
+  pthread_mutex_lock(&pool.mutex);
+  if (pool.tail == NULL) {
+    pool.head = &batch;
+  } else {
+    pool.tail->queue_next = &batch;
+  }
+  pool.tail = &batch;
+  pthread_cond_broadcast(&pool.work);
+
+  while (batch.done < n) {
+    if (batch.next < n) {
+      /* take one ourselves, while there are any left */
+      i = PoolTake(&b);
+      pthread_mutex_unlock(&pool.mutex);
+      StatOne(&b->req[i], b->mask);
+      pthread_mutex_lock(&pool.mutex);
+      b->done++;
+      if (b->done == b->n) {
+        pthread_cond_broadcast(&pool.finished);
+      }
+    } else {
+      pthread_cond_wait(&pool.finished, &pool.mutex);
+    }
+  }
+  pthread_mutex_unlock(&pool.mutex);
+}
+
+static void *PoolRun(void *arg) {
+  StatBatch *b;
+  int i;
+
+  (void)arg;
+
+  pthread_mutex_lock(&pool.mutex);
+  for (;;) {
+    while (pool.running && (pool.head == NULL)) {
+      pthread_cond_wait(&pool.work, &pool.mutex);
+    }
+    if (!pool.running) {
+      break;
+    }
+    i = PoolTake(&b);
+    pthread_mutex_unlock(&pool.mutex);
+    StatOne(&b->req[i], b->mask);
+    pthread_mutex_lock(&pool.mutex);
+
+    /* the batch's owner may return once this is counted */
+    b->done++;
+    if (b->done == b->n) {
+      pthread_cond_broadcast(&pool.finished);
+    }
+  }
+  pthread_mutex_unlock(&pool.mutex);
+
+  return NULL;
+}
+
+/* hand out the next request of the oldest batch, dropping the batch */
+/* from the queue once all of its requests are handed out; called    */
+/* with the mutex held and the queue not empty                       */
+static int PoolTake(StatBatch **batch) {
+  StatBatch *b;
+  int i;
+
+  b = pool.head;
+  i = b->next++;
+  if (b->next == b->n) {
+    pool.head = b->queue_next;
+    if (pool.head == NULL) {
+      pool.tail = NULL;
+    }
+  }
+  *batch = b;
+
+  return i;
+}
@@ -0,0 +1,28 @@
+#ifndef FTP_STAT_H
+#define FTP_STAT_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <linux/stat.h>
+
+/* the statx() fields a listing shows */
+#define FTP_STAT_LIST_MASK (STATX_TYPE | STATX_MODE | STATX_NLINK | \
+                            STATX_UID | STATX_GID | STATX_MTIME | STATX_SIZE)
+
+/* one file to look up, relative to a directory, and what was found */
+typedef struct {
+  int dir_fd;
+  const char *name;
+  int flags;
+
+  struct statx stx;
+  int error;
+} FtpStatRequest;
+
+int FtpStatInit(const char *engine, int num_threads);
+const char *FtpStatEngine(void);
+void FtpStatBatch(FtpStatRequest *req, int n, unsigned int mask);
+int FtpStatPath(const char *path, unsigned int mask, struct statx *stx);
+void FtpStatShutdown(void);
+
+#endif /* FTP_STAT_H */
@@ -0,0 +1,214 @@
+#define _GNU_SOURCE
+#include "ftp_text_cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <assert.h>
+
+/* hash buckets, a power of 2 */
+#define NUM_BUCKETS 256
+
+/* files smaller than this are converted as they are sent; a cached */
+/* copy saves little and costs a descriptor                         */
+static const off_t kMinSize = 64 * 1024;
+
+/* process-wide cache of files converted for ASCII transfers, kept in */
+/* unnamed files in a directory of their own, and bounded in bytes    */
+static struct {
+  int enabled;
+  int dir_fd;
+  FtpLru lru;
+
+  unsigned long hits;
+  unsigned long misses;
+
+  pthread_mutex_t mutex;
+} cache = { 0, -1, { NULL }, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+static int Wanted(const struct stat *st);
+static unsigned long long Hash(dev_t dev, ino_t ino);
+static FtpTextFile *Lookup(unsigned long long hash, const struct stat *st);
+static int Matches(const FtpTextFile *t, const struct stat *st);
+static FtpLruEntry *LeastUsed(const FtpLru *lru);
+static void Destroy(FtpLruEntry *e);
+
+/* keep up to max_bytes of converted files in dir_fd (a tmpfs keeps */
+/* them in memory), making room as policy says                      */
+int FtpTextCacheInit(int dir_fd, size_t max_bytes, int policy) {
+  assert(dir_fd != -1);
+  assert(max_bytes > 0);
+  assert((policy == TEXT_CACHE_LRU) || (policy == TEXT_CACHE_LFU));
+
+  if (!FtpLruInit(&cache.lru, NUM_BUCKETS, max_bytes, Destroy,
+                  (policy == TEXT_CACHE_LFU) ? LeastUsed : NULL)) {
+    return 0;
+  }
+  cache.dir_fd = dir_fd;
+  cache.enabled = 1;
+
+  return 1;
+}
+
+int FtpTextCacheEnabled(void) {
+  return cache.enabled;
+}
+
+/* the converted copy of the file st describes, if it is cached and */
+/* still current, to be given back with FtpTextCacheRelease()       */
+FtpTextFile *FtpTextCacheFind(const struct stat *st) {
+  FtpTextFile *t;
+
+  if (!Wanted(st)) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&cache.mutex);
+
+  t = Lookup(Hash(st->st_dev, st->st_ino), st);
+
+  /* a copy of what the file used to say is no use to anybody */
+  if ((t != NULL) && !Matches(t, st)) {
+    FtpLruRemove(&cache.lru, &t->entry);
+    t = NULL;
+  }
+
+  if (t == NULL) {
+    cache.misses++;
+  } else {
+    cache.hits++;
+    t->uses++;
+    FtpLruUse(&cache.lru, &t->entry);
+  }
+
+  pthread_mutex_unlock(&cache.mutex);
+  return t;
+}
+
+/* a new unnamed file to write the converted copy of the file st */
+/* describes to, or -1 if it isn't worth caching                  */
+int FtpTextCacheCreate(const struct stat *st) {
+  if (!Wanted(st)) {
+    return -1;
+  }
+
+  return openat(cache.dir_fd, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+}
+
+/* cache fd, from FtpTextCacheCreate() and holding len converted bytes, */
+/* as the copy of the file st describes (as it was before converting),  */
+/* taking ownership of it; returns NULL, having closed fd, if it won't  */
+/* fit or there is no memory                                            */
+FtpTextFile *FtpTextCacheInsert(const struct stat *st, int fd, off_t len) {
+  unsigned long long hash;
+  FtpTextFile *t, *old;
+
+  if (!cache.enabled || !FtpLruFits(&cache.lru, (size_t)len)) {
+    close(fd);
+    return NULL;
+  }
+  t = (FtpTextFile *)malloc(sizeof(FtpTextFile));
+  if (t == NULL) {
+    close(fd);
+    return NULL;
+  }
+
+  t->fd = fd;
+  t->len = len;
+  t->dev = st->st_dev;
+  t->ino = st->st_ino;
+  t->mtime = st->st_mtim;
+  t->ctime = st->st_ctim;
+  t->size = st->st_size;
+  t->uses = 1;
+  hash = Hash(t->dev, t->ino);
+
+  pthread_mutex_lock(&cache.mutex);
+
+  /* replace any other copy, e.g. by a session that missed too */
+  old = Lookup(hash, st);
+  if (old != NULL) {
+    FtpLruRemove(&cache.lru, &old->entry);
+  }
+  FtpLruInsert(&cache.lru, &t->entry, hash, len);
+
+  pthread_mutex_unlock(&cache.mutex);
+  return t;
+}
+
+/* done sending a file from FtpTextCacheFind() or FtpTextCacheInsert() */
+void FtpTextCacheRelease(FtpTextFile *t) {
+  pthread_mutex_lock(&cache.mutex);
+  FtpLruRelease(&cache.lru, &t->entry);
+  pthread_mutex_unlock(&cache.mutex);
+}
+
+void FtpTextCacheStats(unsigned long *hits, unsigned long *misses,
+                       unsigned long *evictions, size_t *bytes, int *entries) {
+  pthread_mutex_lock(&cache.mutex);
+  *hits = cache.hits;
+  *misses = cache.misses;
+  *evictions = cache.lru.evictions;
+  *bytes = cache.lru.bytes;
+  *entries = cache.lru.entries;
+  pthread_mutex_unlock(&cache.mutex);
+}
+
+/* whether a file is worth caching; converted, it may double in size */
+static int Wanted(const struct stat *st) {
+  return cache.enabled && (st->st_size >= kMinSize) &&
+         ((size_t)st->st_size <= cache.lru.max_bytes / 8);
+}
+
+static unsigned long long Hash(dev_t dev, ino_t ino) {
+  unsigned long long h;
+
+  h = (unsigned long long)ino ^ ((unsigned long long)dev << 32);
+
+  return h * 0x9E3779B97F4A7C15ULL;
+}
+
+/* the cached copy of the file st describes, current or not, or NULL */
+static FtpTextFile *Lookup(unsigned long long hash, const struct stat *st) {
+  FtpLruEntry *e;
+  FtpTextFile *t;
+
+  for (e = FtpLruChain(&cache.lru, hash); e != NULL; e = e->hash_next) {
+    t = (FtpTextFile *)e;
+    if ((t->dev == st->st_dev) && (t->ino == st->st_ino)) {
+      return t;
+    }
+  }
+
+  return NULL;
+}
+
+/* whether the copy is of the file as it is now */
+static int Matches(const FtpTextFile *t, const struct stat *st) {
+  return (t->size == st->st_size) &&
+         (t->mtime.tv_sec == st->st_mtim.tv_sec) &&
+         (t->mtime.tv_nsec == st->st_mtim.tv_nsec) &&
+         (t->ctime.tv_sec == st->st_ctim.tv_sec) &&
+         (t->ctime.tv_nsec == st->st_ctim.tv_nsec);
+}
+
+/* the file to evict under TEXT_CACHE_LFU: the least used, the least */
+/* recently used of those                                             */
+static FtpLruEntry *LeastUsed(const FtpLru *lru) {
+  FtpLruEntry *e, *victim;
+
+  victim = lru->lru_tail;
+  for (e = victim->lru_prev; e != NULL; e = e->lru_prev) {
+    if (((FtpTextFile *)e)->uses < ((FtpTextFile *)victim)->uses) {
+      victim = e;
+    }
+  }
+
+  return victim;
+}
+
+static void Destroy(FtpLruEntry *e) {
+  close(((FtpTextFile *)e)->fd);
+  free(e);
+}
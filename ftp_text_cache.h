@@ -0,0 +1,43 @@
+#ifndef FTP_TEXT_CACHE_H
+#define FTP_TEXT_CACHE_H
+
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "ftp_lru.h"
+
+/* which file makes room for a new one */
+#define TEXT_CACHE_LRU 0    /* the one least recently sent */
+#define TEXT_CACHE_LFU 1    /* the one sent the fewest times */
+
+/* a file converted for ASCII transfers, as it was when last changed */
+typedef struct FtpTextFile {
+  /* place in the cache */
+  FtpLruEntry entry;
+
+  /* an unnamed file holding the converted bytes, and how many */
+  int fd;
+  off_t len;
+
+  /* what it converts: the file, when it last changed, and its size */
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  struct timespec ctime;
+  off_t size;
+
+  /* times it has been sent */
+  unsigned long uses;
+} FtpTextFile;
+
+int FtpTextCacheInit(int dir_fd, size_t max_bytes, int policy);
+int FtpTextCacheEnabled(void);
+FtpTextFile *FtpTextCacheFind(const struct stat *st);
+int FtpTextCacheCreate(const struct stat *st);
+FtpTextFile *FtpTextCacheInsert(const struct stat *st, int fd, off_t len);
+void FtpTextCacheRelease(FtpTextFile *t);
+void FtpTextCacheStats(unsigned long *hits, unsigned long *misses,
+                       unsigned long *evictions, size_t *bytes, int *entries);
+
+#endif /* FTP_TEXT_CACHE_H */
@@ -0,0 +1,218 @@
+#include "ftp_timer.h"
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "ftp_log.h"
+
+/* the wheel has a level of one second slots, then two levels of */
+/* coarser slots that are cascaded down as their time comes near; */
+/* timers further out than the top level are clamped to it        */
+#define L0_BITS 8
+#define LN_BITS 6
+#define L0_SIZE (1 << L0_BITS)
+#define LN_SIZE (1 << LN_BITS)
+#define L0_MASK (L0_SIZE - 1)
+#define LN_MASK (LN_SIZE - 1)
+#define NUM_LEVELS 3
+#define MAX_DELAY ((1UL << (L0_BITS + LN_BITS * (NUM_LEVELS - 1))) - 1)
+
+/* a slot is a circular list headed by a dummy timer */
+static struct {
+  FtpTimer l0[L0_SIZE];
+  FtpTimer ln[NUM_LEVELS - 1][LN_SIZE];
+
+  /* next tick to process */
+  unsigned long jiffies;
+
+  /* wall clock as of the last tick, read without locking */
+  time_t now;
+
+  /* guards the slots; callbacks run while it is held, so once */
+  /* FtpTimerCancel() returns the callback is not running        */
+  pthread_mutex_t mutex;
+} wheel;
+
+static pthread_once_t wheel_once = PTHREAD_ONCE_INIT;
+static int wheel_started = 0;
+
+static void WheelInit(void);
+static void *WheelRun(void *arg);
+static void WheelTick(void);
+static int Cascade(int level, int index);
+static void AddTimer(FtpTimer *t);
+static void Unlink(FtpTimer *t);
+
+/* start the thread driving the wheel, once per process */
+int FtpTimerWheelStart(void) {
+  pthread_once(&wheel_once, WheelInit);
+
+  return wheel_started;
+}
+
+void FtpTimerInit(FtpTimer *t, int (*callback)(FtpTimer *t)) {
+  assert(t != NULL);
+  assert(callback != NULL);
+
+  t->next = NULL;
+  t->prev = NULL;
+  t->expires = 0;
+  t->callback = callback;
+}
+
+/* (re)arm a timer to go off in the given number of seconds */
+void FtpTimerSet(FtpTimer *t, int seconds) {
+  assert(seconds >= 0);
+
+  pthread_mutex_lock(&wheel.mutex);
+  Unlink(t);
+  t->expires = wheel.jiffies + seconds;
+  AddTimer(t);
+  pthread_mutex_unlock(&wheel.mutex);
+}
+
+void FtpTimerCancel(FtpTimer *t) {
+  pthread_mutex_lock(&wheel.mutex);
+  Unlink(t);
+  pthread_mutex_unlock(&wheel.mutex);
+}
+
+/* coarse current time, cheap enough to stamp on every operation */
+time_t FtpTimerNow(void) {
+  return __atomic_load_n(&wheel.now, __ATOMIC_RELAXED);
+}
+
+static void WheelInit(void) {
+  pthread_t thread_id;
+  int i, j;
+
+  for (i = 0; i < L0_SIZE; ++i) {
+    wheel.l0[i].next = wheel.l0[i].prev = &wheel.l0[i];
+  }
+  for (i = 0; i < NUM_LEVELS - 1; ++i) {
+    for (j = 0; j < LN_SIZE; ++j) {
+      wheel.ln[i][j].next = wheel.ln[i][j].prev = &wheel.ln[i][j];
+    }
+  }
+  wheel.jiffies = 0;
+  wheel.now = time(NULL);
+  pthread_mutex_init(&wheel.mutex, NULL);
+
+  if (pthread_create(&thread_id, NULL, WheelRun, NULL) != 0) {
+    FtpLog(LOG_ERROR, "unable to create timer thread");
+    return;
+  }
+  pthread_detach(thread_id);
+  wheel_started = 1;
+}
+
+static void *WheelRun(void *arg) {
+  struct timespec next;
+  time_t now;
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  for (;;) {
+    /* sleep to the next whole tick, so ticks don't drift */
+    next.tv_sec++;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                           &next, NULL) == EINTR) {
+    }
+
+    now = time(NULL);
+    __atomic_store_n(&wheel.now, now, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&wheel.mutex);
+    WheelTick();
+    pthread_mutex_unlock(&wheel.mutex);
+  }
+
+  return NULL;
+}
+
+/* run the timers due on the current tick, then move on */
+static void WheelTick(void) {
+  FtpTimer due, *t;
+  int index, rearm;
+
+  /* pull the next slot of each coarser level down when its turn comes */
+  index = wheel.jiffies & L0_MASK;
+  if ((index == 0) && (Cascade(0, (wheel.jiffies >> L0_BITS) & LN_MASK) == 0)) {
+    Cascade(1, (wheel.jiffies >> (L0_BITS + LN_BITS)) & LN_MASK);
+  }
+
+  /* detach the slot, so timers re-armed by callbacks land elsewhere */
+  if (wheel.l0[index].next == &wheel.l0[index]) {
+    wheel.jiffies++;
+    return;
+  }
+  due.next = wheel.l0[index].next;
+  due.prev = wheel.l0[index].prev;
+  due.next->prev = &due;
+  due.prev->next = &due;
+  wheel.l0[index].next = wheel.l0[index].prev = &wheel.l0[index];
+
+  wheel.jiffies++;
+  while (due.next != &due) {
+    t = due.next;
+    Unlink(t);
+    rearm = t->callback(t);
+    if (rearm > 0) {
+      t->expires = wheel.jiffies + rearm - 1;
+      AddTimer(t);
+    }
+  }
+}
+
+/* re-queue every timer of a coarse slot, returns the slot's index */
+static int Cascade(int level, int index) {
+  FtpTimer *head, *t;
+
+  head = &wheel.ln[level][index];
+  while (head->next != head) {
+    t = head->next;
+    Unlink(t);
+    AddTimer(t);
+  }
+
+  return index;
+}
+
+/* queue a timer on the slot matching how far away it is */
+static void AddTimer(FtpTimer *t) {
+  unsigned long delay;
+  FtpTimer *head;
+
+  if ((long)(t->expires - wheel.jiffies) < 0) {
+    t->expires = wheel.jiffies;
+  }
+  delay = t->expires - wheel.jiffies;
+  if (delay > MAX_DELAY) {
+    /* fires early; owners re-check their deadline in the callback */
+    delay = MAX_DELAY;
+    t->expires = wheel.jiffies + delay;
+  }
+
+  if (delay < L0_SIZE) {
+    head = &wheel.l0[t->expires & L0_MASK];
+  } else if (delay < (1UL << (L0_BITS + LN_BITS))) {
+    head = &wheel.ln[0][(t->expires >> L0_BITS) & LN_MASK];
+  } else {
+    head = &wheel.ln[1][(t->expires >> (L0_BITS + LN_BITS)) & LN_MASK];
+  }
+
+  t->prev = head->prev;
+  t->next = head;
+  head->prev->next = t;
+  head->prev = t;
+}
+
+static void Unlink(FtpTimer *t) {
+  if (t->next != NULL) {
+    t->next->prev = t->prev;
+    t->prev->next = t->next;
+    t->next = NULL;
+    t->prev = NULL;
+  }
+}
@@ -0,0 +1,26 @@
+#ifndef FTP_TIMER_H
+#define FTP_TIMER_H
+
+#include <time.h>
+
+/* a timer on the process-wide timer wheel, embedded in its owner */
+typedef struct FtpTimer {
+  /* links in the wheel slot the timer is queued on */
+  struct FtpTimer *next;
+  struct FtpTimer *prev;
+
+  /* wheel tick the timer is due on */
+  unsigned long expires;
+
+  /* called from the wheel thread when due; returns the number of */
+  /* seconds until it should be called again, or 0 to stop        */
+  int (*callback)(struct FtpTimer *t);
+} FtpTimer;
+
+int FtpTimerWheelStart(void);
+void FtpTimerInit(FtpTimer *t, int (*callback)(FtpTimer *t));
+void FtpTimerSet(FtpTimer *t, int seconds);
+void FtpTimerCancel(FtpTimer *t);
+time_t FtpTimerNow(void);
+
+#endif /* FTP_TIMER_H */
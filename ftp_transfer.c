@@ -0,0 +1,246 @@
+#define _GNU_SOURCE
+#include "ftp_transfer.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/sendfile.h>
+#include <assert.h>
+
+/* bounds on the bytes asked of the kernel in one call */
+static const size_t kMinChunk = 64 * 1024;
+static const size_t kMaxChunk = 16 * 1024 * 1024;
+
+/* how long a call should take: long enough that the call costs */
+/* little, short enough that progress is still noted often      */
+static const long kTargetUsec = 20 * 1000;
+
+/* ways of moving file data to a socket, best first */
+enum {
+  kSendfile,
+  kSplice,
+  kReadWrite
+};
+
+typedef struct {
+  int out_fd;
+  int in_fd;
+  int method;
+
+  /* a pipe for splice(), and the bytes waiting in it */
+  int pipe_fds[2];
+  size_t piped;
+
+  /* a buffer for read() and write() */
+  char *buf;
+} Transfer;
+
+static ssize_t Move(Transfer *t, off_t *offset, size_t n);
+static ssize_t SpliceChunk(Transfer *t, off_t *offset, size_t n);
+static ssize_t CopyChunk(Transfer *t, off_t *offset, size_t n);
+static size_t NextChunk(size_t chunk, ssize_t moved, long usec);
+static long ElapsedUsec(const struct timespec *start);
+
+/* sends len bytes of in_fd from offset to out_fd, adding them to */
+/* *sent and calling progress(arg, offset) with the offset reached */
+/* as they go; returns 0, with errno set, if there is an error or  */
+/* the file ends first                                             */
+int FtpTransferFile(int out_fd, int in_fd, off_t offset, off_t len,
+                    off_t *sent, void (*progress)(void *arg, off_t offset),
+                    void *arg) {
+  Transfer t;
+  struct timespec start;
+  size_t chunk;
+  ssize_t moved;
+  off_t end;
+  int ok;
+
+  assert(offset >= 0);
+  assert(len >= 0);
+
+  t.out_fd = out_fd;
+  t.in_fd = in_fd;
+  t.method = kSendfile;
+  t.pipe_fds[0] = t.pipe_fds[1] = -1;
+  t.piped = 0;
+  t.buf = NULL;
+
+  ok = 1;
+  chunk = kMinChunk;
+  end = offset + len;
+  while (offset < end) {
+    if ((off_t)chunk > end - offset) {
+      chunk = end - offset;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    moved = Move(&t, &offset, chunk);
+    if (moved == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ok = 0;
+      break;
+    }
+    if (moved == 0) {
+      /* the file got shorter */
+      errno = EIO;
+      ok = 0;
+      break;
+    }
+
+    /* a short count is progress like any other */
+    *sent += moved;
+    if (progress != NULL) {
+      progress(arg, offset);
+    }
+    chunk = NextChunk(chunk, moved, ElapsedUsec(&start));
+  }
+
+  if (t.pipe_fds[0] != -1) {
+    close(t.pipe_fds[0]);
+    close(t.pipe_fds[1]);
+  }
+  free(t.buf);
+  return ok;
+}
+
+/* moves up to n bytes from *offset, falling back to the next method */
+/* while the source or the socket doesn't support the current one    */
+static ssize_t Move(Transfer *t, off_t *offset, size_t n) {
+  ssize_t moved;
+
+  for (;;) {
+    switch (t->method) {
+      case kSendfile:
+        moved = sendfile(t->out_fd, t->in_fd, offset, n);
+        break;
+      case kSplice:
+        moved = SpliceChunk(t, offset, n);
+        break;
+      default:
+        return CopyChunk(t, offset, n);
+    }
+    if ((moved != -1) || ((errno != EINVAL) && (errno != ENOSYS)) ||
+        (t->piped > 0)) {
+      return moved;
+    }
+    t->method++;
+  }
+}
+
+/* moves up to n bytes through a pipe with splice(), never leaving any */
+/* in it on success                                                    */
+static ssize_t SpliceChunk(Transfer *t, off_t *offset, size_t n) {
+  ssize_t ret;
+  size_t moved;
+
+  if ((t->pipe_fds[0] == -1) && (pipe2(t->pipe_fds, O_CLOEXEC) != 0)) {
+    return -1;
+  }
+
+  if (t->piped == 0) {
+    ret = splice(t->in_fd, offset, t->pipe_fds[1], NULL, n,
+                 SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (ret <= 0) {
+      return ret;
+    }
+    t->piped = ret;
+  }
+
+  /* the file has moved on already, so what is in the pipe has to go; */
+  /* if it can't, what did go is reported, and the rest goes next call */
+  moved = 0;
+  while (t->piped > 0) {
+    ret = splice(t->pipe_fds[0], NULL, t->out_fd, NULL, t->piped,
+                 SPLICE_F_MOVE | SPLICE_F_MORE);
+    if ((ret == -1) && (errno == EINTR)) {
+      continue;
+    }
+    if (ret <= 0) {
+      if (ret == 0) {
+        errno = EPIPE;
+      }
+      return (moved > 0) ? (ssize_t)moved : -1;
+    }
+    t->piped -= ret;
+    moved += ret;
+  }
+
+  return moved;
+}
+
+/* the last resort: pread() then write() */
+static ssize_t CopyChunk(Transfer *t, off_t *offset, size_t n) {
+  ssize_t ret, amt_written, write_ret;
+
+  if (t->buf == NULL) {
+    t->buf = (char *)malloc(kMinChunk);
+    if (t->buf == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+  if (n > kMinChunk) {
+    n = kMinChunk;
+  }
+
+  ret = pread(t->in_fd, t->buf, n, *offset);
+  if (ret <= 0) {
+    return ret;
+  }
+  for (amt_written = 0; amt_written < ret; amt_written += write_ret) {
+    write_ret = write(t->out_fd, t->buf + amt_written, ret - amt_written);
+    if ((write_ret == -1) && (errno == EINTR)) {
+      write_ret = 0;
+      continue;
+    }
+    if (write_ret <= 0) {
+      if (write_ret == 0) {
+        errno = EPIPE;
+      }
+      break;
+    }
+  }
+
+  /* what the client has is never read and sent again */
+  *offset += amt_written;
+  if (amt_written == 0) {
+    return -1;
+  }
+
+  return amt_written;
+}
+
+/* the chunk that moves at the rate just seen for about kTargetUsec, */
+/* growing or shrinking at most twofold a step                       */
+static size_t NextChunk(size_t chunk, ssize_t moved, long usec) {
+  double rate;
+  size_t next;
+
+  if (usec <= 0) {
+    usec = 1;
+  }
+  rate = (double)moved / usec;
+  next = (rate * kTargetUsec > kMaxChunk) ? kMaxChunk : rate * kTargetUsec;
+  if (next > chunk * 2) {
+    next = chunk * 2;
+  } else if (next < chunk / 2) {
+    next = chunk / 2;
+  }
+  if (next < kMinChunk) {
+    next = kMinChunk;
+  } else if (next > kMaxChunk) {
+    next = kMaxChunk;
+  }
+
+  return next;
+}
+
+static long ElapsedUsec(const struct timespec *start) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000L +
+         (now.tv_nsec - start->tv_nsec) / 1000;
+}
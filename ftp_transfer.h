@@ -0,0 +1,10 @@
+#ifndef FTP_TRANSFER_H
+#define FTP_TRANSFER_H
+
+#include <sys/types.h>
+
+int FtpTransferFile(int out_fd, int in_fd, off_t offset, off_t len,
+                    off_t *sent, void (*progress)(void *arg, off_t offset),
+                    void *arg);
+
+#endif /* FTP_TRANSFER_H */
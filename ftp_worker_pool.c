@@ -0,0 +1,136 @@
+#include "ftp_worker_pool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "ftp_log.h"
+
+static void *WorkerRun(FtpWorkerPool *p);
+static int QueueTake(FtpWorkerPool *p, void **item);
+
+/* create the queue and start the workers */
+int FtpWorkerPoolInit(FtpWorkerPool *p, int num_workers, int queue_depth,
+                      void (*handler)(void *item)) {
+  int i;
+
+  assert(p != NULL);
+  assert(num_workers > 0);
+  /* a single cell can't tell "filled" from "free for the next lap" */
+  assert(queue_depth > 1);
+  assert(handler != NULL);
+
+  p->slots = (FtpWorkerSlot *)malloc(sizeof(FtpWorkerSlot) * queue_depth);
+  p->workers = (pthread_t *)malloc(sizeof(pthread_t) * num_workers);
+  if ((p->slots == NULL) || (p->workers == NULL)) {
+    FtpLog(LOG_ERROR, "out of memory creating worker pool");
+    free(p->slots);
+    free(p->workers);
+    return 0;
+  }
+
+  /* cell i is free for the producer that gets position i */
+  for (i = 0; i < queue_depth; ++i) {
+    p->slots[i].sequence = i;
+    p->slots[i].item = NULL;
+  }
+  p->queue_depth = queue_depth;
+  p->enqueue_pos = 0;
+  p->dequeue_pos = 0;
+  sem_init(&p->items, 0, 0);
+  p->handler = handler;
+
+  for (i = 0; i < num_workers; ++i) {
+    if (pthread_create(&p->workers[i], NULL,
+                       (void *(*)(void *))WorkerRun, p) != 0) {
+      FtpLog(LOG_ERROR, "unable to create worker thread %d", i);
+      return 0;
+    }
+  }
+  p->num_workers = num_workers;
+
+  return 1;
+}
+
+/* queue an item for the workers, returns 0 if the queue is full */
+int FtpWorkerPoolSubmit(FtpWorkerPool *p, void *item) {
+  FtpWorkerSlot *slot;
+  unsigned long pos, seq;
+  long diff;
+
+  pos = __atomic_load_n(&p->enqueue_pos, __ATOMIC_RELAXED);
+  for (;;) {
+    slot = &p->slots[pos % p->queue_depth];
+    seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    diff = (long)(seq - pos);
+    if (diff == 0) {
+      /* cell is free, try to claim the position */
+      if (__atomic_compare_exchange_n(&p->enqueue_pos, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      /* cell still holds an item from a full lap ago */
+      return 0;
+    } else {
+      pos = __atomic_load_n(&p->enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+
+  slot->item = item;
+  __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+  sem_post(&p->items);
+
+  return 1;
+}
+
+static void *WorkerRun(FtpWorkerPool *p) {
+  void *item;
+
+  for (;;) {
+    while (sem_wait(&p->items) != 0) {
+      assert(errno == EINTR);
+    }
+
+    /* an item is ready, but the cell at the head may still be */
+    /* being filled by a slower producer than the one who woke us */
+    while (!QueueTake(p, &item)) {
+      sched_yield();
+    }
+
+    p->handler(item);
+  }
+
+  return NULL;
+}
+
+static int QueueTake(FtpWorkerPool *p, void **item) {
+  FtpWorkerSlot *slot;
+  unsigned long pos, seq;
+  long diff;
+
+  pos = __atomic_load_n(&p->dequeue_pos, __ATOMIC_RELAXED);
+  for (;;) {
+    slot = &p->slots[pos % p->queue_depth];
+    seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    diff = (long)(seq - (pos + 1));
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&p->dequeue_pos, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      /* nothing published at the head yet */
+      return 0;
+    } else {
+      pos = __atomic_load_n(&p->dequeue_pos, __ATOMIC_RELAXED);
+    }
+  }
+
+  *item = slot->item;
+  /* free the cell for the producer one lap ahead */
+  __atomic_store_n(&slot->sequence, pos + p->queue_depth, __ATOMIC_RELEASE);
+
+  return 1;
+}
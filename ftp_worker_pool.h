@@ -0,0 +1,40 @@
+#ifndef FTP_WORKER_POOL_H
+#define FTP_WORKER_POOL_H
+
+#include <pthread.h>
+#include <semaphore.h>
+
+/* one cell of the hand-off queue */
+typedef struct {
+  /* tells producers and consumers whose turn the cell is */
+  unsigned long sequence;
+  void *item;
+} FtpWorkerSlot;
+
+/* pre-spawned threads fed from a bounded lock-free MPMC queue */
+typedef struct FtpWorkerPool {
+  /* queue cells and their number */
+  FtpWorkerSlot *slots;
+  unsigned long queue_depth;
+
+  /* next positions to fill and to take, kept on separate cache lines */
+  unsigned long enqueue_pos;
+  char pad[64 - sizeof(unsigned long)];
+  unsigned long dequeue_pos;
+
+  /* number of items ready to take, idle workers sleep on it */
+  sem_t items;
+
+  /* called by a worker with each item it takes */
+  void (*handler)(void *item);
+
+  /* the workers themselves */
+  int num_workers;
+  pthread_t *workers;
+} FtpWorkerPool;
+
+int FtpWorkerPoolInit(FtpWorkerPool *p, int num_workers, int queue_depth,
+                      void (*handler)(void *item));
+int FtpWorkerPoolSubmit(FtpWorkerPool *p, void *item);
+
+#endif /* FTP_WORKER_POOL_H */
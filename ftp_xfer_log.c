@@ -0,0 +1,525 @@
+#include "ftp_xfer_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <assert.h>
+#include "ftp_log.h"
+
+/* bytes of records gathered before they are written */
+#define XFER_BATCH_SIZE (64 * 1024)
+
+/* ids of the names already written to the current file, a power of 2 */
+#define XFER_NAMES_SEEN 4096
+
+/* longest name recorded; longer ones are cut short */
+#define XFER_NAME_MAX PATH_MAX
+
+/* seconds a record may wait in the batch */
+static const int kFlushInterval = 1;
+
+/* a rotating file of transfer records, written a batch at a time by */
+/* its own thread, or by whichever session fills the batch           */
+static struct {
+  int enabled;
+
+  /* the file, where it lives, and when it is rotated (0 for never): */
+  /* name becomes name.1, name.1 becomes name.2, up to name.keep     */
+  int fd;
+  int dir_fd;
+  char name[NAME_MAX + 1];
+  long bytes;
+  long max_bytes;
+  int keep;
+
+  /* records not yet written */
+  char batch[XFER_BATCH_SIZE];
+  int batch_len;
+
+  /* names the file has, so each is written to it once; the set is */
+  /* emptied when over 3/4 full, which costs only repeated names    */
+  uint64_t seen[XFER_NAMES_SEEN];
+  int num_seen;
+
+  pthread_t flusher;
+  int stopping;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+} xfer_log;
+
+static int OpenLog(const char *name, int flags);
+static void UseLog(int fd);
+static void RotateLog(void);
+static void FlushBatch(void);
+static void *FlushRun(void *arg);
+static uint64_t AddName(const char *name);
+static void Append(uint32_t type, const void *a, int a_len,
+                   const void *b, int b_len);
+static uint64_t HashName(const char *name, int len);
+
+/* record transfers to name in dir_fd (which must be writable by the */
+/* server's user for the file to be created and rotated)             */
+int FtpXferLogInit(int dir_fd, const char *name, long max_bytes, int keep) {
+  assert(dir_fd != -1);
+  assert(name != NULL);
+  assert(max_bytes >= 0);
+  assert(keep >= 0);
+
+  if (strlen(name) + 16 > sizeof(xfer_log.name)) {
+    FtpLog(LOG_ERROR, "transfer log name too long");
+    return 0;
+  }
+  strcpy(xfer_log.name, name);
+  xfer_log.dir_fd = dir_fd;
+  xfer_log.max_bytes = max_bytes;
+  xfer_log.keep = keep;
+  xfer_log.batch_len = 0;
+  xfer_log.stopping = 0;
+  pthread_mutex_init(&xfer_log.mutex, NULL);
+  pthread_cond_init(&xfer_log.cond, NULL);
+
+  xfer_log.fd = OpenLog(xfer_log.name, 0);
+  if (xfer_log.fd == -1) {
+    return 0;
+  }
+  UseLog(xfer_log.fd);
+  if (pthread_create(&xfer_log.flusher, NULL, FlushRun, NULL) != 0) {
+    FtpLog(LOG_ERROR, "error starting transfer log thread");
+    close(xfer_log.fd);
+    return 0;
+  }
+  xfer_log.enabled = 1;
+
+  return 1;
+}
+
+int FtpXferLogEnabled(void) {
+  return xfer_log.enabled;
+}
+
+/* add a transfer of path, by user ("" if not known), filling in e's */
+/* ids; it is written within kFlushInterval seconds                  */
+void FtpXferLogRecord(FtpXferEvent *e, const char *path, const char *user) {
+  int need;
+
+  assert(xfer_log.enabled);
+  assert(e != NULL);
+  assert(path != NULL);
+  assert(user != NULL);
+
+  memset(e->pad, 0, sizeof(e->pad));
+  need = 3 * sizeof(FtpXferHeader) + 2 * sizeof(uint64_t) + sizeof(*e) +
+         2 * XFER_NAME_MAX;
+
+  pthread_mutex_lock(&xfer_log.mutex);
+
+  /* the event must go to the same file as its names, so the batch */
+  /* is written (and the file perhaps rotated) before, not between */
+  if (xfer_log.batch_len + need > XFER_BATCH_SIZE) {
+    FlushBatch();
+  }
+  e->path_id = AddName(path);
+  e->user_id = AddName(user);
+  Append(XFER_RECORD_EVENT, e, sizeof(*e), NULL, 0);
+  pthread_mutex_unlock(&xfer_log.mutex);
+}
+
+/* write what is left and close the file */
+void FtpXferLogShutdown(void) {
+  if (!xfer_log.enabled) {
+    return;
+  }
+
+  pthread_mutex_lock(&xfer_log.mutex);
+  xfer_log.stopping = 1;
+  pthread_cond_signal(&xfer_log.cond);
+  pthread_mutex_unlock(&xfer_log.mutex);
+  pthread_join(xfer_log.flusher, NULL);
+
+  close(xfer_log.fd);
+  xfer_log.enabled = 0;
+}
+
+/* opens (or creates) a log file, starting it with the magic if it is */
+/* new; returns the descriptor, or -1                                  */
+static int OpenLog(const char *name, int flags) {
+  struct stat st;
+  int fd;
+
+  fd = openat(xfer_log.dir_fd, name,
+              O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | flags, 0644);
+  if (fd == -1) {
+    FtpLog(LOG_ERROR, "error opening transfer log %s; %s", name,
+           strerror(errno));
+    return -1;
+  }
+  if ((fstat(fd, &st) == 0) && (st.st_size == 0) &&
+      (write(fd, XFER_LOG_MAGIC, XFER_LOG_MAGIC_LEN) != XFER_LOG_MAGIC_LEN)) {
+    FtpLog(LOG_ERROR, "error writing transfer log %s; %s", name,
+           strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/* records go to fd from now on, and none of its names are known yet */
+static void UseLog(int fd) {
+  struct stat st;
+
+  xfer_log.fd = fd;
+  if (fstat(fd, &st) != 0) {
+    st.st_size = XFER_LOG_MAGIC_LEN;
+  }
+  xfer_log.bytes = st.st_size;
+  xfer_log.num_seen = 0;
+  memset(xfer_log.seen, 0, sizeof(xfer_log.seen));
+}
+
+/* shifts name.N up to name.N+1, name to name.1, and starts a new name; */
+/* the new file is made first, under a name of its own, so a failure    */
+/* leaves the current file where it was, to be kept on with until it    */
+/* has grown by another max_bytes                                       */
+static void RotateLog(void) {
+  char from[NAME_MAX + 1], to[NAME_MAX + 1], next[NAME_MAX + 1];
+  int fd, i;
+
+  snprintf(next, sizeof(next), "%s.new", xfer_log.name);
+  fd = OpenLog(next, O_TRUNC);
+  if (fd == -1) {
+    xfer_log.bytes = 0;
+    return;
+  }
+
+  for (i = xfer_log.keep - 1; i >= 0; --i) {
+    if (i == 0) {
+      strcpy(from, xfer_log.name);
+    } else {
+      snprintf(from, sizeof(from), "%s.%d", xfer_log.name, i);
+    }
+    snprintf(to, sizeof(to), "%s.%d", xfer_log.name, i + 1);
+    if ((renameat(xfer_log.dir_fd, from, xfer_log.dir_fd, to) != 0) &&
+        (errno != ENOENT)) {
+      FtpLog(LOG_WARNING, "error rotating transfer log %s; %s", from,
+             strerror(errno));
+      close(fd);
+      unlinkat(xfer_log.dir_fd, next, 0);
+      xfer_log.bytes = 0;
+      return;
+    }
+  }
+
+  /* replacing name drops the current file if none are kept; should */
+  /* it fail, the current file goes back to being name              */
+  if (renameat(xfer_log.dir_fd, next, xfer_log.dir_fd, xfer_log.name) != 0) {
+    FtpLog(LOG_WARNING, "error rotating transfer log %s; %s", next,
+           strerror(errno));
+    close(fd);
+    unlinkat(xfer_log.dir_fd, next, 0);
+    if (xfer_log.keep > 0) {
+      snprintf(from, sizeof(from), "%s.1", xfer_log.name);
+      renameat(xfer_log.dir_fd, from, xfer_log.dir_fd, xfer_log.name);
+    }
+    xfer_log.bytes = 0;
+    return;
+  }
+  close(xfer_log.fd);
+  UseLog(fd);
+}
+
+/* writes the batch out; called with the mutex held */
+static void FlushBatch(void) {
+  int amt_written, write_ret;
+
+  for (amt_written = 0; amt_written < xfer_log.batch_len;
+       amt_written += write_ret) {
+    write_ret = write(xfer_log.fd, xfer_log.batch + amt_written,
+                      xfer_log.batch_len - amt_written);
+    if (write_ret <= 0) {
+      FtpLog(LOG_ERROR, "error writing transfer log; %s, %d bytes lost",
+             strerror(errno), xfer_log.batch_len - amt_written);
+      break;
+    }
+  }
+  xfer_log.bytes += amt_written;
+  xfer_log.batch_len = 0;
+
+  if ((xfer_log.max_bytes > 0) && (xfer_log.bytes >= xfer_log.max_bytes)) {
+    RotateLog();
+  }
+}
+
+static void *FlushRun(void *arg) {
+  struct timespec wake;
+
+  (void)arg;
+
+  pthread_mutex_lock(&xfer_log.mutex);
+  while (!xfer_log.stopping) {
+    clock_gettime(CLOCK_REALTIME, &wake);
+    wake.tv_sec += kFlushInterval;
+    pthread_cond_timedwait(&xfer_log.cond, &xfer_log.mutex, &wake);
+    if (xfer_log.batch_len > 0) {
+      FlushBatch();
+    }
+  }
+
+  /* what came in since, or before this thread got going */
+  if (xfer_log.batch_len > 0) {
+    FlushBatch();
+  }
+  pthread_mutex_unlock(&xfer_log.mutex);
+
+  return NULL;
+}
+
+/* the id of name, appending a record naming it if the current file */
+/* may not have one yet; called with the mutex held                 */
+static uint64_t AddName(const char *name) {
+  uint64_t id;
+  int len, i;
+
+  len = strlen(name);
+  if (len == 0) {
+    return 0;
+  }
+  if (len > XFER_NAME_MAX) {
+    len = XFER_NAME_MAX;
+  }
+  id = HashName(name, len);
+
+  for (i = id & (XFER_NAMES_SEEN - 1); xfer_log.seen[i] != 0;
+       i = (i + 1) & (XFER_NAMES_SEEN - 1)) {
+    if (xfer_log.seen[i] == id) {
+      return id;
+    }
+  }
+
+  Append(XFER_RECORD_NAME, &id, sizeof(id), name, len);
+
+  if (xfer_log.num_seen >= XFER_NAMES_SEEN / 4 * 3) {
+    memset(xfer_log.seen, 0, sizeof(xfer_log.seen));
+    xfer_log.num_seen = 0;
+  }
+  for (i = id & (XFER_NAMES_SEEN - 1); xfer_log.seen[i] != 0;
+       i = (i + 1) & (XFER_NAMES_SEEN - 1)) {
+  }
+  xfer_log.seen[i] = id;
+  xfer_log.num_seen++;
+
+  return id;
+}
+
+/* adds a record of a followed by b to the batch, which has room for */
+/* it; called with the mutex held                                    */
+static void Append(uint32_t type, const void *a, int a_len,
+                   const void *b, int b_len) {
+  FtpXferHeader header;
+  char *p;
+
+  assert(xfer_log.batch_len + sizeof(header) + a_len + b_len <=
+         XFER_BATCH_SIZE);
+
+  header.type = type;
+  header.len = a_len + b_len;
+  p = xfer_log.batch + xfer_log.batch_len;
+  memcpy(p, &header, sizeof(header));
+  memcpy(p + sizeof(header), a, a_len);
+  if (b_len > 0) {
+    memcpy(p + sizeof(header) + a_len, b, b_len);
+  }
+  xfer_log.batch_len += sizeof(header) + a_len + b_len;
+}
+
+/* 64-bit FNV-1a, never 0 */
+static uint64_t HashName(const char *name, int len) {
+  uint64_t h;
+  int i;
+
+  h = 14695981039346656037ULL;
+  for (i = 0; i < len; ++i) {
+    h ^= (unsigned char)name[i];
+    h *= 1099511628211ULL;
+  }
+
+  return (h != 0) ? h : 1;
+}
+
+#ifdef XFER_LOG_CONVERTER
+/* prints transfer log files (or standard input) as wu-ftpd xferlog */
+/* lines, e.g. ftpxferlog xfer.log.2 xfer.log.1 xfer.log > xferlog  */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+/* names read so far, by id; a power of 2 that grows */
+typedef struct {
+  uint64_t id;
+  char *name;
+} NameSlot;
+
+static NameSlot *names;
+static unsigned long names_size, names_used;
+
+static const char *LookupName(uint64_t id) {
+  unsigned long i;
+
+  if ((id == 0) || (names_size == 0)) {
+    return NULL;
+  }
+  for (i = id & (names_size - 1); names[i].id != 0;
+       i = (i + 1) & (names_size - 1)) {
+    if (names[i].id == id) {
+      return names[i].name;
+    }
+  }
+
+  return NULL;
+}
+
+static int StoreName(uint64_t id, char *name) {
+  NameSlot *old;
+  unsigned long old_size, i, j;
+
+  if (names_used >= names_size / 2) {
+    old = names;
+    old_size = names_size;
+    names_size = (names_size > 0) ? names_size * 2 : 1024;
+    names = (NameSlot *)calloc(names_size, sizeof(NameSlot));
+    if (names == NULL) {
+      return 0;
+    }
+    for (j = 0; j < old_size; ++j) {
+      if (old[j].id != 0) {
+        for (i = old[j].id & (names_size - 1); names[i].id != 0;
+             i = (i + 1) & (names_size - 1)) {
+        }
+        names[i] = old[j];
+      }
+    }
+    free(old);
+  }
+
+  for (i = id & (names_size - 1); names[i].id != 0;
+       i = (i + 1) & (names_size - 1)) {
+    if (names[i].id == id) {
+      free(names[i].name);
+      names[i].name = name;
+      return 1;
+    }
+  }
+  names[i].id = id;
+  names[i].name = name;
+  names_used++;
+
+  return 1;
+}
+
+/* current-time transfer-time remote-host file-size filename     */
+/* transfer-type special-action-flag direction access-mode       */
+/* username service-name authentication-method authenticated-user-id */
+/* completion-status                                             */
+static void PrintEvent(const FtpXferEvent *e) {
+  char date[32], host[INET_ADDRSTRLEN];
+  const char *path, *user, *c;
+  struct in_addr addr;
+  time_t t;
+
+  t = (time_t)e->end_time;
+  strftime(date, sizeof(date), "%a %b %e %H:%M:%S %Y", localtime(&t));
+  addr.s_addr = e->client;
+  inet_ntop(AF_INET, &addr, host, sizeof(host));
+  path = LookupName(e->path_id);
+  user = LookupName(e->user_id);
+
+  printf("%s %u %s %llu ", date, (e->duration_ms + 500) / 1000, host,
+         (unsigned long long)e->bytes);
+
+  /* xferlog is split on spaces, so none may be in a path */
+  if (path == NULL) {
+    path = "?";
+  }
+  for (c = path; *c != '\0'; ++c) {
+    putchar((*c == ' ') ? '_' : *c);
+  }
+
+  printf(" %c _ %c a %s ftp 0 * %c\n", e->mode, e->direction,
+         (user != NULL) ? user : "*", e->result);
+}
+
+static int ConvertFile(FILE *in, const char *file_name) {
+  char magic[XFER_LOG_MAGIC_LEN];
+  FtpXferHeader header;
+  FtpXferEvent event;
+  uint64_t id;
+  char *name;
+
+  if ((fread(magic, 1, sizeof(magic), in) != sizeof(magic)) ||
+      (memcmp(magic, XFER_LOG_MAGIC, sizeof(magic)) != 0)) {
+    fprintf(stderr, "%s: not a transfer log\n", file_name);
+    return 0;
+  }
+
+  while (fread(&header, sizeof(header), 1, in) == 1) {
+    if ((header.type == XFER_RECORD_EVENT) &&
+        (header.len == sizeof(event))) {
+      if (fread(&event, sizeof(event), 1, in) != 1) {
+        break;
+      }
+      PrintEvent(&event);
+    } else if ((header.type == XFER_RECORD_NAME) &&
+               (header.len > sizeof(id)) &&
+               (header.len <= sizeof(id) + XFER_NAME_MAX)) {
+      name = (char *)malloc(header.len - sizeof(id) + 1);
+      if ((name == NULL) || (fread(&id, sizeof(id), 1, in) != 1) ||
+          (fread(name, header.len - sizeof(id), 1, in) != 1)) {
+        free(name);
+        break;
+      }
+      name[header.len - sizeof(id)] = '\0';
+      if (!StoreName(id, name)) {
+        fprintf(stderr, "%s: out of memory\n", file_name);
+        return 0;
+      }
+    } else {
+      fprintf(stderr, "%s: bad record\n", file_name);
+      return 0;
+    }
+  }
+  if (ferror(in)) {
+    fprintf(stderr, "%s: %s\n", file_name, strerror(errno));
+    return 0;
+  }
+
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  FILE *in;
+  int i, ok;
+
+  if (argc < 2) {
+    return !ConvertFile(stdin, "-");
+  }
+
+  ok = 1;
+  for (i = 1; i < argc; ++i) {
+    in = fopen(argv[i], "rb");
+    if (in == NULL) {
+      fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+      ok = 0;
+      continue;
+    }
+    ok = ConvertFile(in, argv[i]) && ok;
+    fclose(in);
+  }
+
+  return !ok;
+}
+#endif /* XFER_LOG_CONVERTER */
@@ -0,0 +1,46 @@
+#ifndef FTP_XFER_LOG_H
+#define FTP_XFER_LOG_H
+
+#include <stdint.h>
+
+/* what each transfer log file starts with */
+#define XFER_LOG_MAGIC "FTPXFER1"
+#define XFER_LOG_MAGIC_LEN 8
+
+/* kinds of record */
+#define XFER_RECORD_NAME   1
+#define XFER_RECORD_EVENT  2
+
+/* how a transfer ended */
+#define XFER_COMPLETE    'c'
+#define XFER_INCOMPLETE  'i'
+
+/* every record starts with this, and is followed by len bytes: an */
+/* FtpXferEvent, or a name's 64-bit id and then the name itself     */
+typedef struct {
+  uint32_t type;
+  uint32_t len;
+} FtpXferHeader;
+
+/* one transfer; paths and user names are given as the ids of name */
+/* records written to the same file before it (0 for none)         */
+typedef struct {
+  int64_t end_time;      /* seconds since the epoch */
+  uint64_t path_id;
+  uint64_t user_id;
+  uint64_t bytes;
+  uint64_t offset;       /* where in the file it started */
+  uint32_t duration_ms;
+  uint32_t client;       /* IPv4 address, in network order */
+  uint8_t direction;     /* 'o' sent to the client, 'i' received */
+  uint8_t mode;          /* 'a' ascii, 'b' binary */
+  uint8_t result;        /* XFER_COMPLETE or XFER_INCOMPLETE */
+  uint8_t pad[5];
+} FtpXferEvent;
+
+int FtpXferLogInit(int dir_fd, const char *name, long max_bytes, int keep);
+int FtpXferLogEnabled(void);
+void FtpXferLogRecord(FtpXferEvent *e, const char *path, const char *user);
+void FtpXferLogShutdown(void);
+
+#endif /* FTP_XFER_LOG_H */
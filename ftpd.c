@@ -4,34 +4,93 @@
 #include <string.h>
 #include <pwd.h>
 #include <sys/types.h>
+#include <sys/resource.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <errno.h>
 
 #include "ftp_listener.h"
 #include "ftp_log.h"
+#include "ftp_text_cache.h"
 
 static const char *exe_name = "ftpd";
 
+/* settings taken from the command line */
+typedef struct {
+  int port;
+  char *address;
+  int max_clients;
+  int shards;
+  int event_loops;
+  int workers;
+  int worker_queue_depth;
+  int idle_timeout;
+  int transfer_timeout;
+  int list_cache_size;
+  int list_sort_limit;
+  int list_stream;
+  char *stat_engine;
+  char *log_overflow;
+  int log_level;
+  int text_cache_size;
+  char *text_cache_policy;
+  char *xfer_log;
+  int xfer_log_size;
+  int read_ahead;
+  int drop_behind_size;
+  int file_cache_size;
+  int file_cache_max_file;
+  int pasv_port_low;
+  int pasv_port_high;
+  int pasv_pool_size;
+  char *user_name;
+  char *dir_path;
+} Options;
+
 static void PrintUsage(const char *error);
-static int GetOptions(int argc, char *argv[], int *port,
-                       char **address, int *max_clients,
-                       char **usr_name, char **dir_path);
+static int GetOptions(int argc, char *argv[], Options *opt);
 
 int main(int argc, char *argv[]) {
-  int i = 0, port = 0, max_clients = 0;
-  char *user_name, *dir_path, *address;
-  char temp_buf[256];
+  Options opt;
   struct passwd *user_info;
   int sig;
   sigset_t term_signal;
+  struct rlimit fd_limit;
+  int list_spill_fd;
+  int text_cache_fd;
+  int xfer_log_dir_fd;
+  char *xfer_log_name;
   FtpListener ftp_listener;
 
   /* Sets default option */
-  port = FTP_PORT;
-  user_name = NULL;
-  dir_path = NULL;
-  address = FTP_ADDRESS;
-  max_clients = MAX_CLIENTS;
+  opt.port = FTP_PORT;
+  opt.user_name = NULL;
+  opt.dir_path = NULL;
+  opt.address = FTP_ADDRESS;
+  opt.max_clients = MAX_CLIENTS;
+  opt.shards = LISTENER_SHARDS;
+  opt.event_loops = EVENT_LOOPS;
+  opt.workers = WORKER_THREADS;
+  opt.worker_queue_depth = WORKER_QUEUE_DEPTH;
+  opt.idle_timeout = INACTIVITY_TIMEOUT;
+  opt.transfer_timeout = TRANSFER_TIMEOUT;
+  opt.list_cache_size = LIST_CACHE_SIZE;
+  opt.list_sort_limit = LIST_SORT_LIMIT;
+  opt.list_stream = 0;
+  opt.stat_engine = STAT_ENGINE;
+  opt.log_overflow = LOG_OVERFLOW;
+  opt.log_level = FtpLogParseLevel(LOG_LEVEL);
+  opt.text_cache_size = TEXT_CACHE_SIZE;
+  opt.text_cache_policy = TEXT_CACHE_POLICY;
+  opt.xfer_log = NULL;
+  opt.xfer_log_size = XFER_LOG_SIZE;
+  opt.read_ahead = READ_AHEAD;
+  opt.drop_behind_size = DROP_BEHIND_SIZE;
+  opt.file_cache_size = FILE_CACHE_SIZE;
+  opt.file_cache_max_file = FILE_CACHE_MAX_FILE;
+  opt.pasv_port_low = PASV_PORT_LOW;
+  opt.pasv_port_high = PASV_PORT_HIGH;
+  opt.pasv_pool_size = PASV_POOL_SIZE;
 
   /* grab our executable name */
   if (argc > 0) {
@@ -45,24 +104,74 @@ int main(int argc, char *argv[]) {
   }
 
   /* Gets user's args */
-  if (GetOptions(argc, argv, &port, &address,
-                 &max_clients, &user_name, &dir_path) == 0) {
+  if (GetOptions(argc, argv, &opt) == 0) {
     FtpLog(LOG_ERROR, "ftp option parse error.");
   }
 
+  /* log lines are written by their own thread from here on */
+  FtpLogSetLevel(opt.log_level);
+  if (!FtpLogStart((strcmp(opt.log_overflow, "block") == 0) ?
+                   LOG_OVERFLOW_BLOCK : LOG_OVERFLOW_DROP)) {
+    FtpLog(LOG_WARNING, "error starting log writer, logging directly");
+  }
+
   /* Checks the required parameters */
-  if (user_name == NULL || dir_path == NULL) {
+  if (opt.user_name == NULL || opt.dir_path == NULL) {
     PrintUsage("missing user and/or directory name");
     exit(1);
   }
-  user_info = getpwnam(user_name);
+  user_info = getpwnam(opt.user_name);
   if (user_info == NULL) {
     FtpLog(LOG_ERROR, "%s: invalid user name", exe_name);
     exit(1);
   }
 
+  /* big listings are sorted through files outside the root, so the */
+  /* directory for them is opened before leaving it                 */
+  list_spill_fd = -1;
+  if ((opt.list_sort_limit > 0) && !opt.list_stream) {
+    list_spill_fd = open(LIST_SPILL_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (list_spill_fd == -1) {
+      FtpLog(LOG_WARNING, "error opening %s, big listings will be sorted in "
+             "memory; %s", LIST_SPILL_DIR, strerror(errno));
+    }
+  }
+
+  /* and that for text files converted for ASCII transfers */
+  text_cache_fd = -1;
+  if (opt.text_cache_size > 0) {
+    text_cache_fd = open(TEXT_CACHE_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (text_cache_fd == -1) {
+      FtpLog(LOG_WARNING, "error opening %s, text files will be converted "
+             "for every ASCII transfer; %s", TEXT_CACHE_DIR, strerror(errno));
+    }
+  }
+
+  /* so is the directory of the transfer log */
+  xfer_log_dir_fd = -1;
+  xfer_log_name = NULL;
+  if (opt.xfer_log != NULL) {
+    xfer_log_name = strrchr(opt.xfer_log, '/');
+    if (xfer_log_name == NULL) {
+      xfer_log_name = opt.xfer_log;
+      xfer_log_dir_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    } else if (xfer_log_name == opt.xfer_log) {
+      xfer_log_name++;
+      xfer_log_dir_fd = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    } else {
+      *xfer_log_name++ = '\0';
+      xfer_log_dir_fd = open(opt.xfer_log,
+                             O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if ((xfer_log_dir_fd == -1) || (*xfer_log_name == '\0')) {
+      FtpLog(LOG_ERROR, "error opening transfer log directory; %s",
+             strerror(errno));
+      exit(1);
+    }
+  }
+
   /* change to root directory */
-  if (chroot(dir_path) != 0) {
+  if (chroot(opt.dir_path) != 0) {
     FtpLog(LOG_ERROR, "chroot directory error", strerror(errno));
     exit(1);
   }
@@ -74,12 +183,48 @@ int main(int argc, char *argv[]) {
   /* Avoids SIGPIPE on socket activity */
   signal(SIGPIPE, SIG_IGN);
 
+  /* every client needs at least one descriptor, so allow as many as */
+  /* we may; nothing limits them to FD_SETSIZE any more              */
+  if ((getrlimit(RLIMIT_NOFILE, &fd_limit) == 0) &&
+      (fd_limit.rlim_cur < fd_limit.rlim_max)) {
+    fd_limit.rlim_cur = fd_limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &fd_limit) != 0) {
+      FtpLog(LOG_WARNING, "error raising descriptor limit; %s", strerror(errno));
+    }
+  }
+
   /* Creates the main listener */
-  if (!FtpListenerInit(&ftp_listener, address, port,
-                       max_clients, INACTIVITY_TIMEOUT)) {
+  if (!FtpListenerInit(&ftp_listener, opt.address, opt.port,
+                       opt.max_clients, opt.idle_timeout, opt.shards)) {
     FtpLog(LOG_ERROR, "ftp listner init error.");
     exit(1);
   }
+  ftp_listener.num_event_loops = opt.event_loops;
+  ftp_listener.num_workers = opt.workers;
+  ftp_listener.worker_queue_depth = opt.worker_queue_depth;
+  ftp_listener.transfer_timeout = opt.transfer_timeout;
+  ftp_listener.list_cache_size = opt.list_cache_size;
+  ftp_listener.list_sort_limit = opt.list_sort_limit;
+  ftp_listener.list_stream = opt.list_stream;
+  ftp_listener.list_spill_fd = list_spill_fd;
+  ftp_listener.stat_engine = opt.stat_engine;
+  ftp_listener.stat_threads = STAT_THREADS;
+  ftp_listener.text_cache_size = opt.text_cache_size;
+  ftp_listener.text_cache_policy =
+    (strcmp(opt.text_cache_policy, "lfu") == 0) ? TEXT_CACHE_LFU :
+                                                  TEXT_CACHE_LRU;
+  ftp_listener.text_cache_fd = text_cache_fd;
+  ftp_listener.xfer_log_dir_fd = xfer_log_dir_fd;
+  ftp_listener.xfer_log_name = xfer_log_name;
+  ftp_listener.xfer_log_size = (long)opt.xfer_log_size << 20;
+  ftp_listener.xfer_log_keep = XFER_LOG_KEEP;
+  ftp_listener.read_ahead = opt.read_ahead;
+  ftp_listener.drop_behind_size = opt.drop_behind_size;
+  ftp_listener.file_cache_size = opt.file_cache_size;
+  ftp_listener.file_cache_max_file = opt.file_cache_max_file;
+  ftp_listener.pasv_port_low = opt.pasv_port_low;
+  ftp_listener.pasv_port_high = opt.pasv_port_high;
+  ftp_listener.pasv_pool_size = opt.pasv_pool_size;
 
   FtpLog(LOG_INFO, "ftp listener init success.");
 
@@ -96,6 +241,14 @@ int main(int argc, char *argv[]) {
 
   FtpLog(LOG_INFO, "ftp running as gid: %d, uid: %d", user_info->pw_gid, user_info->pw_uid);
 
+  /* block the signals we wait for, before any thread can inherit them */
+  sigemptyset(&term_signal);
+  sigaddset(&term_signal, SIGTERM);
+  sigaddset(&term_signal, SIGINT);
+  sigaddset(&term_signal, SIGUSR1);
+  sigaddset(&term_signal, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &term_signal, NULL);
+
   /* Start the listener */
   if (FtpListenerStart(&ftp_listener) == 0) {
     FtpLog(LOG_ERROR, "ftp listener start error.");
@@ -104,12 +257,20 @@ int main(int argc, char *argv[]) {
 
   FtpLog(LOG_INFO, "ftp server listening...");
 
-  /* wait for a SIGTERM and exit gracefully */
-  sigemptyset(&term_signal);
-  sigaddset(&term_signal, SIGTERM);
-  sigaddset(&term_signal, SIGINT);
-  pthread_sigmask(SIG_BLOCK, &term_signal, NULL);
-  sigwait(&term_signal, &sig);
+  /* report counters on SIGUSR1, switch debug logging on and off on */
+  /* SIGUSR2, wait for a SIGTERM and exit gracefully                 */
+  for (;;) {
+    sigwait(&term_signal, &sig);
+    if (sig == SIGUSR1) {
+      FtpListenerReport(&ftp_listener);
+    } else if (sig == SIGUSR2) {
+      FtpLogSetLevel((ftp_log_level == LOG_DEBUG) ? opt.log_level : LOG_DEBUG);
+      FtpLog(LOG_WARNING, "log level now %s",
+             FtpLogLevelName(ftp_log_level));
+    } else {
+      break;
+    }
+  }
   if (sig == SIGTERM) {
     FtpLog(LOG_INFO, "SIGTERM received, shutting down\n");
   } else {
@@ -123,9 +284,7 @@ int main(int argc, char *argv[]) {
   exit(0);
 }
 
-static int GetOptions(int argc, char *argv[], int *port,
-                       char **address, int *max_clients,
-                       char **user_name, char **dir_path) {
+static int GetOptions(int argc, char *argv[], Options *opt) {
   int i = 0, num = 0;
   char temp_buf[256];
   char *end_ptr;
@@ -146,7 +305,7 @@ static int GetOptions(int argc, char *argv[], int *port,
           PrintUsage(temp_buf);
           return 0;
         }
-        *port = num;
+        opt->port = num;
       } else if (strcmp(argv[i], "-h") == 0) {
         PrintUsage(NULL);
       } else if (strcmp(argv[i], "-i") == 0) {
@@ -154,30 +313,318 @@ static int GetOptions(int argc, char *argv[], int *port,
           PrintUsage("missing interface");
           return 0;
         }
-        *address = argv[i];
+        opt->address = argv[i];
       } else if (strcmp(argv[i], "-m") == 0) {
         if (++i > argc) {
           PrintUsage("missing number of max clients");
           return 0;
         }
         num = strtol(argv[i], &end_ptr, 0);
-        if ((num < MIN_PORT) || (num > MAX_PORT) || (*end_ptr != '\0')) {
+        if ((num < MIN_NUM_CLIENTS) || (num > MAX_NUM_CLIENTS) ||
+            (*end_ptr != '\0')) {
           snprintf(temp_buf, sizeof(temp_buf),
-                   "port must be a number between %d and %d",
-                   MIN_PORT, MAX_PORT);
+                   "max clients must be a number between %d and %d",
+                   MIN_NUM_CLIENTS, MAX_NUM_CLIENTS);
+          PrintUsage(temp_buf);
+          return 0;
+        }
+        opt->max_clients = num;
+      } else if (strcmp(argv[i], "-s") == 0) {
+        if (++i > argc) {
+          PrintUsage("missing number of listening sockets");
+          return 0;
+        }
+        num = strtol(argv[i], &end_ptr, 0);
+        if ((num < MIN_LISTENER_SHARDS) || (num > MAX_LISTENER_SHARDS) ||
+            (*end_ptr != '\0')) {
+          snprintf(temp_buf, sizeof(temp_buf),
+                   "listening sockets must be a number between %d and %d",
+                   MIN_LISTENER_SHARDS, MAX_LISTENER_SHARDS);
+          PrintUsage(temp_buf);
+          return 0;
+        }
+        opt->shards = num;
+      } else if (strcmp(argv[i], "-e") == 0) {
+        if (++i > argc) {
+          PrintUsage("missing number of event loops");
+          return 0;
+        }
+        num = strtol(argv[i], &end_ptr, 0);
+        if ((num < MIN_EVENT_LOOPS) || (num > MAX_EVENT_LOOPS) ||
+            (*end_ptr != '\0')) {
+          snprintf(temp_buf, sizeof(temp_buf),
+                   "event loops must be a number between %d and %d",
+                   MIN_EVENT_LOOPS, MAX_EVENT_LOOPS);
+          PrintUsage(temp_buf);
+          return 0;
+        }
+        opt->event_loops = num;
+      } else if (strcmp(argv[i], "-w") == 0) {
+        if (++i > argc) {
+          PrintUsage("missing number of worker threads");
+          return 0;
+        }
+        num = strtol(argv[i], &end_ptr, 0);
+        if ((num < MIN_WORKER_THREADS) || (num > MAX_WORKER_THREADS) ||
+            (*end_ptr != '\0')) {
+          snprintf(temp_buf, sizeof(temp_buf),
+                   "worker threads must be a number between %d and %d",
+                   MIN_WORKER_THREADS, MAX_WORKER_THREADS);
+          PrintUsage(temp_buf);
+          return 0;
+        }
+        opt->workers = num;
+      } else if (strcmp(argv[i], "-q") == 0) {
+        if (++i > argc) {
+          PrintUsage("missing worker queue depth");
+          return 0;
+        }
+        num = strtol(argv[i], &end_ptr, 0);
+        if ((num < MIN_WORKER_QUEUE_DEPTH) || (num > MAX_WORKER_QUEUE_DEPTH) ||
+            (*end_ptr != '\0')) {
+          snprintf(temp_buf, sizeof(temp_buf),
+                   "worker queue depth must be a number between %d and %d",
+                   MIN_WORKER_QUEUE_DEPTH, MAX_WORKER_QUEUE_DEPTH);
+          PrintUsage(temp_buf);
+          return 0;
+        }
+        opt->worker_queue_depth = num;
+      } else if ((strcmp(argv[i], "-t") == 0) ||
+                 (strcmp(argv[i], "-T") == 0)) {
+        if (++i > argc) {
+          PrintUsage("missing timeout");
+          return 0;
+        }
+        num = strtol(argv[i], &end_ptr, 0);
+        if ((num < MIN_TIMEOUT) || (num > MAX_TIMEOUT) || (*end_ptr != '\0')) {
+          snprintf(temp_buf, sizeof(temp_buf),
+                   "timeout must be a number between %d and %d",
+                   MIN_TIMEOUT, MAX_TIMEOUT);
+          PrintUsage(temp_buf);
+          return 0;
+        }
+        if (argv[i-1][1] == 't') {
+          opt->idle_timeout = num;
+        } else {
+          opt->transfer_timeout = num;
+        }
+      } else if (strcmp(argv[i], "-c") == 0) {
+        if (++i > argc) {
+          PrintUsage("missing listing cache size");
+          return 0;
+        }
+        num = strtol(argv[i], &end_ptr, 0);
+        if ((num < MIN_LIST_CACHE_SIZE) || (num > MAX_LIST_CACHE_SIZE) ||
+            (*end_ptr != '\0')) {
+          snprintf(temp_buf, sizeof(temp_buf),
+                   "listing cache size must be a number between %d and %d",
+                   MIN_LIST_CACHE_SIZE, MAX_LIST_CACHE_SIZE);
+          PrintUsage(temp_buf);
+          return 0;
+        }
+        opt->list_cache_size = num;
+      } else if (strcmp(argv[i], "-L") == 0) {
+        if (++i > argc) {
+          PrintUsage("missing listing sort limit");
+          return 0;
+        }
+        num = strtol(argv[i], &end_ptr, 0);
+        if ((num < MIN_LIST_SORT_LIMIT) || (num > MAX_LIST_SORT_LIMIT) ||
+            (*end_ptr != '\0')) {
+          snprintf(temp_buf, sizeof(temp_buf),
+                   "listing sort limit must be a number between %d and %d",
+                   MIN_LIST_SORT_LIMIT, MAX_LIST_SORT_LIMIT);
+          PrintUsage(temp_buf);
+          return 0;
+        }
+        opt->list_sort_limit = num;
+      } else if (strcmp(argv[i], "-U") == 0) {
+        opt->list_stream = 1;
+      } else if (strcmp(argv[i], "-M") == 0) {
+        if (++i > argc) {
+          PrintUsage("missing metadata engine");
+          return 0;
+        }
+        if ((strcmp(argv[i], "uring") != 0) &&
+            (strcmp(argv[i], "threads") != 0) &&
+            (strcmp(argv[i], "sync") != 0)) {
+          PrintUsage("metadata engine must be uring, threads or sync");
+          return 0;
+        }
+        opt->stat_engine = argv[i];
+      } else if (strcmp(argv[i], "-l") == 0) {
+        if (++i > argc) {
+          PrintUsage("missing log overflow policy");
+          return 0;
+        }
+        if ((strcmp(argv[i], "drop") != 0) &&
+            (strcmp(argv[i], "block") != 0)) {
+          PrintUsage("log overflow policy must be drop or block");
+          return 0;
+        }
+        opt->log_overflow = argv[i];
+      } else if (strcmp(argv[i], "-v") == 0) {
+        if (++i > argc) {
+          PrintUsage("missing log level");
+          return 0;
+        }
+        num = FtpLogParseLevel(argv[i]);
+        if (num == -1) {
+          PrintUsage("log level must be debug, info, warning or error");
+          return 0;
+        }
+        opt->log_level = num;
+      } else if (strcmp(argv[i], "-a") == 0) {
+        if (++i > argc) {
+          PrintUsage("missing text cache size");
+          return 0;
+        }
+        num = strtol(argv[i], &end_ptr, 0);
+        if ((num < MIN_TEXT_CACHE_SIZE) || (num > MAX_TEXT_CACHE_SIZE) ||
+            (*end_ptr != '\0')) {
+          snprintf(temp_buf, sizeof(temp_buf),
+                   "text cache size must be a number between %d and %d",
+                   MIN_TEXT_CACHE_SIZE, MAX_TEXT_CACHE_SIZE);
+          PrintUsage(temp_buf);
+          return 0;
+        }
+        opt->text_cache_size = num;
+      } else if (strcmp(argv[i], "-A") == 0) {
+        if (++i > argc) {
+          PrintUsage("missing text cache policy");
+          return 0;
+        }
+        if ((strcmp(argv[i], "lru") != 0) && (strcmp(argv[i], "lfu") != 0)) {
+          PrintUsage("text cache policy must be lru or lfu");
+          return 0;
+        }
+        opt->text_cache_policy = argv[i];
+      } else if (strcmp(argv[i], "-x") == 0) {
+        if (++i > argc) {
+          PrintUsage("missing transfer log file");
+          return 0;
+        }
+        opt->xfer_log = argv[i];
+      } else if (strcmp(argv[i], "-X") == 0) {
+        if (++i > argc) {
+          PrintUsage("missing transfer log size");
+          return 0;
+        }
+        num = strtol(argv[i], &end_ptr, 0);
+        if ((num < MIN_XFER_LOG_SIZE) || (num > MAX_XFER_LOG_SIZE) ||
+            (*end_ptr != '\0')) {
+          snprintf(temp_buf, sizeof(temp_buf),
+                   "transfer log size must be a number between %d and %d",
+                   MIN_XFER_LOG_SIZE, MAX_XFER_LOG_SIZE);
+          PrintUsage(temp_buf);
+          return 0;
+        }
+        opt->xfer_log_size = num;
+      } else if (strcmp(argv[i], "-R") == 0) {
+        if (++i > argc) {
+          PrintUsage("missing read ahead");
+          return 0;
+        }
+        num = strtol(argv[i], &end_ptr, 0);
+        if ((num < MIN_READ_AHEAD) || (num > MAX_READ_AHEAD) ||
+            (*end_ptr != '\0')) {
+          snprintf(temp_buf, sizeof(temp_buf),
+                   "read ahead must be a number between %d and %d",
+                   MIN_READ_AHEAD, MAX_READ_AHEAD);
+          PrintUsage(temp_buf);
+          return 0;
+        }
+        opt->read_ahead = num;
+      } else if (strcmp(argv[i], "-D") == 0) {
+        if (++i > argc) {
+          PrintUsage("missing drop behind size");
+          return 0;
+        }
+        num = strtol(argv[i], &end_ptr, 0);
+        if ((num < MIN_DROP_BEHIND_SIZE) || (num > MAX_DROP_BEHIND_SIZE) ||
+            (*end_ptr != '\0')) {
+          snprintf(temp_buf, sizeof(temp_buf),
+                   "drop behind size must be a number between %d and %d",
+                   MIN_DROP_BEHIND_SIZE, MAX_DROP_BEHIND_SIZE);
+          PrintUsage(temp_buf);
+          return 0;
+        }
+        opt->drop_behind_size = num;
+      } else if (strcmp(argv[i], "-f") == 0) {
+        if (++i > argc) {
+          PrintUsage("missing file cache size");
+          return 0;
+        }
+        num = strtol(argv[i], &end_ptr, 0);
+        if ((num < MIN_FILE_CACHE_SIZE) || (num > MAX_FILE_CACHE_SIZE) ||
+            (*end_ptr != '\0')) {
+          snprintf(temp_buf, sizeof(temp_buf),
+                   "file cache size must be a number between %d and %d",
+                   MIN_FILE_CACHE_SIZE, MAX_FILE_CACHE_SIZE);
+          PrintUsage(temp_buf);
+          return 0;
+        }
+        opt->file_cache_size = num;
+      } else if (strcmp(argv[i], "-F") == 0) {
+        if (++i > argc) {
+          PrintUsage("missing biggest cached file");
+          return 0;
+        }
+        num = strtol(argv[i], &end_ptr, 0);
+        if ((num < MIN_FILE_CACHE_MAX_FILE) ||
+            (num > MAX_FILE_CACHE_MAX_FILE) || (*end_ptr != '\0')) {
+          snprintf(temp_buf, sizeof(temp_buf),
+                   "biggest cached file must be a number between %d and %d",
+                   MIN_FILE_CACHE_MAX_FILE, MAX_FILE_CACHE_MAX_FILE);
+          PrintUsage(temp_buf);
+          return 0;
+        }
+        opt->file_cache_max_file = num;
+      } else if (strcmp(argv[i], "-P") == 0) {
+        if (++i > argc) {
+          PrintUsage("missing passive port range");
+          return 0;
+        }
+        num = strtol(argv[i], &end_ptr, 10);
+        if (*end_ptr == '-') {
+          opt->pasv_port_high = strtol(end_ptr + 1, &end_ptr, 10);
+        } else {
+          opt->pasv_port_high = num;
+        }
+        if ((num < MIN_PASV_PORT) || (opt->pasv_port_high < num) ||
+            (opt->pasv_port_high > MAX_PASV_PORT) || (*end_ptr != '\0')) {
+          snprintf(temp_buf, sizeof(temp_buf),
+                   "passive ports must be a range of numbers between %d "
+                   "and %d, e.g. %d-%d", MIN_PASV_PORT, MAX_PASV_PORT,
+                   PASV_PORT_LOW, PASV_PORT_HIGH);
+          PrintUsage(temp_buf);
+          return 0;
+        }
+        opt->pasv_port_low = num;
+      } else if (strcmp(argv[i], "-Q") == 0) {
+        if (++i > argc) {
+          PrintUsage("missing passive socket pool size");
+          return 0;
+        }
+        num = strtol(argv[i], &end_ptr, 0);
+        if ((num < MIN_PASV_POOL_SIZE) || (num > MAX_PASV_POOL_SIZE) ||
+            (*end_ptr != '\0')) {
+          snprintf(temp_buf, sizeof(temp_buf),
+                   "passive socket pool size must be a number between %d "
+                   "and %d", MIN_PASV_POOL_SIZE, MAX_PASV_POOL_SIZE);
           PrintUsage(temp_buf);
           return 0;
         }
-        *max_clients = num;
+        opt->pasv_pool_size = num;
       } else {
         PrintUsage("Unknown option");
         return 0;
       }
     } else {
-      if (*user_name == NULL) {
-        *user_name = argv[i];
-      } else if (*dir_path == NULL) {
-        *dir_path = argv[i];
+      if (opt->user_name == NULL) {
+        opt->user_name = argv[i];
+      } else if (opt->dir_path == NULL) {
+        opt->dir_path = argv[i];
       } else {
         PrintUsage("too many arguments on the command line");
         return 0;
@@ -201,6 +648,84 @@ static void PrintUsage(const char *error) {
           " -i, <IP Address>\n"
           "     Set the interface to listen on (Default: all)\n"
           " -m, <num>\n"
-          "     Set the number of clients allowed at one time (Default: %d)\n",
-          DEFAULT_FTP_PORT, MAX_CLIENTS);
+          "     Set the number of clients allowed at one time (Default: %d)\n"
+          " -s, <num>\n"
+          "     Accept on this many SO_REUSEPORT sockets, each with a thread\n"
+          "     pinned to its own processor (Default: %d)\n"
+          " -e, <num>\n"
+          "     Serve control connections from this many event loop threads,\n"
+          "     0 runs a thread per connection (Default: %d)\n"
+          " -w, <num>\n"
+          "     Pre-spawn this many worker threads to run sessions, or with\n"
+          "     -e the commands that wait on data connections (Default: %d)\n"
+          " -q, <num>\n"
+          "     Set how many connections may wait for a worker before new\n"
+          "     ones are turned away with 421 (Default: %d)\n"
+          " -t, <seconds>\n"
+          "     Drop clients sending no command for this long, 0 to never\n"
+          "     drop them (Default: %d)\n"
+          " -T, <seconds>\n"
+          "     Abort transfers making no progress for this long, 0 to never\n"
+          "     abort them (Default: %d)\n"
+          " -c, <megabytes>\n"
+          "     Keep this much of rendered directory listings to send again\n"
+          "     while the directory is unchanged, 0 to keep none (Default: %d)\n"
+          " -L, <entries>\n"
+          "     Sort listings of bigger directories in runs of this many,\n"
+          "     merged through files in %s, 0 for no limit (Default: %d)\n"
+          " -U\n"
+          "     List directories over the -L limit unsorted instead, as they\n"
+          "     are read (any listing is unsorted with LIST -U or LIST -f)\n"
+          " -M, <engine>\n"
+          "     Look up the files of a listing with io_uring (uring), %d\n"
+          "     helper threads (threads) or one at a time (sync); one that\n"
+          "     is unavailable falls back to the next (Default: %s)\n"
+          " -l, <policy>\n"
+          "     When a thread logs faster than lines can be written, drop\n"
+          "     and count its lines (drop) or make it wait (block)\n"
+          "     (Default: %s)\n"
+          " -v, <level>\n"
+          "     Log only lines of this level or above: debug (which logs\n"
+          "     every command), info, warning or error; SIGUSR2 switches\n"
+          "     between it and debug (Default: %s)\n"
+          " -a, <megabytes>\n"
+          "     Keep this much of text files converted for ASCII transfers\n"
+          "     in %s, to send again while unchanged, 0 to convert\n"
+          "     every time (Default: %d)\n"
+          " -A, <policy>\n"
+          "     Make room in the text cache by dropping the file least\n"
+          "     recently sent (lru) or least often sent (lfu) (Default: %s)\n"
+          " -x, <file>\n"
+          "     Record each transfer in file, in binary; ftpxferlog prints\n"
+          "     it as an xferlog. Its directory must be writable by\n"
+          "     user_name (Default: none)\n"
+          " -X, <megabytes>\n"
+          "     Rotate the transfer log at this size, keeping %d old ones,\n"
+          "     0 to never rotate it (Default: %d)\n"
+          " -R, <megabytes>\n"
+          "     Read this far ahead of a download, 0 to leave it to the\n"
+          "     kernel (Default: %d)\n"
+          " -D, <megabytes>\n"
+          "     Drop what has been sent of files this big from the page\n"
+          "     cache as they download, 0 to never drop it (Default: %d)\n"
+          " -f, <megabytes>\n"
+          "     Keep this much of small files asked for more than once in\n"
+          "     memory, to send again while unchanged, 0 to keep none\n"
+          "     (Default: %d)\n"
+          " -F, <kilobytes>\n"
+          "     Keep files of up to this size in memory (Default: %d)\n"
+          " -P, <low>-<high>\n"
+          "     Make passive data connections to ports in this range\n"
+          "     (Default: %d-%d)\n"
+          " -Q, <num>\n"
+          "     Keep this many passive sockets listening, ready for PASV,\n"
+          "     0 to open one for each PASV (Default: %d)\n",
+          DEFAULT_FTP_PORT, MAX_CLIENTS, LISTENER_SHARDS, EVENT_LOOPS,
+          WORKER_THREADS, WORKER_QUEUE_DEPTH,
+          INACTIVITY_TIMEOUT, TRANSFER_TIMEOUT, LIST_CACHE_SIZE,
+          LIST_SPILL_DIR, LIST_SORT_LIMIT, STAT_THREADS, STAT_ENGINE,
+          LOG_OVERFLOW, LOG_LEVEL, TEXT_CACHE_DIR, TEXT_CACHE_SIZE,
+          TEXT_CACHE_POLICY, XFER_LOG_KEEP, XFER_LOG_SIZE, READ_AHEAD,
+          DROP_BEHIND_SIZE, FILE_CACHE_SIZE, FILE_CACHE_MAX_FILE,
+          PASV_PORT_LOW, PASV_PORT_HIGH, PASV_POOL_SIZE);
 }
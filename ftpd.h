@@ -11,16 +11,153 @@
 #define MIN_PORT 0
 #define MAX_PORT 65535
 
+/* default range of ports passive data connections are made to, e.g. */
+/* the ones a firewall lets through, and bounds on it                */
+#define PASV_PORT_LOW 1024
+#define PASV_PORT_HIGH 65535
+#define MIN_PASV_PORT 1024
+#define MAX_PASV_PORT 65535
+
+/* default number of passive sockets kept listening for each address, */
+/* ready for PASV, and bounds on it                                    */
+#define PASV_POOL_SIZE 8
+#define MIN_PASV_POOL_SIZE 0
+#define MAX_PASV_POOL_SIZE 1024
+
 /* default maximum number of clients */
 #define MAX_CLIENTS 250
 
 /* bounds on command-line specified number of clients */
 #define MIN_NUM_CLIENTS 1
-#define MAX_NUM_CLIENTS 300
+#define MAX_NUM_CLIENTS 65536
+
+/* default number of listening sockets, each with its own accepting */
+/* thread (more than 1 shares the port with SO_REUSEPORT) */
+#define LISTENER_SHARDS 1
+
+/* bounds on command-line specified number of listening sockets */
+#define MIN_LISTENER_SHARDS 1
+#define MAX_LISTENER_SHARDS 256
+
+/* default number of event loop threads serving control connections */
+/* (use 0 to run one thread per connection) */
+#define EVENT_LOOPS 0
+
+/* bounds on command-line specified number of event loops */
+#define MIN_EVENT_LOOPS 0
+#define MAX_EVENT_LOOPS 64
+
+/* default number of pre-spawned worker threads (use 0 to create a */
+/* thread for each connection or blocking command instead) */
+#define WORKER_THREADS 0
+
+/* default number of connections that may wait for a worker */
+#define WORKER_QUEUE_DEPTH 64
+
+/* bounds on command-line specified workers and queue depth */
+#define MIN_WORKER_THREADS 0
+#define MAX_WORKER_THREADS 1024
+#define MIN_WORKER_QUEUE_DEPTH 2
+#define MAX_WORKER_QUEUE_DEPTH 65536
 
 /* timeout (in seconds) before dropping inactive clients */
 #define INACTIVITY_TIMEOUT (15 * 60)
 
+/* timeout (in seconds) before aborting a transfer making no progress */
+#define TRANSFER_TIMEOUT (5 * 60)
+
+/* bounds on command-line specified timeouts (0 disables a timeout) */
+#define MIN_TIMEOUT 0
+#define MAX_TIMEOUT (24 * 60 * 60)
+
+/* default size (in megabytes) of the cache of rendered directory */
+/* listings (use 0 to render every listing) */
+#define LIST_CACHE_SIZE 32
+
+/* bounds on command-line specified listing cache size */
+#define MIN_LIST_CACHE_SIZE 0
+#define MAX_LIST_CACHE_SIZE 4096
+
+/* default number of entries a directory listing sorts in memory; */
+/* bigger directories are sorted in runs spilled to temporary files */
+/* in LIST_SPILL_DIR and merged (use 0 to sort any size in memory)  */
+#define LIST_SORT_LIMIT 65536
+
+/* bounds on command-line specified listing sort limit */
+#define MIN_LIST_SORT_LIMIT 0
+#define MAX_LIST_SORT_LIMIT (64 * 1024 * 1024)
+
+/* where sorted runs of big directory listings go (outside the root) */
+#define LIST_SPILL_DIR "/tmp"
+
+/* default size (in megabytes) of the cache of text files converted */
+/* for ASCII transfers, so later ones are sent with sendfile() (use  */
+/* 0 to convert every time), and which file makes room for another:  */
+/* the least recently sent ("lru") or the least sent ("lfu")         */
+#define TEXT_CACHE_SIZE 0
+#define TEXT_CACHE_POLICY "lru"
+
+/* bounds on command-line specified text cache size */
+#define MIN_TEXT_CACHE_SIZE 0
+#define MAX_TEXT_CACHE_SIZE (1024 * 1024)
+
+/* default size (in megabytes) of the cache of small files kept in */
+/* memory and sent from there while unchanged (use 0 to read every */
+/* time), and the size (in kilobytes) of the biggest file it takes */
+#define FILE_CACHE_SIZE 32
+#define FILE_CACHE_MAX_FILE 64
+
+/* bounds on command-line specified file cache sizes */
+#define MIN_FILE_CACHE_SIZE 0
+#define MAX_FILE_CACHE_SIZE (1024 * 1024)
+#define MIN_FILE_CACHE_MAX_FILE 1
+#define MAX_FILE_CACHE_MAX_FILE 1024
+
+/* where the converted files are kept (outside the root); a tmpfs */
+/* keeps them in memory                                            */
+#define TEXT_CACHE_DIR "/dev/shm"
+
+/* default size (in megabytes) a transfer log is rotated at, and */
+/* how many rotated files are kept (use 0 to never rotate it)     */
+#define XFER_LOG_SIZE 64
+#define XFER_LOG_KEEP 9
+
+/* bounds on command-line specified transfer log size */
+#define MIN_XFER_LOG_SIZE 0
+#define MAX_XFER_LOG_SIZE (1024 * 1024)
+
+/* default megabytes read ahead of a download (use 0 to leave it to */
+/* the kernel; a file is sent up to 16MB at a time, so less does     */
+/* little), and size (in megabytes) from which a download drops what */
+/* it has sent from the page cache, so one big file doesn't push out */
+/* the small ones many clients fetch (use 0 to never drop)           */
+#define READ_AHEAD 16
+#define DROP_BEHIND_SIZE 1024
+
+/* bounds on command-line specified read ahead and drop behind size */
+#define MIN_READ_AHEAD 0
+#define MAX_READ_AHEAD 1024
+#define MIN_DROP_BEHIND_SIZE 0
+#define MAX_DROP_BEHIND_SIZE (1024 * 1024)
+
+/* default way of looking up the metadata of a batch of files:    */
+/* "uring", "threads" (STAT_THREADS helpers) or "sync"; one that    */
+/* is unavailable falls back to the next. Overlapping lookups pays  */
+/* off on storage with latency, such as NFS; on a local disk, doing */
+/* them in turn is as fast                                          */
+#define STAT_ENGINE "sync"
+#define STAT_THREADS 8
+
+/* what becomes of a log line when its thread has logged more than */
+/* the writer has caught up with: "drop" it (counted, and reported  */
+/* on SIGUSR1) or "block" the thread until there is room            */
+#define LOG_OVERFLOW "drop"
+
+/* lines below this level are not logged: "debug" (which includes */
+/* every command received), "info", "warning" or "error"; SIGUSR2  */
+/* switches between it and "debug" while running                   */
+#define LOG_LEVEL "info"
+
 /* README file name (sent automatically as a response to users) */
 #define README_FILE_NAME "README"
 
@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include "ftp_listener.h"
+#include "ftp_log.h"
+
+static int Connect(int port) {
+  struct sockaddr_in addr;
+  int fd;
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((fd == -1) ||
+      (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)) {
+    perror("connect");
+    exit(1);
+  }
+  return fd;
+}
+
+/* read up to the end of a reply, or give up after a few seconds */
+static int ReadReply(int fd, char *buf, int buflen) {
+  struct pollfd pfd;
+  int len, ret;
+
+  len = 0;
+  while ((len == 0) || (buf[len - 1] != '\n')) {
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 5000) != 1) {
+      return 0;
+    }
+    ret = read(fd, buf + len, buflen - len - 1);
+    if (ret <= 0) {
+      return 0;
+    }
+    len += ret;
+  }
+  buf[len] = '\0';
+  return len;
+}
+
+/* one client pipelines NOOPs and never reads a reply, while another on */
+/* the same event loop sends NOOPs one at a time and times each reply; */
+/* the loop must go on answering the second however far the first     */
+/* falls behind                                                        */
+int main(int argc, char *argv[]) {
+  static const char kNoop[] = "NOOP\r\n";
+  FtpListener f;
+  struct sockaddr_in addr;
+  struct timespec start, end;
+  socklen_t addr_len;
+  char buf[4096], flood[64 * 1024];
+  long sent, usec, max_usec, total_usec;
+  int rounds, port, slow_fd, fast_fd, flood_len, i, ret;
+
+  rounds = (argc > 1) ? atoi(argv[1]) : 1000;
+  signal(SIGPIPE, SIG_IGN);
+  FtpLogSetLevel(LOG_WARNING);
+
+  if (!FtpListenerInit(&f, "127.0.0.1", 0, 16, 0, 1)) {
+    return 1;
+  }
+  f.num_event_loops = 1;
+  if (!FtpListenerStart(&f)) {
+    return 1;
+  }
+  addr_len = sizeof(addr);
+  getsockname(f.shards[0].sock_fd, (struct sockaddr *)&addr, &addr_len);
+  port = ntohs(addr.sin_port);
+
+  /* fill the slow client's socket with NOOPs until the server stops */
+  /* taking them, and read nothing back                              */
+  slow_fd = Connect(port);
+  fcntl(slow_fd, F_SETFL, O_NONBLOCK);
+  flood_len = 0;
+  while (flood_len + (int)sizeof(kNoop) - 1 <= (int)sizeof(flood)) {
+    memcpy(flood + flood_len, kNoop, sizeof(kNoop) - 1);
+    flood_len += sizeof(kNoop) - 1;
+  }
+  sent = 0;
+  for (i = 0; i < 100; ++i) {
+    while ((ret = write(slow_fd, flood, flood_len)) > 0) {
+      sent += ret;
+    }
+    usleep(10000);
+  }
+
+  fast_fd = Connect(port);
+  if (!ReadReply(fast_fd, buf, sizeof(buf))) {
+    printf("event loop stalled: no greeting in 5 seconds\n");
+    return 1;
+  }
+  max_usec = total_usec = 0;
+  for (i = 0; i < rounds; ++i) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((write(fast_fd, kNoop, sizeof(kNoop) - 1) != sizeof(kNoop) - 1) ||
+        !ReadReply(fast_fd, buf, sizeof(buf))) {
+      printf("event loop stalled: no reply to NOOP %d in 5 seconds\n", i);
+      return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    usec = (end.tv_sec - start.tv_sec) * 1000000 +
+           (end.tv_nsec - start.tv_nsec) / 1000;
+    total_usec += usec;
+    if (usec > max_usec) {
+      max_usec = usec;
+    }
+  }
+
+  printf("%ld bytes of NOOPs unread by one client; %d NOOPs from another "
+         "answered in %ld us on average, %ld us at most\n", sent, rounds,
+         total_usec / rounds, max_usec);
+  return 0;
+}
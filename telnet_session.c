@@ -4,6 +4,8 @@
 #include <arpa/telnet.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
@@ -19,13 +21,19 @@ enum InputState {
 };
 
 static int MaxInputRead(TelnetSession *t);
+static int SetNonBlocking(int fd);
 static void ProcessData(TelnetSession *t, int wait_flag);
 static void ReadData(TelnetSession *t);
+static void ProcessInput(TelnetSession *t, const char *s, int len);
 static void ProcessInputChar(TelnetSession *t, int c);
+static void AddIncomingSpan(TelnetSession *t, const char *s, int len);
 static void AddIncomingChar(TelnetSession *t, int c);
-static int TakeIncomingChar(TelnetSession *t);
+static int TryLine(TelnetSession *t, char *buf, int buflen, int consume);
+static int TakeLine(TelnetSession *t, char *buf, int buflen, int consume);
+static int OutputSpace(TelnetSession *t);
+static void AddOutgoingSpan(TelnetSession *t, const char *s, int len);
 static void AddOutgoingChar(TelnetSession *t, int c);
-static void WriteData(TelnetSession *t);
+static int WriteData(TelnetSession *t);
 
 void TelnetServerInit(TelnetSession *t, int in, int out) {
   assert(t != NULL);
@@ -36,19 +44,28 @@ void TelnetServerInit(TelnetSession *t, int in, int out) {
   t->in_errno = 0;
   t->in_eof = 0;
   t->in_take = t->in_add = 0;
-  t->in_buflen = 0;
   t->in_status = kNormal;
 
   t->out_fd = out;
   t->out_errno = 0;
   t->out_eof = 0;
   t->out_take = t->out_add = 0;
-  t->out_buflen = 0;
+
+  /* never let a read or write stall the thread; waiting is done in poll() */
+  if (!SetNonBlocking(in)) {
+    t->in_errno = errno;
+  }
+  if ((out != in) && !SetNonBlocking(out)) {
+    t->out_errno = errno;
+  }
 
   ProcessData(t, 0);
 }
 
 void TelnetDestroy(TelnetSession *t) {
+  /* last words (a 221 or 421) go out if the socket will take them */
+  TelnetTryFlush(t);
+
   close(t->in_fd);
   if (t->out_fd != t->in_fd) {
     close(t->out_fd);
@@ -59,141 +76,268 @@ void TelnetDestroy(TelnetSession *t) {
 }
 
 int TelnetPrint(TelnetSession *t, const char *s) {
-  int len, amt_printed;
+  if (!TelnetQueue(t, s)) {
+    return 0;
+  }
+  return TelnetFlush(t);
+}
 
-  len = strlen(s);
-  if (len == 0) {
-    return 1;
+int TelnetPrintLine(TelnetSession *t, const char *s) {
+  if (!TelnetQueueLine(t, s)) {
+    return 0;
   }
+  return TelnetFlush(t);
+}
+
+/* add s to the output without sending it yet, so that several replies */
+/* can leave in one write(); only waits if the buffer fills up          */
+int TelnetQueue(TelnetSession *t, const char *s) {
+  int len, amt_queued, amt_copy;
 
-  amt_printed = 0;
-  do {
+  len = strlen(s);
+
+  amt_queued = 0;
+  while (amt_queued < len) {
     if ((t->out_errno != 0) || (t->out_eof != 0)) {
       return 0;
     }
-    while ((amt_printed < len) && (t->out_buflen < BUF_LEN)) {
-      AddOutgoingChar(t, s[amt_printed]);
-      amt_printed++;
+    amt_copy = OutputSpace(t);
+    if (amt_copy > len - amt_queued) {
+      amt_copy = len - amt_queued;
     }
-    ProcessData(t, 1);
-  } while (amt_printed < len);
-
-  while (t->out_buflen > 0) {
-    if ((t->out_errno != 0) || (t->out_eof != 0)) {
-      return 0;
+    AddOutgoingSpan(t, s + amt_queued, amt_copy);
+    amt_queued += amt_copy;
+    if (amt_queued < len) {
+      ProcessData(t, 1);
     }
-    ProcessData(t, 1);
   }
 
   return 1;
 }
 
-int TelnetPrintLine(TelnetSession *t, const char *s) {
-  if (!TelnetPrint(t, s)) {
+int TelnetQueueLine(TelnetSession *t, const char *s) {
+  if (!TelnetQueue(t, s)) {
     return 0;
   }
-  if (!TelnetPrint(t, "\015\012")) {
-    return 0;
+  return TelnetQueue(t, "\015\012");
+}
+
+/* send everything queued, waiting as long as it takes */
+int TelnetFlush(TelnetSession *t) {
+  while (t->out_add > t->out_take) {
+    if ((t->out_errno != 0) || (t->out_eof != 0)) {
+      return 0;
+    }
+    ProcessData(t, 1);
   }
-  return 1;
+
+  return ((t->out_errno != 0) || (t->out_eof != 0)) ? 0 : 1;
 }
 
 int TelnetReadLine(TelnetSession *t, char *buf, int buflen) {
-  int amt_read;
+  assert(buflen > 1);
 
-  amt_read = 0;
   for (;;) {
     if ((t->in_errno != 0) || (t->in_eof != 0)) {
       return 0;
     }
+    if (TakeLine(t, buf, buflen, 1)) {
+      return 1;
+    }
+    ProcessData(t, 1);
+  }
+}
 
-    while (t->in_buflen > 0) {
-      if (amt_read == buflen-1) {
-        buf[amt_read] = '\0';
-        return 1;
-      }
-      assert(amt_read >= 0);
-      assert(amt_read < buflen);
+/* read the next line if one can be had without waiting, returns 1 if */
+/* a line was copied, 0 on error or EOF, TELNET_WOULD_BLOCK otherwise  */
+int TelnetTryReadLine(TelnetSession *t, char *buf, int buflen) {
+  return TryLine(t, buf, buflen, 1);
+}
 
-      buf[amt_read] = TakeIncomingChar(t);
+/* as TelnetTryReadLine(), but leave the line in the input buffer */
+int TelnetPeekLine(TelnetSession *t, char *buf, int buflen) {
+  return TryLine(t, buf, buflen, 0);
+}
 
-      if (buf[amt_read] == '\012') {
-        assert(amt_read + 1 >= 0);
-        assert(amt_read + 1 < buflen);
+/* as TelnetQueue(), but never waits: when the buffer fills, sends what */
+/* the socket will take right now; returns 1 once all of s is queued, 0 */
+/* on error, TELNET_WOULD_BLOCK if the socket won't take enough to make */
+/* room for the rest (which is not queued)                              */
+int TelnetTryQueue(TelnetSession *t, const char *s) {
+  int len, amt_queued, amt_copy;
 
-        buf[amt_read+1] = '\0';
-        return 1;
-      }
-      amt_read++;
+  len = strlen(s);
+
+  amt_queued = 0;
+  while (amt_queued < len) {
+    if ((t->out_errno != 0) || (t->out_eof != 0)) {
+      return 0;
     }
+    amt_copy = OutputSpace(t);
+    if (amt_copy > len - amt_queued) {
+      amt_copy = len - amt_queued;
+    }
+    AddOutgoingSpan(t, s + amt_queued, amt_copy);
+    amt_queued += amt_copy;
+    if ((amt_queued < len) && !WriteData(t)) {
+      return TELNET_WOULD_BLOCK;
+    }
+  }
 
-    ProcessData(t, 1);
+  return 1;
+}
+
+int TelnetTryQueueLine(TelnetSession *t, const char *s) {
+  int ret;
+
+  ret = TelnetTryQueue(t, s);
+  if (ret != 1) {
+    return ret;
   }
+  return TelnetTryQueue(t, "\015\012");
 }
 
-/* receive any incoming data, send any pending data */
-static void ProcessData(TelnetSession *t, int wait_flag) {
-  fd_set read_fds;
-  fd_set write_fds;
-  fd_set except_fds;
-  struct timeval tv_zero;
-  struct timeval *tv;
-
-  FD_ZERO(&read_fds);
-  FD_ZERO(&write_fds);
-  FD_ZERO(&except_fds);
-
-  if (wait_flag) {
-    tv = NULL;
-  } else {
-    tv_zero.tv_sec = 0;
-    tv_zero.tv_usec = 0;
-    tv = &tv_zero;
+/* room for more output without waiting, after sending what the socket */
+/* will take if the buffer is short of min_space                       */
+int TelnetOutputRoom(TelnetSession *t, int min_space) {
+  while ((OutputSpace(t) < min_space) && (t->out_errno == 0) &&
+         (t->out_eof == 0) && WriteData(t)) {
+  }
+  return OutputSpace(t);
+}
+
+/* send pending output without waiting, returns 1 once it is all sent, */
+/* 0 on error, TELNET_WOULD_BLOCK if the socket can't take it all yet  */
+int TelnetTryFlush(TelnetSession *t) {
+  while (t->out_add > t->out_take) {
+    if ((t->out_errno != 0) || (t->out_eof != 0)) {
+      return 0;
+    }
+    if (!WriteData(t)) {
+      return TELNET_WOULD_BLOCK;
+    }
+  }
+  return ((t->out_errno != 0) || (t->out_eof != 0)) ? 0 : 1;
+}
+
+/* shared by the non-blocking line readers: reads whatever is available */
+/* without waiting if no whole line is buffered yet                     */
+static int TryLine(TelnetSession *t, char *buf, int buflen, int consume) {
+  int polled;
+
+  assert(buflen > 1);
+
+  polled = 0;
+  for (;;) {
+    if ((t->in_errno != 0) || (t->in_eof != 0)) {
+      return 0;
+    }
+    if (TakeLine(t, buf, buflen, consume)) {
+      return 1;
+    }
+    if (polled) {
+      return TELNET_WOULD_BLOCK;
+    }
+
+    ProcessData(t, 0);
+    polled = 1;
   }
+}
+
+/* receive any incoming data, send any pending data; poll() has no limit */
+/* on descriptor numbers, unlike select() with its FD_SETSIZE             */
+static void ProcessData(TelnetSession *t, int wait_flag) {
+  struct pollfd fds[2];
+  int nfds, in, out;
+
+  nfds = 0;
+  in = out = -1;
 
   /* Checks for input if we can accept input */
   if ((t->in_errno == 0) && (t->in_eof == 0) && (MaxInputRead(t) > 0)) {
-    FD_SET(t->in_fd, &read_fds);
-    FD_SET(t->in_fd, &except_fds);
+    in = nfds++;
+    fds[in].fd = t->in_fd;
+    fds[in].events = POLLIN;
   }
 
   /* Checks for output if we have pending output */
-  if ((t->out_errno == 0) && (t->out_eof == 0) && (t->out_buflen > 0)) {
-    FD_SET(t->out_fd, &write_fds);
-    FD_SET(t->out_fd, &except_fds);
+  if ((t->out_errno == 0) && (t->out_eof == 0) && (t->out_add > t->out_take)) {
+    if ((in != -1) && (t->out_fd == t->in_fd)) {
+      out = in;
+      fds[out].events |= POLLOUT;
+    } else {
+      out = nfds++;
+      fds[out].fd = t->out_fd;
+      fds[out].events = POLLOUT;
+    }
+  }
+
+  /* nothing we could wait for */
+  if (nfds == 0) {
+    return;
   }
 
-  /* See if there's anything to do */
-  if (select(FD_SETSIZE, &read_fds, &write_fds, &except_fds, tv) > 0) {
-    if (FD_ISSET(t->in_fd, &except_fds)) {
-      t->in_eof = 1;
-    } else if (FD_ISSET(t->in_fd, &read_fds)) {
+  /* See if there's anything to do; errors and hang-ups are picked */
+  /* up by the read() or write() that follows                      */
+  if (poll(fds, nfds, wait_flag ? -1 : 0) > 0) {
+    if ((in != -1) && (fds[in].revents & (POLLIN | POLLHUP | POLLERR))) {
       ReadData(t);
     }
-    if (FD_ISSET(t->out_fd, &except_fds)) {
-      t->out_eof = 1;
-    } else if (FD_ISSET(t->out_fd, &write_fds)) {
+    if ((out != -1) && (fds[out].revents & (POLLOUT | POLLHUP | POLLERR))) {
       WriteData(t);
     }
   }
 }
 
 static void ReadData(TelnetSession *t) {
-  int read_ret, i = 0;
+  int read_ret;
   char buf[BUF_LEN];
 
   /* read as much data as we have buffer space for */
   assert(MaxInputRead(t) <= BUF_LEN);
   read_ret = read(t->in_fd, buf, MaxInputRead(t));
 
-  /* handle three possible read results */
+  /* handle three possible read results; a spurious wakeup just */
+  /* means going back to poll() */
   if (read_ret == -1) {
-    t->in_errno = errno;
+    if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+      t->in_errno = errno;
+    }
   } else if (read_ret == 0) {
     t->in_eof = 1;
   } else {
-    for (i = 0; i < read_ret; ++i) {
-      ProcessInputChar(t, (unsigned char)buf[i]);
+    ProcessInput(t, buf, read_ret);
+  }
+}
+
+/* process a block of input, copying runs of plain characters whole */
+/* and only stepping through telnet commands and line ends one by one */
+static void ProcessInput(TelnetSession *t, const char *s, int len) {
+  const char *end, *iac, *stop, *cr;
+
+  end = s + len;
+
+  /* in the usual case there is no IAC at all, and each run */
+  /* is found with a single memchr() for the CR ending it   */
+  iac = memchr(s, IAC, len);
+  while (s < end) {
+    if (t->in_status != kNormal) {
+      ProcessInputChar(t, (unsigned char)*s++);
+      continue;
+    }
+    if ((iac != NULL) && (iac < s)) {
+      iac = memchr(s, IAC, end - s);
+    }
+    stop = (iac != NULL) ? iac : end;
+    cr = memchr(s, '\015', stop - s);
+    if (cr != NULL) {
+      stop = cr;
+    }
+
+    AddIncomingSpan(t, s, stop - s);
+    s = stop;
+    if (s < end) {
+      ProcessInputChar(t, (unsigned char)*s++);
     }
   }
 }
@@ -259,118 +403,136 @@ static void ProcessInputChar(TelnetSession *t, int c) {
   }
 }
 
-/* add a single character, wrapping buffer if necessary (should never occur) */
+/* append to the input, which MaxInputRead() made sure has room */
+static void AddIncomingSpan(TelnetSession *t, const char *s, int len) {
+  assert(t->in_add + len <= BUF_LEN);
+
+  memcpy(t->in_buf + t->in_add, s, len);
+  t->in_add += len;
+}
+
+/* add a single character of a telnet command */
 static void AddIncomingChar(TelnetSession *t, int c) {
-  assert(t->in_add >= 0);
-  assert(t->in_add < BUF_LEN);
+  char ch = c;
 
-  t->in_buf[t->in_add] = c;
-  t->in_add++;
-  if (t->in_add == BUF_LEN) {
-    t->in_add = 0;
+  AddIncomingSpan(t, &ch, 1);
+}
+
+/* copy the next line (or as much of it as fits) into buf, returns 0 */
+/* if the line isn't complete yet */
+static int TakeLine(TelnetSession *t, char *buf, int buflen, int consume) {
+  int avail, len;
+  char *nl;
+
+  avail = t->in_add - t->in_take;
+  len = (avail < buflen - 1) ? avail : buflen - 1;
+
+  nl = memchr(t->in_buf + t->in_take, '\012', len);
+  if (nl != NULL) {
+    len = nl - (t->in_buf + t->in_take) + 1;
+  } else if ((len < buflen - 1) && (avail < BUF_LEN - 1)) {
+    /* wait for the rest, unless the buffer can't take any more */
+    return 0;
   }
 
-  if (t->in_buflen == BUF_LEN) {
-    t->in_take++;
-    if (t->in_take == BUF_LEN) {
-      t->in_take = 0;
+  memcpy(buf, t->in_buf + t->in_take, len);
+  buf[len] = '\0';
+
+  if (consume) {
+    t->in_take += len;
+    if (t->in_take == t->in_add) {
+      t->in_take = t->in_add = 0;
     }
-  } else {
-    t->in_buflen++;
   }
+
+  return 1;
 }
 
-/* remove a single character */
-static int TakeIncomingChar(TelnetSession *t) {
-  int c;
+/* room left at the end of the output buffer, after moving pending */
+/* output to its start */
+static int OutputSpace(TelnetSession *t) {
+  if (t->out_take > 0) {
+    memmove(t->out_buf, t->out_buf + t->out_take, t->out_add - t->out_take);
+    t->out_add -= t->out_take;
+    t->out_take = 0;
+  }
 
-  assert(t->in_take >= 0);
-  assert(t->in_take < BUF_LEN);
+  return BUF_LEN - t->out_add;
+}
 
-  c = t->in_buf[t->in_take];
-  t->in_take++;
-  if (t->in_take == BUF_LEN) {
-    t->in_take = 0;
-  }
-  t->in_buflen--;
+static void AddOutgoingSpan(TelnetSession *t, const char *s, int len) {
+  assert(t->out_add + len <= BUF_LEN);
 
-  return c;
+  memcpy(t->out_buf + t->out_add, s, len);
+  t->out_add += len;
 }
 
-/* add a single character, hopefully will never happen :) */
+/* add a single character of a telnet reply */
 static void AddOutgoingChar(TelnetSession *t, int c) {
-  assert(t->out_add >= 0);
-  assert(t->out_add < BUF_LEN);
-
-  t->out_buf[t->out_add] = c;
-  t->out_add++;
-  if (t->out_add == BUF_LEN) {
-    t->out_add = 0;
-  }
+  char ch = c;
 
-  if (t->out_buflen == BUF_LEN) {
-    t->out_take++;
-    if (t->out_take == BUF_LEN) {
-      t->out_take = 0;
-    }
-  } else {
-    t->out_buflen++;
-  }
+  AddOutgoingSpan(t, &ch, 1);
 }
 
-static void WriteData(TelnetSession *t) {
+/* returns 0 if the socket can't take anything right now */
+static int WriteData(TelnetSession *t) {
   int write_ret;
 
-  if (t->out_take < t->out_add) {
-    /* handle a buffer that looks like this:       */
-    /*     |-- empty --|-- data --|-- empty --|    */
-    assert(t->out_take >= 0);
-    assert(t->out_take < BUF_LEN);
-    assert(t->out_buflen > 0);
-    assert(t->out_buflen + t->out_take <= BUF_LEN);
-    write_ret = write(t->out_fd, t->out_buf + t->out_take, t->out_buflen);
-  } else {
-    /* handle a buffer that looks like this:       */
-    /*     |-- data --|-- empty --|-- data --|     */
-    assert(t->out_take >= 0);
-    assert(t->out_take < BUF_LEN);
-    assert((BUF_LEN - t->out_take) > 0);
-    write_ret = write(t->out_fd, t->out_buf + t->out_take,
-                      BUF_LEN - t->out_take);
-  }
+  /* the pending output is always contiguous */
+  assert(t->out_add > t->out_take);
+  write_ret = write(t->out_fd, t->out_buf + t->out_take,
+                    t->out_add - t->out_take);
 
   /* handle three possible write results */
   if (write_ret == -1) {
-    t->out_errno = errno;
+    if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+      return 0;
+    }
+    if (errno != EINTR) {
+      t->out_errno = errno;
+    }
   } else if (write_ret == 0) {
     t->out_eof = 1;
   } else {
-    t->out_buflen -= write_ret;
     t->out_take += write_ret;
-    if (t->out_take >= BUF_LEN) {
-      t->out_take -= BUF_LEN;
+    if (t->out_take == t->out_add) {
+      t->out_take = t->out_add = 0;
     }
   }
+  return 1;
+}
+
+static int SetNonBlocking(int fd) {
+  int flags;
+
+  flags = fcntl(fd, F_GETFL);
+  if (flags == -1) {
+    return 0;
+  }
+  return (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0);
 }
 
 /* Returnes the amount of a read */
 static int MaxInputRead(TelnetSession *t) {
   int max_in, max_out;
 
-  /* figure out how much space is available in the input buffer */
-  if (t->in_buflen < BUF_LEN) {
-    max_in = BUF_LEN - t->in_buflen;
-  } else {
-    max_in = 0;
+  /* figure out how much space is available in the input buffer, */
+  /* moving what's left of the last read to the front first      */
+  if (t->in_take > 0) {
+    memmove(t->in_buf, t->in_buf + t->in_take, t->in_add - t->in_take);
+    t->in_add -= t->in_take;
+    t->in_take = 0;
   }
+  max_in = BUF_LEN - t->in_add;
 
-  /* worry about space in the output buffer (for DONT/WONT replies) */
-  if (t->out_buflen < BUF_LEN) {
-    max_out = BUF_LEN - t->out_buflen;
-  } else {
-    max_out = 0;
+  /* a pending CR turns the next character into two */
+  if ((t->in_status == kCR) && (max_in > 0)) {
+    max_in--;
   }
 
+  /* worry about space in the output buffer (for DONT/WONT replies) */
+  max_out = OutputSpace(t);
+
   /* return the minimum of the two values */
   return (max_in < max_out) ? max_in : max_out;
 }
@@ -429,3 +591,159 @@ int main() {
 }
 #endif /* STUB_TEST */
 
+
+#ifdef TELNET_BENCHMARK
+/* compares the span based buffering above with the old per-byte ring */
+/* buffer, without sockets: input is fed straight into ProcessInput()  */
+/* and replies are appended to the output buffer and then dropped      */
+#include <time.h>
+
+typedef struct {
+  int take, add, buflen;
+  char buf[BUF_LEN];
+} LegacyRing;
+
+static void LegacyAdd(LegacyRing *r, int c) {
+  r->buf[r->add++] = c;
+  if (r->add == BUF_LEN) {
+    r->add = 0;
+  }
+  r->buflen++;
+}
+
+static int LegacyTake(LegacyRing *r) {
+  int c;
+
+  c = r->buf[r->take++];
+  if (r->take == BUF_LEN) {
+    r->take = 0;
+  }
+  r->buflen--;
+  return c;
+}
+
+/* the old kNormal/kCR handling, one character at a time */
+static void LegacyInput(LegacyRing *r, int *cr, const char *s, int len) {
+  int i, c;
+
+  for (i = 0; i < len; ++i) {
+    c = (unsigned char)s[i];
+    if (*cr) {
+      LegacyAdd(r, '\012');
+      if (c != '\012') {
+        LegacyAdd(r, c);
+      }
+      *cr = 0;
+    } else if (c == '\015') {
+      *cr = 1;
+    } else {
+      LegacyAdd(r, c);
+    }
+  }
+}
+
+static int LegacyReadLine(LegacyRing *r, char *buf, int buflen) {
+  int amt_read;
+
+  for (amt_read = 0; r->buflen > 0 && amt_read < buflen - 1; ) {
+    buf[amt_read] = LegacyTake(r);
+    if (buf[amt_read++] == '\012') {
+      buf[amt_read] = '\0';
+      return 1;
+    }
+  }
+  buf[amt_read] = '\0';
+  return 0;
+}
+
+static double Elapsed(struct timespec *start) {
+  struct timespec end;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+  static const char *commands[] = {
+    "NOOP\r\n",
+    "LIST /pub/mirrors/debian/dists/stable/main/binary-amd64\r\n",
+    "SIZE /pub/mirrors/debian/ls-lR.gz\r\n",
+    "TYPE I\r\n",
+    "RETR /pub/mirrors/debian/dists/stable/main/Contents-amd64.gz\r\n",
+  };
+  static const char *reply =
+    "213-Status follows: this is a reasonably long reply line\r\n";
+  TelnetSession t;
+  LegacyRing r;
+  char input[BUF_LEN / 2], line[BUF_LEN];
+  struct timespec start;
+  long i, iterations, lines, bytes;
+  int len, cr, n, k;
+  double legacy_in, span_in, legacy_out, span_out;
+
+  iterations = (argc > 1) ? atol(argv[1]) : 200000;
+
+  /* a chunk of pipelined commands, as a single read() would return it */
+  len = 0;
+  for (k = 0; len + strlen(commands[k % 5]) < sizeof(input); ++k) {
+    memcpy(input + len, commands[k % 5], strlen(commands[k % 5]));
+    len += strlen(commands[k % 5]);
+  }
+
+  memset(&t, 0, sizeof(t));
+  t.in_status = kNormal;
+  lines = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < iterations; ++i) {
+    MaxInputRead(&t);
+    ProcessInput(&t, input, len);
+    while (TakeLine(&t, line, sizeof(line), 1)) {
+      lines++;
+    }
+  }
+  span_in = Elapsed(&start);
+
+  memset(&r, 0, sizeof(r));
+  cr = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < iterations; ++i) {
+    LegacyInput(&r, &cr, input, len);
+    while (LegacyReadLine(&r, line, sizeof(line))) {
+      lines--;
+    }
+  }
+  legacy_in = Elapsed(&start);
+  assert(lines == 0);
+
+  n = strlen(reply);
+  bytes = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < iterations * 16; ++i) {
+    if (OutputSpace(&t) < n) {
+      bytes += t.out_add;
+      t.out_take = t.out_add = 0;
+    }
+    AddOutgoingSpan(&t, reply, n);
+  }
+  span_out = Elapsed(&start);
+
+  memset(&r, 0, sizeof(r));
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < iterations * 16; ++i) {
+    if (r.buflen + n > BUF_LEN) {
+      bytes -= r.buflen;
+      r.take = r.add = r.buflen = 0;
+    }
+    for (k = 0; k < n; ++k) {
+      LegacyAdd(&r, reply[k]);
+    }
+  }
+  legacy_out = Elapsed(&start);
+
+  printf("input:  %d bytes x %ld, per-byte %.3fs, span %.3fs (%.1fx)\n",
+         len, iterations, legacy_in, span_in, legacy_in / span_in);
+  printf("output: %d bytes x %ld, per-byte %.3fs, span %.3fs (%.1fx)\n",
+         n, iterations * 16, legacy_out, span_out, legacy_out / span_out);
+  return (bytes == 0) ? 0 : 1;
+}
+#endif /* TELNET_BENCHMARK */
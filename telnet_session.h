@@ -3,6 +3,9 @@
 
 #define BUF_LEN 2048
 
+/* returned by the non-blocking calls when they would have to wait */
+#define TELNET_WOULD_BLOCK (-1)
+
 /* information on a telnet session */
 typedef struct {
     int in_fd;
@@ -11,7 +14,6 @@ typedef struct {
     int in_take;
     int in_add;
     char in_buf[BUF_LEN];
-    int in_buflen;
 
     int in_status;
 
@@ -21,15 +23,23 @@ typedef struct {
     int out_take;
     int out_add;
     char out_buf[BUF_LEN];
-    int out_buflen;
 } TelnetSession;
 
 /* functions */
-void TelnetInit(TelnetSession *t, int in, int out);
+void TelnetServerInit(TelnetSession *t, int in, int out);
 void TelnetDestroy(TelnetSession *t);
 int TelnetPrint(TelnetSession *t, const char *s);
 int TelnetPrintLine(TelnetSession *t, const char *s);
+int TelnetQueue(TelnetSession *t, const char *s);
+int TelnetQueueLine(TelnetSession *t, const char *s);
+int TelnetFlush(TelnetSession *t);
 int TelnetReadLine(TelnetSession *t, char *buf, int buflen);
+int TelnetTryReadLine(TelnetSession *t, char *buf, int buflen);
+int TelnetPeekLine(TelnetSession *t, char *buf, int buflen);
+int TelnetTryQueue(TelnetSession *t, const char *s);
+int TelnetTryQueueLine(TelnetSession *t, const char *s);
+int TelnetTryFlush(TelnetSession *t);
+int TelnetOutputRoom(TelnetSession *t, int min_space);
 
 #endif /* TELNET_SERVER_H */
 